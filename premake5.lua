@@ -17,3 +17,6 @@ workspace "Language"
       filter "configurations:Release"
          defines { "NDEBUG" }
          optimize "On"
+
+      filter "system:linux"
+         links { "pthread" }
@@ -0,0 +1,1038 @@
+#pragma once
+
+enum struct opcode {
+	unknown = 0,
+	push_i64,		// a: value
+	push_f64,		// a: bit pattern of the value
+	push_i32,		// a: value
+	push_u8,		// a: value
+	push_string,	// a: string index
+	push_const,		// a: constant index
+	push_fn,		// a: function index
+	make_closure,	// a: function index, b: capture count, the captured values are on the stack in order
+	push_this,
+	load_local,		// a: slot
+	store_local,	// a: slot, the stored value stays on the stack
+	load_global,	// a: global index
+	store_global,	// a: global index
+	load_capture,	// a: index into the captures of the running closure
+	get_member,		// a: string index
+	set_member,		// a: string index, stack: object, value -> value
+	pop,
+	add,
+	sub,
+	mul,
+	div,
+	add_i64,
+	sub_i64,
+	mul_i64,
+	div_i64,
+	add_f64,
+	sub_f64,
+	mul_f64,
+	div_f64,
+	wrap_i32,		// Truncates the i64 result of an operation on two i32 values back to i32
+	wrap_u8,
+	cmp_eq,
+	cmp_lt,
+	cmp_gt,
+	cmp_lte,
+	cmp_gte,
+	cmp_eq_i64,
+	cmp_lt_i64,
+	cmp_gt_i64,
+	cmp_lte_i64,
+	cmp_gte_i64,
+	cmp_eq_f64,
+	cmp_lt_f64,
+	cmp_gt_f64,
+	cmp_lte_f64,
+	cmp_gte_f64,
+	jump,			// a: target
+	jump_if_false,	// a: target, pops the condition
+	call,			// a: function index, b: argument count
+	call_value,		// b: argument count, the called value sits below the arguments
+	call_builtin,	// a: builtin index, b: argument count
+	new_object,		// a: object init index, b: value count
+	new_frame_object,	// a: object init index, b: slot of the local, reuses the frame owned object already in it
+	spawn,			// a: function index, b: argument count
+	spawn_value,	// b: argument count, the spawned value sits below the arguments
+	next,			// a: target once the generator is exhausted, pops the generator and resumes it
+	yield,			// Pops the value, suspends the generator and pushes the value to the frame that resumed it
+	new_array,		// b: element count
+	get_index,		// stack: array, index -> value
+	set_index,		// stack: array, index, value -> value
+	ret,
+};
+
+struct instruction {
+	opcode op;
+	i64 a;
+	i64 b;
+};
+
+struct function_proto {
+	std::string name;
+	i64 index;
+	std::vector<argument_decl> args;
+	std::vector<std::string> locals;	// Slot names, arguments come first
+	std::vector<std::string> captures;	// Names of the values a closure copies from its surroundings
+	std::vector<instruction> code;
+	bool generator = false;	// Contains 'yield', calling it creates a generator instead of running the body
+};
+
+struct object_shape {
+	std::string name;
+	std::vector<std::string> members;
+};
+
+// Members given in an object initializer, in the order their values are pushed.
+struct object_init_desc {
+	std::string type;
+	std::vector<std::string> members;
+};
+
+// A 'const' binding. Its initializer is compiled to a function that evaluate_constants runs once the program is
+// compiled. The result is stored as the operands of a push instruction, one per element for arrays.
+struct constant_decl {
+	std::string name;
+	i64 init = -1;	// Function computing the value
+	opcode push = opcode::unknown;	// push_i64, push_f64, push_i32, push_u8 or push_string
+	bool is_array = false;
+	std::vector<i64> operands;
+};
+
+struct global_decl {
+	std::string name;
+	i64 function;	// Index of the function, -1 for enums
+	i64 enum_type;	// Index into program::enums, -1 for functions
+};
+
+// FNV-1a, never 0 so a string_ref can use 0 for a hash that isn't computed yet.
+constexpr uint64_t hash_string(std::string_view s) {
+	uint64_t h = 14695981039346656037ull;
+	for (char c : s) {
+		h = (h ^ (uint8_t)c) * 1099511628211ull;
+	}
+	return h ? h : 1;
+}
+
+struct eval_context;
+struct value;
+
+using internal_function = std::function<void(eval_context&, std::vector<value>)>;
+
+// Everything the VM needs to run a library, no references back into the ast.
+// Never modified once loaded, so any number of VMs on any threads can share one program.
+struct program {
+	std::vector<function_proto> functions;
+	std::vector<std::string> strings;
+	std::vector<uint64_t> string_hashes;	// hash_string of every constant, strings loaded from them never hash again
+	std::vector<object_shape> object_types;
+	std::vector<enum_def> enums;
+	std::vector<object_init_desc> object_inits;
+	std::vector<constant_decl> constants;
+	std::vector<std::string> builtins;
+	std::vector<internal_function> natives;	// Implementations of 'builtins', linked by load_program
+	std::vector<global_decl> globals;
+};
+
+// Where the object built by 'let x = T { ... }' lives. Objects go to the heap unless the local holding them
+// provably never lets them leave the frame.
+enum struct object_storage {
+	heap,
+	frame,		// Besides member access only passed to print or println, each site reuses one object owned by the frame
+	scalars,	// Only its members are used, they become locals 'x.member' and no object is built
+};
+
+// What one function body does with its locals. Nested lambdas are scanned on their own.
+struct escape_scan {
+	std::unordered_map<std::string, i64> declarations;	// Arguments, lets and for loop variables
+	std::unordered_map<std::string, const ast_node*> candidates;	// Lets initialized with a new object
+	std::unordered_map<std::string, bool> escapes;	// Locals used as a value, false if they're only printed
+	std::unordered_set<std::string> used;	// Every name referenced, by the first element of its path
+	std::vector<const lambda*> nested;
+	bool generator = false;
+	bool spawns = false;
+};
+
+void scan_escapes(escape_scan& scan, const ast_node* node, const std::unordered_map<std::string, i64>& globals) {
+	auto scan_child = [&](const ast_node* child) {
+		if (child) {
+			scan_escapes(scan, child, globals);
+		}
+	};
+	auto root = [](const std::string& name) { return name.substr(0, name.find('.')); };
+
+	switch (node->type) {
+		case ast_node_type::symbol:
+		{
+			// Only a member access keeps the object itself out of reach.
+			scan.used.insert(root(node->as_symbol));
+			if (root(node->as_symbol) == node->as_symbol) {
+				scan.escapes[node->as_symbol] = true;
+			}
+			break;
+		}
+		case ast_node_type::bin_op:
+		{
+			scan_child(node->as_bin_op.lhs);
+			scan_child(node->as_bin_op.rhs);
+			break;
+		}
+		case ast_node_type::comparison:
+		{
+			scan_child(node->as_comparison.lhs);
+			scan_child(node->as_comparison.rhs);
+			break;
+		}
+		case ast_node_type::sequence:
+		case ast_node_type::array:
+		{
+			for (auto& s : node->as_sequence) {
+				scan_child(s);
+			}
+			// The last expression of a block is its value, a 'let' there hands out its object.
+			if (node->type == ast_node_type::sequence && !node->as_sequence.empty() && node->as_sequence.back()->type == ast_node_type::initialize) {
+				scan.escapes[node->as_sequence.back()->as_initialize.symbol.name] = true;
+			}
+			break;
+		}
+		case ast_node_type::call:
+		case ast_node_type::spawn:
+		{
+			auto& c = node->as_call;
+			scan.spawns = scan.spawns || node->type == ast_node_type::spawn;
+			scan.used.insert(root(c.target));
+			if (root(c.target) == c.target) {
+				scan.escapes[c.target] = true;
+			}
+			// The print builtins only read their arguments while they run.
+			bool reads = node->type == ast_node_type::call && (c.target == "print" || c.target == "println") && !globals.count(c.target) && !scan.declarations.count(c.target);
+			for (auto& arg : c.args) {
+				if (reads && arg->type == ast_node_type::symbol && root(arg->as_symbol) == arg->as_symbol) {
+					scan.used.insert(arg->as_symbol);
+					scan.escapes.emplace(arg->as_symbol, false);
+				}
+				else {
+					scan_child(arg);
+				}
+			}
+			break;
+		}
+		case ast_node_type::lambda:
+		{
+			scan.nested.push_back(&node->as_lambda);
+			break;
+		}
+		case ast_node_type::initialize:
+		{
+			auto& name = node->as_initialize.symbol.name;
+			scan_child(node->as_initialize.value);
+			scan.declarations[name]++;
+			if (!node->as_initialize.is_const && node->as_initialize.value->type == ast_node_type::object_init) {
+				scan.candidates[name] = node;
+			}
+			break;
+		}
+		case ast_node_type::assign:
+		{
+			auto& target = node->as_assign.symbol;
+			scan.used.insert(root(target));
+			if (root(target) == target) {
+				scan.escapes[target] = true;
+			}
+			scan_child(node->as_assign.value);
+			break;
+		}
+		case ast_node_type::conditional:
+		{
+			scan_child(node->as_if.condition);
+			scan_child(node->as_if.scope);
+			scan_child(node->as_if.else_scope);
+			break;
+		}
+		case ast_node_type::loop:
+		{
+			scan_child(node->as_loop.condition);
+			if (node->as_loop.type == loop_type::loop_for) {
+				scan.declarations[node->as_loop.symbol]++;
+			}
+			scan_child(node->as_loop.scope);
+			break;
+		}
+		case ast_node_type::yield:
+		{
+			scan.generator = true;
+			scan_child(node->as_yield);
+			break;
+		}
+		case ast_node_type::index:
+		case ast_node_type::index_assign:
+		{
+			scan_child(node->as_index.target);
+			scan_child(node->as_index.index);
+			scan_child(node->as_index.value);
+			break;
+		}
+		case ast_node_type::object_init:
+		{
+			for (auto& [name, value] : node->as_object_init.initial_values) {
+				scan_child(value);
+			}
+			break;
+		}
+		default:
+		{
+			break;
+		}
+	}
+}
+
+escape_scan scan_escapes(const lambda& l, const std::unordered_map<std::string, i64>& globals) {
+	escape_scan scan;
+	for (auto& arg : l.args) {
+		scan.declarations[arg.name]++;
+	}
+	scan_escapes(scan, l.scope, globals);
+	return scan;
+}
+
+// Names a lambda uses without declaring them, including those its own nested lambdas need.
+std::vector<std::string> free_names(const lambda& l, const std::unordered_map<std::string, i64>& globals) {
+	auto scan = scan_escapes(l, globals);
+	std::unordered_set<std::string> names;
+	for (auto& name : scan.used) {
+		if (!scan.declarations.count(name)) {
+			names.insert(name);
+		}
+	}
+	for (auto& nested : scan.nested) {
+		for (auto& name : free_names(*nested, globals)) {
+			if (!scan.declarations.count(name)) {
+				names.insert(name);
+			}
+		}
+	}
+	std::vector<std::string> sorted(names.begin(), names.end());
+	std::sort(sorted.begin(), sorted.end());
+	return sorted;
+}
+
+// Objects whose initializer gives every member once and whose local is declared once can leave the heap.
+std::unordered_map<std::string, object_storage> object_storages(const escape_scan& scan, const program& prog, const std::unordered_map<std::string, i64>& globals) {
+	// Closures copy the objects they capture, those have to stay real values.
+	std::unordered_set<std::string> captured;
+	for (auto& nested : scan.nested) {
+		for (auto& name : free_names(*nested, globals)) {
+			captured.insert(name);
+		}
+	}
+	std::unordered_map<std::string, object_storage> storages;
+	for (auto& [name, node] : scan.candidates) {
+		auto& init = node->as_initialize.value->as_object_init;
+		auto shape = std::find_if(prog.object_types.begin(), prog.object_types.end(), [&](const object_shape& s) { return s.name == init.type; });
+		bool complete = shape != prog.object_types.end() && shape->members.size() == init.initial_values.size();
+		for (i64 i = 0; complete && i < (i64)init.initial_values.size(); i++) {
+			auto& member = init.initial_values[i].first;
+			bool is_member = std::find(shape->members.begin(), shape->members.end(), member) != shape->members.end();
+			bool repeated = std::any_of(init.initial_values.begin(), init.initial_values.begin() + i, [&](auto& v) { return v.first == member; });
+			complete = is_member && !repeated;
+		}
+		if (!complete || scan.declarations.at(name) != 1 || captured.count(name)) {
+			continue;
+		}
+
+		// A generator's frame moves between stacks, it doesn't own objects.
+		auto escape = scan.escapes.find(name);
+		if (escape == scan.escapes.end()) {
+			storages[name] = object_storage::scalars;
+		}
+		else if (!escape->second && !scan.generator) {
+			storages[name] = object_storage::frame;
+		}
+	}
+	return storages;
+}
+
+// Builtins that only compute a result from their arguments, a const initializer may call them.
+const std::unordered_set<std::string> pure_builtins = {
+	"len", "to_i64", "to_f64", "to_i32", "to_u8", "push", "split",
+	"buf_new", "sum", "min", "max", "dot", "add", "mul", "fill", "find",
+	"map_new", "has", "erase", "keys", "columns_new", "rows", "column",
+};
+
+struct compile_context {
+	const library* lib;
+	program* prog;
+	const type_annotations* annotations;	// Of the generic instance while one is compiled
+	bool types_checked;	// The library has no type errors, operand types the checker proved can be trusted
+	std::vector<std::string> errors;
+
+	std::unordered_map<std::string, i64> globals;
+	std::unordered_map<std::string, i64> strings;
+	std::unordered_map<std::string, i64> builtins;
+	std::unordered_map<std::string, i64> instances;	// Function index of every generic instance
+	std::unordered_map<std::string, i64> consts;	// Top-level constants by name
+	std::unordered_map<std::string, bool> purity;	// Functions already decided by is_pure
+
+	// Type arguments of the generic function being compiled, its uninstantiated body gets '?' for all of them.
+	const std::unordered_map<std::string, std::string>* type_args = nullptr;
+
+	// State of the function being compiled. Block scopes map names to slots of 'fn'.
+	function_proto* fn;
+	std::vector<std::unordered_map<std::string, i64>> scopes;
+	std::unordered_map<std::string, object_storage> objects;	// Object locals of 'fn' that don't live on the heap
+
+	std::vector<std::string> captures;	// Of 'fn', in load_capture order
+	std::unordered_map<std::string, i64> local_consts;	// Constants declared in 'fn' and the functions around it
+
+	void error(const std::string& msg){ errors.push_back(msg); }
+};
+
+i64 emit(compile_context& ctx, opcode op, i64 a = 0, i64 b = 0) {
+	ctx.fn->code.push_back(instruction{ .op = op, .a = a, .b = b });
+	return (i64)ctx.fn->code.size() - 1;
+}
+
+i64 intern_string(compile_context& ctx, const std::string& s) {
+	auto it = ctx.strings.find(s);
+	if (it != ctx.strings.end()) {
+		return it->second;
+	}
+	i64 idx = (i64)ctx.prog->strings.size();
+	ctx.prog->strings.push_back(s);
+	ctx.prog->string_hashes.push_back(hash_string(s));
+	ctx.strings.emplace(s, idx);
+	return idx;
+}
+
+i64 declare_local(compile_context& ctx, const std::string& name) {
+	i64 slot = (i64)ctx.fn->locals.size();
+	ctx.fn->locals.push_back(name);
+	ctx.scopes.back()[name] = slot;
+	return slot;
+}
+
+std::optional<i64> find_local(compile_context& ctx, const std::string& name) {
+	for (i64 i = (i64)ctx.scopes.size() - 1; i >= 0; i--) {
+		auto it = ctx.scopes[i].find(name);
+		if (it != ctx.scopes[i].end()) {
+			return it->second;
+		}
+	}
+	return {};
+}
+
+std::optional<i64> find_capture(compile_context& ctx, const std::string& name) {
+	auto it = std::find(ctx.captures.begin(), ctx.captures.end(), name);
+	if (it == ctx.captures.end()) {
+		return {};
+	}
+	return it - ctx.captures.begin();
+}
+
+std::vector<std::string> split_path(const std::string& name) {
+	std::vector<std::string> parts;
+	i64 start = 0;
+	while (true) {
+		i64 dot = name.find_first_of('.', start);
+		if (dot == (i64)name.npos) {
+			parts.push_back(name.substr(start));
+			return parts;
+		}
+		parts.push_back(name.substr(start, dot - start));
+		start = dot + 1;
+	}
+}
+
+std::optional<i64> find_const(compile_context& ctx, const std::string& name) {
+	auto it = ctx.local_consts.find(name);
+	if (it != ctx.local_consts.end()) {
+		return it->second;
+	}
+	it = ctx.consts.find(name);
+	if (it != ctx.consts.end()) {
+		return it->second;
+	}
+	return {};
+}
+
+void compile_load(compile_context& ctx, const std::string& name) {
+	if (name == "this") {
+		emit(ctx, opcode::push_this);
+	}
+	else if (auto slot = find_local(ctx, name)) {
+		emit(ctx, opcode::load_local, *slot);
+	}
+	else if (auto capture = find_capture(ctx, name)) {
+		emit(ctx, opcode::load_capture, *capture);
+	}
+	else if (auto c = find_const(ctx, name)) {
+		emit(ctx, opcode::push_const, *c);
+	}
+	else if (ctx.globals.count(name)) {
+		emit(ctx, opcode::load_global, ctx.globals[name]);
+	}
+	else {
+		ctx.error("(Symbol) Unknown symbol '" + name + "' in '" + ctx.fn->name + "'.");
+	}
+}
+
+void compile_store(compile_context& ctx, const std::string& name) {
+	if (auto slot = find_local(ctx, name)) {
+		emit(ctx, opcode::store_local, *slot);
+	}
+	else if (find_capture(ctx, name)) {
+		ctx.error("(Closure) '" + name + "' is captured by value in '" + ctx.fn->name + "', it can't be assigned.");
+	}
+	else if (find_const(ctx, name)) {
+		ctx.error("(Const) '" + name + "' can't be assigned in '" + ctx.fn->name + "'.");
+	}
+	else if (ctx.globals.count(name)) {
+		emit(ctx, opcode::store_global, ctx.globals[name]);
+	}
+	else {
+		// Assigning an unknown name declares it in the current scope.
+		emit(ctx, opcode::store_local, declare_local(ctx, name));
+	}
+}
+
+// Loads the start of a member path. A scalar replaced object has no value of its own, its first member is read from
+// its local 'x.member' instead. Returns how many elements of the path were used.
+i64 compile_path_root(compile_context& ctx, const std::vector<std::string>& path) {
+	auto storage = ctx.objects.find(path[0]);
+	if (path.size() > 1 && storage != ctx.objects.end() && storage->second == object_storage::scalars) {
+		compile_load(ctx, path[0] + "." + path[1]);
+		return 2;
+	}
+	compile_load(ctx, path[0]);
+	return 1;
+}
+
+void compile(compile_context& ctx, const ast_node* node);
+
+// Pushes the values of an object initializer, returns its index in program::object_inits.
+i64 compile_object_values(compile_context& ctx, const object_init& init) {
+	object_init_desc desc{ .type = init.type, .members = {} };
+	for (auto& [name, value] : init.initial_values) {
+		compile(ctx, value);
+		desc.members.push_back(name);
+	}
+	ctx.prog->object_inits.push_back(desc);
+	return (i64)ctx.prog->object_inits.size() - 1;
+}
+
+// Without a clean type check an operand proven i64 may still be a string at run time, so only the checked
+// generic opcodes are used.
+operand_type proven_operands(compile_context& ctx, const ast_node* node) {
+	if (!ctx.types_checked) {
+		return operand_type::unknown;
+	}
+	auto it = ctx.annotations->operands.find(node);
+	return it == ctx.annotations->operands.end() ? operand_type::unknown : it->second;
+}
+
+i64 compile_function(compile_context& ctx, const std::string& name, const lambda& l, std::vector<std::string> captures);
+
+bool is_pure(compile_context& ctx, const std::string& name);
+
+// Why a free name keeps code from running at compile time, empty if it's a constant, an enum, or a pure function
+// or builtin.
+std::string compile_time_problem(compile_context& ctx, const std::string& name) {
+	if (name == "this" || find_const(ctx, name)) {
+		return "";
+	}
+	auto global = ctx.globals.find(name);
+	if (global != ctx.globals.end()) {
+		bool is_function = ctx.prog->globals[global->second].function >= 0;
+		return (!is_function || is_pure(ctx, name)) ? "" : "calls '" + name + "', which isn't pure";
+	}
+	if (ctx.builtins.count(name)) {
+		return pure_builtins.count(name) ? "" : "calls '" + name + "', which isn't pure";
+	}
+	return "depends on '" + name + "', which isn't known at compile time";
+}
+
+bool spawns_tasks(const lambda& l, const std::unordered_map<std::string, i64>& globals) {
+	auto scan = scan_escapes(l, globals);
+	return scan.spawns || std::any_of(scan.nested.begin(), scan.nested.end(), [&](const lambda* n) { return spawns_tasks(*n, globals); });
+}
+
+// A function is pure if it spawns no tasks and only uses constants and pure functions and builtins. Calls back
+// into a function that's still being decided count as pure.
+bool is_pure(compile_context& ctx, const std::string& name) {
+	auto known = ctx.purity.find(name);
+	if (known != ctx.purity.end()) {
+		return known->second;
+	}
+	ctx.purity[name] = true;
+
+	auto fn = std::find_if(ctx.lib->functions.begin(), ctx.lib->functions.end(), [&](const ast_node* f) { return f->as_function.symbol == name; });
+	bool pure = fn != ctx.lib->functions.end();
+	if (pure) {
+		auto& l = (*fn)->as_function.lambda->as_lambda;
+		pure = !spawns_tasks(l, ctx.globals);
+		for (auto& free : free_names(l, ctx.globals)) {
+			pure = pure && compile_time_problem(ctx, free).empty();
+		}
+	}
+	ctx.purity[name] = pure;
+	return pure;
+}
+
+// Compiles the initializer of a 'const' into its own function for evaluate_constants.
+void compile_const(compile_context& ctx, i64 index, const ast_node* node) {
+	auto& name = node->as_initialize.symbol.name;
+	lambda init{ .scope = node->as_initialize.value, .args = {}, .return_type = {} };
+	if (spawns_tasks(init, ctx.globals)) {
+		ctx.error("(Const) '" + name + "' spawns a task, it can't be computed at compile time.");
+	}
+	for (auto& free : free_names(init, ctx.globals)) {
+		auto problem = compile_time_problem(ctx, free);
+		if (!problem.empty()) {
+			ctx.error("(Const) '" + name + "' " + problem + ".");
+		}
+	}
+	ctx.prog->constants[index].init = compile_function(ctx, "const " + name, init, {});
+}
+
+// Constants are read only, even arrays. Only the name is checked here, arrays reached through a copy of it are
+// marked read_only and rejected at run time.
+void check_not_const(compile_context& ctx, const ast_node* target, const std::string& what) {
+	bool is_const = target->type == ast_node_type::symbol && !find_local(ctx, target->as_symbol) && !find_capture(ctx, target->as_symbol) && find_const(ctx, target->as_symbol);
+	if (is_const) {
+		ctx.error("(Const) '" + target->as_symbol + "' can't be " + what + " in '" + ctx.fn->name + "'.");
+	}
+}
+
+void compile(compile_context& ctx, const ast_node* node) {
+	switch (node->type) {
+		case ast_node_type::number:
+		{
+			switch (node->as_number_type) {
+				case number_type::i64:	emit(ctx, opcode::push_i64, node->as_number); break;
+				case number_type::f64:	emit(ctx, opcode::push_f64, std::bit_cast<i64>(node->as_f64)); break;
+				case number_type::i32:	emit(ctx, opcode::push_i32, node->as_number); break;
+				case number_type::u8:	emit(ctx, opcode::push_u8, node->as_number); break;
+			}
+			break;
+		}
+		case ast_node_type::string:
+		{
+			emit(ctx, opcode::push_string, intern_string(ctx, node->as_string));
+			break;
+		}
+		case ast_node_type::bin_op:
+		{
+			// i32 and u8 values are kept sign or zero extended, they use the i64 operations and wrap the result.
+			compile(ctx, node->as_bin_op.lhs);
+			compile(ctx, node->as_bin_op.rhs);
+			auto operands = proven_operands(ctx, node);
+			bool is_int = operands == operand_type::i64 || operands == operand_type::i32 || operands == operand_type::u8;
+			bool is_f64 = operands == operand_type::f64;
+			switch (node->as_bin_op.type) {
+				case bin_op_type::add: emit(ctx, is_int ? opcode::add_i64 : is_f64 ? opcode::add_f64 : opcode::add); break;
+				case bin_op_type::sub: emit(ctx, is_int ? opcode::sub_i64 : is_f64 ? opcode::sub_f64 : opcode::sub); break;
+				case bin_op_type::mul: emit(ctx, is_int ? opcode::mul_i64 : is_f64 ? opcode::mul_f64 : opcode::mul); break;
+				case bin_op_type::div: emit(ctx, is_int ? opcode::div_i64 : is_f64 ? opcode::div_f64 : opcode::div); break;
+				default: assert(false); break;
+			}
+			if (operands == operand_type::i32) {
+				emit(ctx, opcode::wrap_i32);
+			}
+			else if (operands == operand_type::u8) {
+				emit(ctx, opcode::wrap_u8);
+			}
+			break;
+		}
+		case ast_node_type::comparison:
+		{
+			compile(ctx, node->as_comparison.lhs);
+			compile(ctx, node->as_comparison.rhs);
+			auto operands = proven_operands(ctx, node);
+			bool is_int = operands == operand_type::i64 || operands == operand_type::i32 || operands == operand_type::u8;
+			bool is_f64 = operands == operand_type::f64;
+			switch (node->as_comparison.type) {
+				case comparison_type::eq: emit(ctx, is_int ? opcode::cmp_eq_i64 : is_f64 ? opcode::cmp_eq_f64 : opcode::cmp_eq); break;
+				case comparison_type::lt: emit(ctx, is_int ? opcode::cmp_lt_i64 : is_f64 ? opcode::cmp_lt_f64 : opcode::cmp_lt); break;
+				case comparison_type::gt: emit(ctx, is_int ? opcode::cmp_gt_i64 : is_f64 ? opcode::cmp_gt_f64 : opcode::cmp_gt); break;
+				case comparison_type::lte: emit(ctx, is_int ? opcode::cmp_lte_i64 : is_f64 ? opcode::cmp_lte_f64 : opcode::cmp_lte); break;
+				case comparison_type::gte: emit(ctx, is_int ? opcode::cmp_gte_i64 : is_f64 ? opcode::cmp_gte_f64 : opcode::cmp_gte); break;
+				default: assert(false); break;
+			}
+			break;
+		}
+		case ast_node_type::sequence:
+		{
+			// Every expression leaves one value, a sequence keeps only the last one.
+			if (node->as_sequence.empty()) {
+				emit(ctx, opcode::push_i64, 0);
+			}
+			for (i64 i = 0; i < (i64)node->as_sequence.size(); i++) {
+				if (i > 0) {
+					emit(ctx, opcode::pop);
+				}
+				compile(ctx, node->as_sequence[i]);
+			}
+			break;
+		}
+		case ast_node_type::call:
+		{
+			auto& target = node->as_call.target;
+			i64 argc = (i64)node->as_call.args.size();
+			auto compile_args = [&]() {
+				for (auto& arg : node->as_call.args) {
+					compile(ctx, arg);
+				}
+			};
+
+			auto instance = ctx.annotations->generic_calls.find(&node->as_call);
+			if (instance != ctx.annotations->generic_calls.end()) {
+				compile_args();
+				emit(ctx, opcode::call, ctx.instances.at(instance->second), argc);
+			}
+			else if (target == "this" && ctx.captures.empty()) {
+				compile_args();
+				emit(ctx, opcode::call, ctx.fn->index, argc);
+			}
+			else if (target == "this" || find_local(ctx, target) || find_capture(ctx, target)) {
+				compile_load(ctx, target);
+				compile_args();
+				emit(ctx, opcode::call_value, 0, argc);
+			}
+			else if (ctx.globals.count(target) && ctx.prog->globals[ctx.globals[target]].function >= 0) {
+				compile_args();
+				emit(ctx, opcode::call, ctx.prog->globals[ctx.globals[target]].function, argc);
+			}
+			else if (ctx.builtins.count(target)) {
+				if ((target == "push" || target == "fill") && argc > 0) {
+					check_not_const(ctx, node->as_call.args[0], "changed");
+				}
+				compile_args();
+				emit(ctx, opcode::call_builtin, ctx.builtins[target], argc);
+			}
+			else {
+				compile_load(ctx, target);
+				compile_args();
+				emit(ctx, opcode::call_value, 0, argc);
+			}
+			break;
+		}
+		case ast_node_type::spawn:
+		{
+			auto& target = node->as_call.target;
+			i64 argc = (i64)node->as_call.args.size();
+			auto compile_args = [&]() {
+				for (auto& arg : node->as_call.args) {
+					compile(ctx, arg);
+				}
+			};
+
+			auto instance = ctx.annotations->generic_calls.find(&node->as_call);
+			if (instance != ctx.annotations->generic_calls.end()) {
+				compile_args();
+				emit(ctx, opcode::spawn, ctx.instances.at(instance->second), argc);
+			}
+			else if (target == "this" && ctx.captures.empty()) {
+				compile_args();
+				emit(ctx, opcode::spawn, ctx.fn->index, argc);
+			}
+			else if (!find_local(ctx, target) && !find_capture(ctx, target) && ctx.globals.count(target) && ctx.prog->globals[ctx.globals[target]].function >= 0) {
+				compile_args();
+				emit(ctx, opcode::spawn, ctx.prog->globals[ctx.globals[target]].function, argc);
+			}
+			else {
+				compile_load(ctx, target);
+				compile_args();
+				emit(ctx, opcode::spawn_value, 0, argc);
+			}
+			break;
+		}
+		case ast_node_type::lambda:
+		{
+			// Free names visible here are copied into the closure as it's created, others stay global or dynamic.
+			std::vector<std::string> captures;
+			for (auto& name : free_names(node->as_lambda, ctx.globals)) {
+				if (auto slot = find_local(ctx, name)) {
+					emit(ctx, opcode::load_local, *slot);
+					captures.push_back(name);
+				}
+				else if (auto capture = find_capture(ctx, name)) {
+					emit(ctx, opcode::load_capture, *capture);
+					captures.push_back(name);
+				}
+			}
+			i64 count = (i64)captures.size();
+			i64 idx = compile_function(ctx, "lambda", node->as_lambda, std::move(captures));
+			if (count == 0) {
+				emit(ctx, opcode::push_fn, idx);
+			}
+			else {
+				emit(ctx, opcode::make_closure, idx, count);
+			}
+			break;
+		}
+		case ast_node_type::assign:
+		{
+			auto path = split_path(node->as_assign.symbol);
+			auto storage = ctx.objects.find(path[0]);
+			bool is_scalar = storage != ctx.objects.end() && storage->second == object_storage::scalars;
+			if (path.size() == 1 || (path.size() == 2 && is_scalar)) {
+				compile(ctx, node->as_assign.value);
+				compile_store(ctx, node->as_assign.symbol);
+				break;
+			}
+			for (i64 i = compile_path_root(ctx, path); i < (i64)path.size() - 1; i++) {
+				emit(ctx, opcode::get_member, intern_string(ctx, path[i]));
+			}
+			compile(ctx, node->as_assign.value);
+			emit(ctx, opcode::set_member, intern_string(ctx, path.back()));
+			break;
+		}
+		case ast_node_type::initialize:
+		{
+			auto& name = node->as_initialize.symbol.name;
+			if (node->as_initialize.is_const) {
+				i64 index = (i64)ctx.prog->constants.size();
+				ctx.prog->constants.push_back({ .name = name });
+				compile_const(ctx, index, node);
+				ctx.local_consts[name] = index;
+				emit(ctx, opcode::push_const, index);
+				break;
+			}
+			auto storage = ctx.objects.find(name);
+			if (storage != ctx.objects.end() && storage->second == object_storage::scalars) {
+				for (auto& [member, value] : node->as_initialize.value->as_object_init.initial_values) {
+					compile(ctx, value);
+					emit(ctx, opcode::store_local, declare_local(ctx, name + "." + member));
+					emit(ctx, opcode::pop);
+				}
+				emit(ctx, opcode::push_i64, 0);
+				break;
+			}
+			if (storage != ctx.objects.end() && storage->second == object_storage::frame) {
+				i64 init = compile_object_values(ctx, node->as_initialize.value->as_object_init);
+				i64 slot = declare_local(ctx, name);
+				emit(ctx, opcode::new_frame_object, init, slot);
+				emit(ctx, opcode::store_local, slot);
+				break;
+			}
+			compile(ctx, node->as_initialize.value);
+			emit(ctx, opcode::store_local, declare_local(ctx, name));
+			break;
+		}
+		case ast_node_type::symbol:
+		{
+			auto path = split_path(node->as_symbol);
+			for (i64 i = compile_path_root(ctx, path); i < (i64)path.size(); i++) {
+				emit(ctx, opcode::get_member, intern_string(ctx, path[i]));
+			}
+			break;
+		}
+		case ast_node_type::conditional:
+		{
+			// A false condition without an else branch produces 0.
+			compile(ctx, node->as_if.condition);
+			i64 to_else = emit(ctx, opcode::jump_if_false);
+			compile(ctx, node->as_if.scope);
+			i64 to_end = emit(ctx, opcode::jump);
+			ctx.fn->code[to_else].a = (i64)ctx.fn->code.size();
+			if (node->as_if.else_scope) {
+				compile(ctx, node->as_if.else_scope);
+			}
+			else {
+				emit(ctx, opcode::push_i64, 0);
+			}
+			ctx.fn->code[to_end].a = (i64)ctx.fn->code.size();
+			break;
+		}
+		case ast_node_type::loop:
+		{
+			if (node->as_loop.type == loop_type::loop_for) {
+				// The generator is kept in a hidden local, '$' can't start a name in the source.
+				ctx.scopes.push_back({});
+				compile(ctx, node->as_loop.condition);
+				i64 gen = declare_local(ctx, "$for");
+				emit(ctx, opcode::store_local, gen);
+				emit(ctx, opcode::pop);
+				i64 item = declare_local(ctx, node->as_loop.symbol);
+				i64 start = (i64)ctx.fn->code.size();
+				emit(ctx, opcode::load_local, gen);
+				i64 to_end = emit(ctx, opcode::next);
+				emit(ctx, opcode::store_local, item);
+				emit(ctx, opcode::pop);
+				compile(ctx, node->as_loop.scope);
+				emit(ctx, opcode::pop);
+				emit(ctx, opcode::jump, start);
+				ctx.fn->code[to_end].a = (i64)ctx.fn->code.size();
+				ctx.scopes.pop_back();
+				emit(ctx, opcode::push_i64, 0);
+				break;
+			}
+			assert(node->as_loop.type == loop_type::loop_while); // Unknown loop type
+			i64 start = (i64)ctx.fn->code.size();
+			compile(ctx, node->as_loop.condition);
+			i64 to_end = emit(ctx, opcode::jump_if_false);
+			ctx.scopes.push_back({});
+			compile(ctx, node->as_loop.scope);
+			ctx.scopes.pop_back();
+			emit(ctx, opcode::pop);
+			emit(ctx, opcode::jump, start);
+			ctx.fn->code[to_end].a = (i64)ctx.fn->code.size();
+			emit(ctx, opcode::push_i64, 0);
+			break;
+		}
+		case ast_node_type::yield:
+		{
+			compile(ctx, node->as_yield);
+			emit(ctx, opcode::yield);
+			emit(ctx, opcode::push_i64, 0);
+			ctx.fn->generator = true;
+			break;
+		}
+		case ast_node_type::array:
+		{
+			for (auto& e : node->as_sequence) {
+				compile(ctx, e);
+			}
+			emit(ctx, opcode::new_array, 0, (i64)node->as_sequence.size());
+			break;
+		}
+		case ast_node_type::index:
+		case ast_node_type::index_assign:
+		{
+			compile(ctx, node->as_index.target);
+			compile(ctx, node->as_index.index);
+			if (node->as_index.value) {
+				check_not_const(ctx, node->as_index.target, "assigned");
+				compile(ctx, node->as_index.value);
+				emit(ctx, opcode::set_index);
+			}
+			else {
+				emit(ctx, opcode::get_index);
+			}
+			break;
+		}
+		case ast_node_type::object_init:
+		{
+			i64 init = compile_object_values(ctx, node->as_object_init);
+			emit(ctx, opcode::new_object, init, (i64)node->as_object_init.initial_values.size());
+			break;
+		}
+		default:
+		{
+			assert(false);
+			break;
+		}
+	}
+}
+
+// Compiles a lambda into its own function_proto at 'idx'.
+void compile_function(compile_context& ctx, i64 idx, const std::string& name, const lambda& l, std::vector<std::string> captures = {}) {
+	function_proto fn{ .name = name, .index = idx, .args = l.args, .locals = {}, .captures = captures, .code = {} };
+	if (ctx.type_args) {
+		// Arguments whose type depends on an unknown type argument aren't checked when called.
+		for (auto& arg : fn.args) {
+			if (arg.type) {
+				arg.type = substitute_type_args(*arg.type, *ctx.type_args);
+			}
+			if (arg.type && arg.type->find('?') != std::string::npos) {
+				arg.type.reset();
+			}
+		}
+	}
+
+	auto outer_fn = ctx.fn;
+	auto outer_scopes = std::move(ctx.scopes);
+	auto outer_objects = std::move(ctx.objects);
+	auto outer_captures = std::exchange(ctx.captures, std::move(captures));
+	auto outer_consts = ctx.local_consts;
+	ctx.fn = &fn;
+	ctx.scopes = { {} };
+	ctx.objects = object_storages(scan_escapes(l, ctx.globals), *ctx.prog, ctx.globals);
+
+	for (auto& arg : l.args) {
+		declare_local(ctx, arg.name);
+	}
+	compile(ctx, l.scope);
+	emit(ctx, opcode::ret);
+
+	ctx.fn = outer_fn;
+	ctx.scopes = std::move(outer_scopes);
+	ctx.objects = std::move(outer_objects);
+	ctx.captures = std::move(outer_captures);
+	ctx.local_consts = std::move(outer_consts);
+	ctx.prog->functions[idx] = std::move(fn);
+}
+
+// Nested lambdas are appended to the program as they're found.
+i64 compile_function(compile_context& ctx, const std::string& name, const lambda& l, std::vector<std::string> captures) {
+	i64 idx = (i64)ctx.prog->functions.size();
+	ctx.prog->functions.push_back({});
+	compile_function(ctx, idx, name, l, std::move(captures));
+	return idx;
+}
+
+std::pair<program, std::vector<std::string>> compile(const library& lib, const type_annotations& annotations, bool types_checked) {
+	program prog{};
+	compile_context ctx{ .lib = &lib, .prog = &prog, .annotations = &annotations, .types_checked = types_checked };
+
+	for (auto& [name, sig] : builtin_signatures) {
+		ctx.builtins[name] = (i64)prog.builtins.size();
+		prog.builtins.push_back(name);
+	}
+	for (auto& obj : lib.object_types) {
+		if (obj->type == ast_node_type::object_type) {
+			object_shape shape{ .name = obj->as_object_type.name, .members = {} };
+			for (auto& m : obj->as_object_type.members) {
+				shape.members.push_back(m.name);
+			}
+			prog.object_types.push_back(shape);
+		}
+		else if (obj->type == ast_node_type::enum_def) {
+			ctx.globals[obj->as_enum_def.name] = (i64)prog.globals.size();
+			prog.globals.push_back({ .name = obj->as_enum_def.name, .function = -1, .enum_type = (i64)prog.enums.size() });
+			prog.enums.push_back(obj->as_enum_def);
+		}
+	}
+
+	// Functions get the first indices so calls can be emitted before their target is compiled.
+	for (auto& fn : lib.functions) {
+		i64 idx = (i64)prog.functions.size();
+		prog.functions.push_back({});
+		ctx.globals[fn->as_function.symbol] = (i64)prog.globals.size();
+		prog.globals.push_back({ .name = fn->as_function.symbol, .function = idx, .enum_type = -1 });
+	}
+	for (auto& inst : annotations.instances) {
+		ctx.instances[inst.name] = (i64)prog.functions.size();
+		prog.functions.push_back({});
+	}
+	for (auto& c : lib.constants) {
+		ctx.consts[c->as_initialize.symbol.name] = (i64)prog.constants.size();
+		prog.constants.push_back({ .name = c->as_initialize.symbol.name });
+	}
+	for (i64 i = 0; i < (i64)lib.functions.size(); i++) {
+		// The uninstantiated body of a generic function is still reachable as a value, untyped.
+		auto& l = lib.functions[i]->as_function.lambda->as_lambda;
+		std::unordered_map<std::string, std::string> unknown_args;
+		for (auto& param : l.type_params) {
+			unknown_args[param] = "?";
+		}
+		ctx.type_args = l.type_params.empty() ? nullptr : &unknown_args;
+		compile_function(ctx, i, lib.functions[i]->as_function.symbol, l);
+	}
+	// Every instance is compiled on its own, with the operand types proven for its type arguments.
+	for (auto& inst : annotations.instances) {
+		ctx.annotations = &inst.annotations;
+		ctx.type_args = &inst.type_args;
+		compile_function(ctx, ctx.instances[inst.name], inst.name, inst.function->as_function.lambda->as_lambda);
+	}
+	ctx.annotations = &annotations;
+	ctx.type_args = nullptr;
+	for (auto& c : lib.constants) {
+		compile_const(ctx, ctx.consts[c->as_initialize.symbol.name], c);
+	}
+
+	return { std::move(prog), ctx.errors };
+}
@@ -0,0 +1,321 @@
+#pragma once
+
+// Bytes transferred or the opened fd, a negative errno on failure.
+using io_callback = std::function<void(i64 result)>;
+
+// Runs file and pipe I/O on its own thread so script threads never block on it. Operations can be started from
+// any thread, their callbacks run on the I/O thread and may start further operations.
+// Linux uses io_uring when the kernel allows it and a poll loop otherwise, other systems complete every
+// operation right away on the calling thread.
+class io_loop {
+public:
+	io_loop() {
+#if !defined(_WIN32)
+#if defined(IO_URING_AVAILABLE)
+		mUring = setup_uring(256);
+#endif
+		if (!mUring) {
+			int fds[2];
+			if (pipe(fds) == 0) {
+				mWakeRead = fds[0];
+				mWakeWrite = fds[1];
+			}
+		}
+		mThread = std::thread([this]() { mUring ? uring_loop() : poll_loop(); });
+#endif
+	}
+	~io_loop() {
+#if !defined(_WIN32)
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			mShutdown = true;
+		}
+		wake();
+		mThread.join();
+#endif
+	}
+
+	const char* backend() const {
+#if defined(_WIN32)
+		return "blocking";
+#else
+		return mUring ? "io_uring" : "poll";
+#endif
+	}
+
+	// Reads at the file position, 0 bytes means end of file. 'buf' has to stay valid until 'cb' runs.
+	void submit_read(int fd, char* buf, i64 size, io_callback cb) {
+		start(std::make_unique<io_op>(io_op{ .type = io_op_type::read, .fd = fd, .buf = buf, .size = size, .path = {}, .flags = 0, .cb = std::move(cb) }));
+	}
+
+	// May write less than 'size', the caller continues with the rest.
+	void submit_write(int fd, const char* buf, i64 size, io_callback cb) {
+		start(std::make_unique<io_op>(io_op{ .type = io_op_type::write, .fd = fd, .buf = (char*)buf, .size = size, .path = {}, .flags = 0, .cb = std::move(cb) }));
+	}
+
+	void submit_open(const std::string& path, int flags, io_callback cb) {
+		start(std::make_unique<io_op>(io_op{ .type = io_op_type::open, .fd = -1, .buf = nullptr, .size = 0, .path = path, .flags = flags, .cb = std::move(cb) }));
+	}
+
+private:
+	enum struct io_op_type {
+		read,
+		write,
+		open,
+	};
+
+	struct io_op {
+		io_op_type type;
+		int fd;
+		char* buf;
+		i64 size;
+		std::string path;
+		int flags;
+		io_callback cb;
+	};
+
+	// Runs the operation with a plain system call, for the poll loop and systems without an event loop.
+	static i64 perform(io_op& op) {
+#if defined(_WIN32)
+		switch (op.type) {
+			case io_op_type::read:	return _read(op.fd, op.buf, (unsigned)op.size);
+			case io_op_type::write:	return _write(op.fd, op.buf, (unsigned)op.size);
+			case io_op_type::open:	return _open(op.path.c_str(), op.flags | _O_BINARY, 0644);
+		}
+		return -1;
+#else
+		i64 res = -1;
+		switch (op.type) {
+			case io_op_type::read:	res = ::read(op.fd, op.buf, (size_t)op.size); break;
+			case io_op_type::write:	res = ::write(op.fd, op.buf, (size_t)op.size); break;
+			case io_op_type::open:	res = ::open(op.path.c_str(), op.flags | O_CLOEXEC, 0644); break;
+		}
+		return res < 0 ? -errno : res;
+#endif
+	}
+
+#if defined(_WIN32)
+	void start(std::unique_ptr<io_op> op) {
+		i64 res = perform(*op);
+		op->cb(res < 0 ? -errno : res);
+	}
+#else
+	void start(std::unique_ptr<io_op> op) {
+#if defined(IO_URING_AVAILABLE)
+		if (mUring) {
+			uring_submit(op.release());
+			return;
+		}
+#endif
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			mQueued.push_back(std::move(op));
+		}
+		wake();
+	}
+
+	void wake() {
+#if defined(IO_URING_AVAILABLE)
+		if (mUring) {
+			uring_submit(nullptr);
+			return;
+		}
+#endif
+		char c = 0;
+		[[maybe_unused]] auto n = ::write(mWakeWrite, &c, 1);
+	}
+
+	// Waits on every pending fd at once. Opens and regular files are always ready, so they complete on the next pass.
+	void poll_loop() {
+		std::vector<std::unique_ptr<io_op>> active;
+		std::vector<pollfd> fds;
+		while (true) {
+			{
+				std::lock_guard<std::mutex> lock(mLock);
+				if (mShutdown) {
+					return;
+				}
+				for (auto& op : mQueued) {
+					active.push_back(std::move(op));
+				}
+				mQueued.clear();
+			}
+
+			for (i64 i = 0; i < (i64)active.size(); i++) {
+				if (active[i]->type == io_op_type::open) {
+					auto op = std::move(active[i]);
+					active.erase(active.begin() + i--);
+					op->cb(perform(*op));
+				}
+			}
+
+			fds.assign(1, pollfd{ .fd = mWakeRead, .events = POLLIN, .revents = 0 });
+			for (auto& op : active) {
+				fds.push_back(pollfd{ .fd = op->fd, .events = (short)(op->type == io_op_type::read ? POLLIN : POLLOUT), .revents = 0 });
+			}
+			if (poll(fds.data(), (nfds_t)fds.size(), -1) < 0) {
+				continue;
+			}
+			if (fds[0].revents) {
+				char buf[64];
+				[[maybe_unused]] auto n = ::read(mWakeRead, buf, sizeof(buf));
+			}
+
+			// Callbacks may queue new operations, those are picked up on the next pass.
+			std::vector<std::unique_ptr<io_op>> ready;
+			for (i64 i = (i64)active.size() - 1; i >= 0; i--) {
+				if (fds[i + 1].revents) {
+					ready.push_back(std::move(active[i]));
+					active.erase(active.begin() + i);
+				}
+			}
+			for (i64 i = (i64)ready.size() - 1; i >= 0; i--) {
+				ready[i]->cb(perform(*ready[i]));
+			}
+		}
+	}
+
+#if defined(IO_URING_AVAILABLE)
+	// The rings shared with the kernel. Submissions are serialized by mLock, only the I/O thread reaps completions.
+	struct uring {
+		int fd = -1;
+		unsigned* sq_tail;
+		unsigned* sq_mask;
+		unsigned* sq_array;
+		io_uring_sqe* sqes;
+		unsigned* cq_head;
+		unsigned* cq_tail;
+		unsigned* cq_mask;
+		io_uring_cqe* cqes;
+	};
+
+	static std::unique_ptr<uring> setup_uring(unsigned entries) {
+		io_uring_params params{};
+		int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+		if (fd < 0) {
+			return nullptr;
+		}
+		// Reads and writes at the file position need 5.6, NODROP guarantees every completion is delivered.
+		if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+			close(fd);
+			return nullptr;
+		}
+
+		size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_mmap) {
+			sq_size = cq_size = std::max(sq_size, cq_size);
+		}
+		char* sq = (char*)mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		char* cq = single_mmap ? sq : (char*)mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		void* sqes = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+			close(fd);
+			return nullptr;
+		}
+
+		// The mappings live as long as the process, like the loop itself.
+		auto ring = std::make_unique<uring>();
+		ring->fd = fd;
+		ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+		ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+		ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+		ring->sqes = (io_uring_sqe*)sqes;
+		ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+		ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+		ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+		ring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+		return ring;
+	}
+
+	// Every submission enters the kernel right away, so the submission ring never holds more than one entry.
+	// A null op is a no-op that wakes the I/O thread.
+	void uring_submit(io_op* op) {
+		std::lock_guard<std::mutex> lock(mLock);
+		unsigned tail = *mUring->sq_tail;
+		unsigned index = tail & *mUring->sq_mask;
+		io_uring_sqe& sqe = mUring->sqes[index];
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.user_data = (uint64_t)op;
+		if (!op) {
+			sqe.opcode = IORING_OP_NOP;
+		}
+		else if (op->type == io_op_type::open) {
+			sqe.opcode = IORING_OP_OPENAT;
+			sqe.fd = AT_FDCWD;
+			sqe.addr = (uint64_t)op->path.c_str();
+			sqe.open_flags = (uint32_t)(op->flags | O_CLOEXEC);
+			sqe.len = 0644;
+		}
+		else {
+			sqe.opcode = (op->type == io_op_type::read) ? IORING_OP_READ : IORING_OP_WRITE;
+			sqe.fd = op->fd;
+			sqe.addr = (uint64_t)op->buf;
+			sqe.len = (uint32_t)std::min<i64>(op->size, UINT32_MAX);
+			sqe.off = (uint64_t)-1;
+		}
+		mUring->sq_array[index] = index;
+		std::atomic_ref<unsigned>(*mUring->sq_tail).store(tail + 1, std::memory_order_release);
+		while (syscall(__NR_io_uring_enter, mUring->fd, 1, 0, 0, nullptr, 0) < 0 && errno == EINTR) {}
+	}
+
+	void uring_loop() {
+		std::vector<io_uring_cqe> completed;
+		while (true) {
+			syscall(__NR_io_uring_enter, mUring->fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+			std::atomic_ref<unsigned> cq_head(*mUring->cq_head);
+			unsigned head = cq_head.load(std::memory_order_relaxed);
+			unsigned tail = std::atomic_ref<unsigned>(*mUring->cq_tail).load(std::memory_order_acquire);
+			completed.clear();
+			for (; head != tail; head++) {
+				completed.push_back(mUring->cqes[head & *mUring->cq_mask]);
+			}
+			cq_head.store(head, std::memory_order_release);
+
+			// Taking the submission lock orders the ops' contents before their callbacks run, the kernel's
+			// hand-off isn't visible to the C++ memory model.
+			bool shutdown;
+			{
+				std::lock_guard<std::mutex> lock(mLock);
+				shutdown = mShutdown;
+			}
+			for (auto& cqe : completed) {
+				if (auto op = std::unique_ptr<io_op>((io_op*)cqe.user_data)) {
+					op->cb(cqe.res);
+				}
+			}
+			if (shutdown) {
+				return;
+			}
+		}
+	}
+
+	std::unique_ptr<uring> mUring;
+#else
+	static constexpr bool mUring = false;
+	void uring_loop() {}
+#endif
+
+	std::thread mThread;
+	std::mutex mLock;
+	bool mShutdown = false;
+	std::vector<std::unique_ptr<io_op>> mQueued;	// Handed to the poll loop
+	int mWakeRead = -1;
+	int mWakeWrite = -1;
+#endif
+};
+
+io_loop& default_io_loop() {
+	static io_loop loop;
+	return loop;
+}
+
+int io_close(int fd) {
+#if defined(_WIN32)
+	return _close(fd);
+#else
+	return close(fd);
+#endif
+}
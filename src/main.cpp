@@ -6,10 +6,60 @@
 #include <fstream>
 #include <functional>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <string_view>
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include <charconv>
+#include <fcntl.h>
+#include <bit>
+#include <cstdio>
+#include <filesystem>
 
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(_WIN32)
+#include <io.h>
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define IO_URING_AVAILABLE
+#endif
+#endif
+
+#include "thread_pool.h"
+#include "io.h"
+#include "simd.h"
 #include "parser.h"
+#include "tree_shaker.h"
 #include "type_checker.h"
+#include "compiler.h"
 #include "vm.h"
+#include "scheduler.h"
+#include "program_cache.h"
+#include "snapshot.h"
 
 std::optional<std::string> read_file(const std::string& fname) {
 	std::fstream fs(fname, std::fstream::in);
@@ -36,31 +86,29 @@ public:
 		return (double)std::chrono::duration_cast<std::chrono::milliseconds>(now - mStart).count() * 0.001;
 	}
 private:
-	std::chrono::steady_clock::time_point mStart;
+	std::chrono::high_resolution_clock::time_point mStart;
 };
 
-int main(int argc, const char* argv[]) {
+// Parses, checks and compiles a source file. Returns nullptr if it can't be run.
+std::shared_ptr<const program> build_program(const std::string& src_file) {
 	timer t;
 
-	auto args = parse_args(argc, argv);
-
-	if (args.size() <= 1) {
-		std::cout << "Input source file.\n";
-		return -1;
-	}
-
-	std::string src_file = args[1];
-
-	// std::string fname = "example/0_fibonacci_recursive.fl";
-	// std::string fname = "example/0_fibonacci_loop.fl";
-	// std::string fname = "example/1_objects.fl";
-	std::string fname = "example/compiler.fl";
-	
-	auto file = read_file(fname);
+	auto file = read_file(src_file);
 
 	if (!file) {
 		std::cout << "Unable to read file.\n";
-		return -1;
+		return nullptr;
+	}
+
+	// An unchanged source skips straight to loading its compiled program.
+	t.reset();
+	uint64_t source_hash = hash_string(*file);
+	if (auto cached = load_cached_program(source_hash)) {
+		auto prog = load_program(std::move(*cached));
+		if (natives_linked(*prog)) {
+			std::cout << "[Loaded cached program in]: " << t.elapsed() << "s\n";
+			return prog;
+		}
 	}
 
 	t.reset();
@@ -75,18 +123,26 @@ int main(int argc, const char* argv[]) {
 		for (auto& err : errors) {
 			std::cout << err << "\n";
 		}
-		return -1;
+		return nullptr;
 	}
 
 	if (ast.functions.empty()) {
 		std::cout << "Unable to parse AST.\n";
-		return -1;
+		return nullptr;
 	}
 	
 	std::cout << "[Built program in]: " << compile_end << "s\n";
 
+	auto removed = tree_shake(ast);
+	if (!removed.empty()) {
+		std::cout << "[Removed unreachable]:";
+		for (auto& r : removed) {
+			std::cout << " " << r << (&r == &removed.back() ? "\n" : ",");
+		}
+	}
+
 	t.reset();
-	auto type_errors = type_check(ast);
+	auto[annotations,type_errors] = type_check(ast);
 	auto tc_end = t.elapsed();
 
 	if (type_errors.size() == 0) {
@@ -97,17 +153,139 @@ int main(int argc, const char* argv[]) {
 		for (auto& err : type_errors) {
 			std::cout << err << "\n";
 		}
-		//return -1;
+		//return nullptr;
 	}
 	std::cout << "[Checked types in]: " << tc_end << "s\n";
 
+	t.reset();
+	auto[prog,compile_errors] = compile(ast, annotations, type_errors.empty());
+	if (compile_errors.empty()) {
+		compile_errors = evaluate_constants(prog);
+	}
+	auto codegen_end = t.elapsed();
+
+	if (compile_errors.size() != 0) {
+		std::cout << "[Encountered errors in compile]\n";
+		for (auto& err : compile_errors) {
+			std::cout << err << "\n";
+		}
+		return nullptr;
+	}
+	std::cout << "[Compiled in]: " << codegen_end << "s\n";
+
+	// Type errors don't stop the build, a program with any isn't cached so every run reports them.
+	if (type_errors.empty()) {
+		save_cached_program(prog, source_hash);
+	}
+	return load_program(std::move(prog));
+}
+
+// Runs every script as a fiber on the thread pool, time sliced so a long running script doesn't hold up the rest.
+int run_fibers(const std::vector<std::string>& src_files) {
+	timer t;
+
+	fiber_scheduler scheduler(default_thread_pool());
+	for (auto& src_file : src_files) {
+		auto prog = build_program(src_file);
+		if (!prog) {
+			return -1;
+		}
+		scheduler.spawn(prog, src_file);
+	}
+
+	std::cout << "[Running " << src_files.size() << " fibers]\n";
+
+	t.reset();
+	scheduler.wait();
+	auto run_end = t.elapsed();
+
+	int res = 0;
+	for (auto& f : scheduler.fibers()) {
+		double cpu_time = (double)std::chrono::duration_cast<std::chrono::microseconds>(f->cpu_time).count() * 0.000001;
+		std::cout << "[Fiber " << f->id << "] " << f->name << " returned " << f->result << " in " << cpu_time << "s cpu, " << f->slices << " slices\n";
+		for (auto& err : f->errors) {
+			std::cout << err << "\n";
+		}
+		if (!f->errors.empty()) {
+			res = -1;
+		}
+	}
+	std::cout << "[Ran fibers in]: " << run_end << "s\n";
+
+	return res;
+}
+
+// Builds a script, runs its 'init' and stores the result so later runs of the same source start at 'main'.
+int write_snapshot(const std::string& src_file) {
+	auto file = read_file(src_file);
+	auto prog = build_program(src_file);
+	if (!file || !prog) {
+		return -1;
+	}
+
+	timer t;
+	auto errors = save_snapshot(prog, hash_string(*file));
+	if (!errors.empty()) {
+		std::cout << "[Encountered errors in snapshot]\n";
+		for (auto& err : errors) {
+			std::cout << err << "\n";
+		}
+		return -1;
+	}
+	std::cout << "[Wrote snapshot in]: " << t.elapsed() << "s\n";
+	return 0;
+}
+
+int main(int argc, const char* argv[]) {
+	timer t;
+
+	auto args = parse_args(argc, argv);
+
+	if (args.size() <= 1) {
+		std::cout << "Input source file.\n";
+		return -1;
+	}
+
+	if (args[1] == "--snapshot") {
+		if (args.size() != 3) {
+			std::cout << "Input one source file to snapshot.\n";
+			return -1;
+		}
+		return write_snapshot(args[2]);
+	}
+
+	if (args.size() > 2) {
+		return run_fibers(std::vector<std::string>(args.begin() + 1, args.end()));
+	}
+
+	// A snapshot of an unchanged source has the program and the result of 'init' ready.
+	std::optional<snapshot> snap;
+	if (auto file = read_file(args[1])) {
+		t.reset();
+		if ((snap = load_snapshot(hash_string(*file)))) {
+			std::cout << "[Loaded snapshot in]: " << t.elapsed() << "s\n";
+		}
+	}
+
+	auto prog = snap ? snap->prog : build_program(args[1]);
+	if (!prog) {
+		return -1;
+	}
+
 	std::cout << "[Running]\n";
-	
+
 	t.reset();
-	i64 res = evaluate(ast);
+	eval_context vm = make_context(prog);
+	auto[res,runtime_errors] = evaluate(vm, snap ? std::optional<value>(snap->state) : std::nullopt);
 	auto run_end = t.elapsed();
 
+	if (runtime_errors.size() != 0) {
+		std::cout << "[Encountered runtime errors]\n";
+		for (auto& err : runtime_errors) {
+			std::cout << err << "\n";
+		}
+	}
 	std::cout << "[Ran program in]: " << run_end << "s\n";
 
 	return (int)res;
-}
\ No newline at end of file
+}
@@ -20,6 +20,11 @@ enum struct ast_node_type {
 	object_init,
 	loop,
 	enum_def,
+	spawn,
+	yield,
+	array,
+	index,
+	index_assign,
 };
 
 struct ast_node;
@@ -46,6 +51,8 @@ struct argument_decl {
 struct lambda {
 	ast_node* scope;
 	std::vector<argument_decl> args;
+	std::optional<std::string> return_type;
+	std::vector<std::string> type_params;	// 'T' of 'fn max<T>(a: T, b: T) -> T', only functions declare them
 };
 
 struct assign {
@@ -56,6 +63,7 @@ struct assign {
 struct initialize {
 	argument_decl symbol;
 	ast_node* value;
+	bool is_const = false;	// 'const', the value is computed by the compiler
 };
 
 struct call {
@@ -78,8 +86,9 @@ enum struct loop_type {
 
 struct loop_node {
 	loop_type type;
-	ast_node* condition;
+	ast_node* condition;	// The generator iterated by 'for'
 	ast_node* scope;
+	std::string symbol;		// Loop variable of 'for'
 };
 
 enum struct comparison_type {
@@ -117,10 +126,27 @@ struct enum_def {
 	std::vector<std::string> values;
 };
 
+// a[i], and a[i] = value
+struct index_node {
+	ast_node* target;
+	ast_node* index;
+	ast_node* value;
+};
+
+// Type of a number literal, '1.5' is f64, '7i32' and '255u8' take a suffix.
+enum struct number_type {
+	i64,
+	f64,
+	i32,
+	u8,
+};
+
 struct ast_node {
 	ast_node_type type;
 
 	i64 as_number;
+	number_type as_number_type;
+	double as_f64;
 	bin_op as_bin_op;
 	std::vector<ast_node*> as_sequence;
 	call as_call;
@@ -137,158 +163,256 @@ struct ast_node {
 	object_init as_object_init;
 	loop_node as_loop;
 	enum_def as_enum_def;
+	ast_node* as_yield;
+	index_node as_index;
+};
+
+// Bump allocator for ast nodes. Each parsing thread fills its own arena so workers never contend on the heap.
+class ast_arena {
+public:
+	ast_arena() = default;
+	ast_arena(const ast_arena&) = delete;
+	ast_arena& operator=(const ast_arena&) = delete;
+	~ast_arena() {
+		for (i64 i = 0; i < (i64)mBlocks.size(); i++) {
+			i64 count = (i == (i64)mBlocks.size() - 1) ? mUsed : block_size;
+			for (i64 j = 0; j < count; j++) {
+				mBlocks[i][j].~ast_node();
+			}
+			std::allocator<ast_node>{}.deallocate(mBlocks[i], block_size);
+		}
+	}
+
+	ast_node* alloc(ast_node&& n) {
+		if (mBlocks.empty() || mUsed == block_size) {
+			mBlocks.push_back(std::allocator<ast_node>{}.allocate(block_size));
+			mUsed = 0;
+		}
+		return new (&mBlocks.back()[mUsed++]) ast_node(std::move(n));
+	}
+
+private:
+	static constexpr i64 block_size = 256;
+
+	std::vector<ast_node*> mBlocks;
+	i64 mUsed = 0;
 };
 
+// Arena used by the make_* constructors on this thread, nodes are heap allocated when none is set.
+thread_local ast_arena* current_arena = nullptr;
+
+ast_node* alloc_node(ast_node&& n) {
+	if (current_arena) {
+		return current_arena->alloc(std::move(n));
+	}
+	return new ast_node(std::move(n));
+}
+
 ast_node* make_enum(const std::string& name, const std::vector<std::string>& vals) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::enum_def,
 		.as_enum_def = {
 			.name = name,
 			.values = vals
 		}
-	};
+	});
 }
 
-ast_node* make_number(i64 v) {
-	return new ast_node{
+ast_node* make_number(i64 v, number_type type = number_type::i64) {
+	return alloc_node(ast_node{
 		.type = ast_node_type::number,
-		.as_number = { v }
-	};
+		.as_number = v,
+		.as_number_type = type
+	});
+}
+
+ast_node* make_float(double v) {
+	return alloc_node(ast_node{
+		.type = ast_node_type::number,
+		.as_number = 0,
+		.as_number_type = number_type::f64,
+		.as_f64 = v
+	});
 }
 
 ast_node* make_string(const std::string& val) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::string,
 		.as_string = val
-	};
+	});
 }
 
 ast_node* make_bin_op(ast_node* lhs, ast_node* rhs, bin_op_type type) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::bin_op,
 		.as_bin_op = {
 			.type = type,
 			.lhs = lhs,
 			.rhs = rhs
 		}
-	};
+	});
 }
 
 ast_node* make_sequence(std::vector<ast_node*> nodes) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::sequence,
 		.as_sequence = nodes
-	};
+	});
 }
 
 ast_node* make_call(const std::string& name, std::vector<ast_node*> nodes) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::call,
 		.as_call = {
 			.target = name,
 			.args = nodes
 		}
-	};
+	});
 }
 
-ast_node* make_lambda(ast_node* scope, const std::vector<argument_decl>& args) {
-	return new ast_node{
+ast_node* make_lambda(ast_node* scope, const std::vector<argument_decl>& args, const std::optional<std::string>& return_type) {
+	return alloc_node(ast_node{
 		.type = ast_node_type::lambda,
 		.as_lambda = {
 			.scope = scope,
-			.args = args
+			.args = args,
+			.return_type = return_type
 		}
-	};
+	});
 }
 
 ast_node* make_assign(const std::string& sym, ast_node* v) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::assign,
 		.as_assign = {
 			.symbol = sym,
 			.value = v
 		}
-	};
+	});
 }
 
 ast_node* make_initialize(argument_decl sym, ast_node* v) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::initialize,
 		.as_initialize = {
 			.symbol = sym,
 			.value = v
 		}
-	};
+	});
 }
 
 ast_node* make_symbol(const std::string& sym) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::symbol,
 		.as_symbol = sym
-	};
+	});
 }
 
 ast_node* make_if(ast_node* cond, ast_node* scope, ast_node* else_block) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::conditional,
 		.as_if = {
 			.condition = cond,
 			.scope = scope,
 			.else_scope = else_block
 		}
-	};
+	});
 }
 
 ast_node* make_comparison(ast_node* lhs, ast_node* rhs, comparison_type t) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::comparison,
 		.as_comparison = {
 			.type = t,
 			.lhs = lhs,
 			.rhs = rhs
 		}
-	};
+	});
 }
 
 ast_node* make_function(const std::string& symbol, ast_node* lambda) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::function,
 		.as_function = {
 			.symbol = symbol,
 			.lambda = lambda
 		}
-	};
+	});
 }
 
 ast_node* make_object_type(const std::string& name, const std::vector<argument_decl>& members) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::object_type,
 		.as_object_type = {
 			.name = name,
 			.members = members
 		}
-	};
+	});
 }
 
 ast_node* make_object_init(const std::string& name, const std::vector<std::pair<std::string, ast_node*>> vals) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::object_init,
 		.as_object_init = {
 			.type = name,
 			.initial_values = vals
 		}
-	};
+	});
 }
 
 ast_node* make_loop(ast_node* condition, ast_node* scope, loop_type t) {
-	return new ast_node{
+	return alloc_node(ast_node{
 		.type = ast_node_type::loop,
 		.as_loop = {
 			.type = t,
 			.condition = condition,
 			.scope = scope
 		}
-	};
+	});
+}
+
+ast_node* make_for(const std::string& symbol, ast_node* generator, ast_node* scope) {
+	return alloc_node(ast_node{
+		.type = ast_node_type::loop,
+		.as_loop = {
+			.type = loop_type::loop_for,
+			.condition = generator,
+			.scope = scope,
+			.symbol = symbol
+		}
+	});
+}
+
+ast_node* make_yield(ast_node* value) {
+	return alloc_node(ast_node{
+		.type = ast_node_type::yield,
+		.as_yield = value
+	});
+}
+
+ast_node* make_array(std::vector<ast_node*> elements) {
+	return alloc_node(ast_node{
+		.type = ast_node_type::array,
+		.as_sequence = elements
+	});
+}
+
+ast_node* make_index(ast_node* target, ast_node* index, ast_node* value) {
+	return alloc_node(ast_node{
+		.type = value ? ast_node_type::index_assign : ast_node_type::index,
+		.as_index = {
+			.target = target,
+			.index = index,
+			.value = value
+		}
+	});
+}
+
+ast_node* make_spawn(ast_node* call) {
+	return alloc_node(ast_node{
+		.type = ast_node_type::spawn,
+		.as_call = call->as_call
+	});
 }
 
 struct parse_context {
@@ -324,12 +448,36 @@ ast_node* parse_number(parse_context& ctx) {
 
 	ignore_ws(ctx);
 	if (is_num(ctx.peek())) {
+		i64 start = ctx.offset;
 		i64 v = 0;
 		do {
 			v *= 10;
 			v += (i64)(ctx.get() - '0');
 		} while (is_num(ctx.peek()));
-		return make_number(v);
+
+		bool is_float = ctx.peek() == '.' && is_num(ctx.src[ctx.offset + 1]);
+		double d = (double)v;
+		if (is_float) {
+			ctx.get();
+			while (is_num(ctx.peek())) {
+				ctx.get();
+			}
+			std::from_chars(ctx.src.data() + start, ctx.src.data() + ctx.offset, d);
+		}
+
+		// Suffixes only count when they end the literal, '1i32x' isn't a number. Fractions only take 'f64'.
+		for (auto [suffix, type] : { std::pair{ "f64", number_type::f64 }, std::pair{ "i32", number_type::i32 }, std::pair{ "u8", number_type::u8 }, std::pair{ "i64", number_type::i64 } }) {
+			i64 len = (i64)strlen(suffix);
+			char next = ctx.src[std::min<i64>(ctx.offset + len, (i64)ctx.src.size())];
+			if (ctx.src.compare(ctx.offset, len, suffix) == 0 && !is_in_alphabet(next) && !is_num(next) && next != '_') {
+				if (is_float && type != number_type::f64) {
+					break;
+				}
+				ctx.offset += len;
+				return (type == number_type::f64) ? make_float(d) : make_number(v, type);
+			}
+		}
+		return is_float ? make_float(d) : make_number(v);
 	}
 
 	ctx.offset = off;
@@ -344,7 +492,13 @@ ast_node* parse_string(parse_context& ctx) {
 		ctx.get(); // "
 		std::string tmp;
 		while (ctx.peek() != '\"') {
-			tmp.push_back(ctx.get());
+			char c = ctx.get();
+			// Escapes: \n, \t, \\ and \"
+			if (c == '\\') {
+				c = ctx.get();
+				c = (c == 'n') ? '\n' : (c == 't') ? '\t' : c;
+			}
+			tmp.push_back(c);
 		}
 		ctx.get(); // "
 		return make_string(tmp);
@@ -373,20 +527,52 @@ ast_node* parse_expr(parse_context& ctx);
 ast_node* parse_scope(parse_context& ctx);
 ast_node* parse_call(parse_context& ctx);
 
-
-ast_node* parse_add(parse_context& ctx) {
+// a, a.b, a[i][j]
+ast_node* parse_index(parse_context& ctx) {
 	i64 off = ctx.offset;
 
 	ignore_ws(ctx);
-	ast_node* lhs = parse_number(ctx);
-	if (!lhs) {
-		if (auto call = parse_call(ctx)) {
-			lhs = call;
+	auto sym = parse_symbol(ctx);
+	if (!sym) {
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ast_node* node = make_symbol(*sym);
+	while (true) {
+		i64 index_off = ctx.offset;
+		ignore_ws(ctx);
+		if (!parse_literal(ctx, "[")) {
+			ctx.offset = index_off;
+			break;
 		}
-		else if (auto sym = parse_symbol(ctx)) {
-			lhs = make_symbol(*sym);
+		ast_node* index = parse_expr(ctx);
+		ignore_ws(ctx);
+		if (!index || !parse_literal(ctx, "]")) {
+			ctx.offset = off;
+			return nullptr;
 		}
+		node = make_index(node, index, nullptr);
 	}
+	return node;
+}
+
+// Left hand side of a binary operation or comparison.
+ast_node* parse_operand(parse_context& ctx) {
+	if (auto num = parse_number(ctx)) {
+		return num;
+	}
+	if (auto call = parse_call(ctx)) {
+		return call;
+	}
+	return parse_index(ctx);
+}
+
+ast_node* parse_add(parse_context& ctx) {
+	i64 off = ctx.offset;
+
+	ignore_ws(ctx);
+	ast_node* lhs = parse_operand(ctx);
 	if (!lhs) {
 		ctx.offset = off;
 		return nullptr;
@@ -413,13 +599,7 @@ ast_node* parse_sub(parse_context& ctx) {
 	i64 off = ctx.offset;
 
 	ignore_ws(ctx);
-	ast_node* lhs = parse_number(ctx);
-	if (!lhs) {
-		auto sym = parse_symbol(ctx);
-		if (sym) {
-			lhs = make_symbol(*sym);
-		}
-	}
+	ast_node* lhs = parse_operand(ctx);
 	if (!lhs) {
 		ctx.offset = off;
 		return nullptr;
@@ -446,13 +626,7 @@ ast_node* parse_mul(parse_context& ctx) {
 	i64 off = ctx.offset;
 
 	ignore_ws(ctx);
-	ast_node* lhs = parse_number(ctx);
-	if (!lhs) {
-		auto sym = parse_symbol(ctx);
-		if (sym) {
-			lhs = make_symbol(*sym);
-		}
-	}
+	ast_node* lhs = parse_operand(ctx);
 	if (!lhs) {
 		ctx.offset = off;
 		return nullptr;
@@ -479,13 +653,7 @@ ast_node* parse_div(parse_context& ctx) {
 	i64 off = ctx.offset;
 
 	ignore_ws(ctx);
-	ast_node* lhs = parse_number(ctx);
-	if (!lhs) {
-		auto sym = parse_symbol(ctx);
-		if (sym) {
-			lhs = make_symbol(*sym);
-		}
-	}
+	ast_node* lhs = parse_operand(ctx);
 	if (!lhs) {
 		ctx.offset = off;
 		return nullptr;
@@ -616,6 +784,117 @@ ast_node* parse_while(parse_context& ctx) {
 	return make_loop(cond, scope, loop_type::loop_while);
 }
 
+// for (x in gen) { ... }
+ast_node* parse_for(parse_context& ctx) {
+	i64 off = ctx.offset;
+
+	ignore_ws(ctx);
+	if(!parse_literal(ctx, "for")){
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ignore_ws(ctx);
+	if(!parse_literal(ctx, "(")){
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ignore_ws(ctx);
+	auto sym = parse_symbol(ctx, false);
+	if (!sym) {
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ignore_ws(ctx);
+	if(!parse_literal(ctx, "in") || !is_ws(ctx.peek())){
+		ctx.error("Expected 'in' after the loop variable of 'for'.");
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ignore_ws(ctx);
+	ast_node* generator = parse_expr(ctx);
+	if (!generator) {
+		ctx.error("Expected an expression after 'in'.");
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ignore_ws(ctx);
+	if(!parse_literal(ctx, ")")){
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ignore_ws(ctx);
+	ast_node* scope = parse_scope(ctx);
+	if (!scope) {
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	return make_for(*sym, generator, scope);
+}
+
+// a[i] = value
+ast_node* parse_index_assign(parse_context& ctx) {
+	i64 off = ctx.offset;
+
+	ast_node* target = parse_index(ctx);
+	if (!target || target->type != ast_node_type::index) {
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ignore_ws(ctx);
+	if (!parse_literal(ctx, "=") || ctx.peek() == '=') {
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ast_node* value = parse_expr(ctx);
+	if (!value) {
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	return make_index(target->as_index.target, target->as_index.index, value);
+}
+
+// [a, b, c]
+ast_node* parse_array(parse_context& ctx) {
+	i64 off = ctx.offset;
+
+	ignore_ws(ctx);
+	if (!parse_literal(ctx, "[")) {
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	std::vector<ast_node*> elements;
+	ignore_ws(ctx);
+	if (!parse_literal(ctx, "]")) {
+		do {
+			ast_node* e = parse_expr(ctx);
+			if (!e) {
+				ctx.offset = off;
+				return nullptr;
+			}
+			elements.push_back(e);
+			ignore_ws(ctx);
+		} while (parse_literal(ctx, ","));
+
+		if (!parse_literal(ctx, "]")) {
+			ctx.offset = off;
+			return nullptr;
+		}
+	}
+
+	return make_array(elements);
+}
+
 ast_node* parse_assign(parse_context& ctx) {
 	i64 off = ctx.offset;
 
@@ -650,7 +929,11 @@ ast_node* parse_initialize(parse_context& ctx) {
 
 	ignore_ws(ctx);
 	auto let = parse_literal(ctx, "let");
-	if (!let) {
+	bool is_const = !let && parse_literal(ctx, "const");
+	if (is_const && (is_in_alphabet(ctx.peek()) || is_num(ctx.peek()) || ctx.peek() == '_')) {
+		is_const = false;
+	}
+	if (!let && !is_const) {
 		ctx.offset = off;
 		return nullptr;
 	}
@@ -658,7 +941,7 @@ ast_node* parse_initialize(parse_context& ctx) {
 	ignore_ws(ctx);
 	auto lhs = parse_argument_decl(ctx);
 	if (!lhs) {
-		ctx.error("No value decleration after 'let'.");
+		ctx.error(std::string("No value decleration after '") + (is_const ? "const" : "let") + "'.");
 		ctx.offset = off;
 		return nullptr;
 	}
@@ -666,7 +949,7 @@ ast_node* parse_initialize(parse_context& ctx) {
 	ignore_ws(ctx);
 	bool assign = parse_literal(ctx, "=");
 	if (!assign) {
-		ctx.error("No assignment after 'let'.");
+		ctx.error(std::string("No assignment after '") + (is_const ? "const" : "let") + "'.");
 		ctx.offset = off;
 		return nullptr;
 	}
@@ -679,7 +962,9 @@ ast_node* parse_initialize(parse_context& ctx) {
 		return nullptr;
 	}
 
-	return make_initialize(*lhs, rhs);
+	auto init = make_initialize(*lhs, rhs);
+	init->as_initialize.is_const = is_const;
+	return init;
 }
 
 ast_node* parse_object_initialize(parse_context& ctx) {
@@ -794,16 +1079,10 @@ ast_node* parse_comparison(parse_context& ctx) {
 	i64 off = ctx.offset;
 
 	ignore_ws(ctx);
-	ast_node* lhs = parse_number(ctx);
+	ast_node* lhs = parse_operand(ctx);
 	if (!lhs) {
-		auto sym = parse_symbol(ctx);
-		if (sym) {
-			lhs = make_symbol(*sym);
-		}
-		else {
-			ctx.offset = off;
-			return nullptr;
-		}
+		ctx.offset = off;
+		return nullptr;
 	}
 	
 	ignore_ws(ctx);
@@ -823,17 +1102,65 @@ ast_node* parse_comparison(parse_context& ctx) {
 	return make_comparison(lhs, rhs, cmp_t);
 }
 
+ast_node* parse_spawn(parse_context& ctx) {
+	i64 off = ctx.offset;
+
+	ignore_ws(ctx);
+	if (!parse_literal(ctx, "spawn") || !is_ws(ctx.peek())) {
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ignore_ws(ctx);
+	ast_node* call = parse_call(ctx);
+	if (!call) {
+		ctx.error("Expected a call after 'spawn'.");
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	return make_spawn(call);
+}
+
+ast_node* parse_yield(parse_context& ctx) {
+	i64 off = ctx.offset;
+
+	ignore_ws(ctx);
+	if (!parse_literal(ctx, "yield") || !is_ws(ctx.peek())) {
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	ast_node* value = parse_expr(ctx);
+	if (!value) {
+		ctx.error("Expected an expression after 'yield'.");
+		ctx.offset = off;
+		return nullptr;
+	}
+
+	return make_yield(value);
+}
+
 ast_node* parse_expr(parse_context& ctx) {
 	i64 off = ctx.offset;
 
 	ignore_ws(ctx);
 
+	ast_node* spawn = parse_spawn(ctx);
+	if (spawn) return spawn;
+
+	ast_node* yield = parse_yield(ctx);
+	if (yield) return yield;
+
 	ast_node* obj_init = parse_object_initialize(ctx);
 	if(obj_init) return obj_init;
 
 	ast_node* init = parse_initialize(ctx);
 	if (init) return init;
 
+	ast_node* index_assign = parse_index_assign(ctx);
+	if (index_assign) return index_assign;
+
 	ast_node* assign = parse_assign(ctx);
 	if (assign) return assign;
 
@@ -864,8 +1191,11 @@ ast_node* parse_expr(parse_context& ctx) {
 	ast_node* str = parse_string(ctx);
 	if(str) return str;
 
-	auto sym = parse_symbol(ctx);
-	if (sym) return make_symbol(*sym);
+	ast_node* arr = parse_array(ctx);
+	if (arr) return arr;
+
+	ast_node* index = parse_index(ctx);
+	if (index) return index;
 
 	ctx.offset = off;
 	return nullptr;
@@ -978,6 +1308,10 @@ ast_node* parse_statement(parse_context& ctx) {
 	if (while_loop) {
 		return while_loop;
 	}
+	ast_node* for_loop = parse_for(ctx);
+	if (for_loop) {
+		return for_loop;
+	}
 
 	ignore_ws(ctx);
 	ast_node* expr = parse_expr(ctx);
@@ -1041,6 +1375,57 @@ ast_node* parse_scope(parse_context& ctx) {
 	return seq;
 }
 
+// A type name with optional type parameters, 'gen<i64>'. Parameters are joined without spaces.
+// '[T]' is short for 'array<T>'.
+std::optional<std::string> parse_type_name(parse_context& ctx) {
+	i64 off = ctx.offset;
+
+	if (parse_literal(ctx, "[")) {
+		auto element = parse_type_name(ctx);
+		ignore_ws(ctx);
+		if (!element || !parse_literal(ctx, "]")) {
+			ctx.offset = off;
+			return {};
+		}
+		return "array<" + *element + ">";
+	}
+
+	auto name = parse_symbol(ctx, false);
+	if (!name) {
+		ctx.offset = off;
+		return {};
+	}
+
+	i64 params_off = ctx.offset;
+	ignore_ws(ctx);
+	if (!parse_literal(ctx, "<")) {
+		ctx.offset = params_off;
+		return name;
+	}
+
+	std::string type = *name + "<";
+	do {
+		ignore_ws(ctx);
+		auto param = parse_type_name(ctx);
+		if (!param) {
+			ctx.offset = off;
+			return {};
+		}
+		type += *param;
+		ignore_ws(ctx);
+		if (!parse_literal(ctx, ",")) {
+			break;
+		}
+		type += ",";
+	} while (true);
+
+	if (!parse_literal(ctx, ">")) {
+		ctx.offset = off;
+		return {};
+	}
+	return type + ">";
+}
+
 std::optional<argument_decl> parse_argument_decl(parse_context& ctx) {
 	i64 off = ctx.offset;
 	ignore_ws(ctx);
@@ -1059,7 +1444,7 @@ std::optional<argument_decl> parse_argument_decl(parse_context& ctx) {
 	}
 
 	ignore_ws(ctx);
-	auto type = parse_symbol(ctx);
+	auto type = parse_type_name(ctx);
 
 	if(!type) {
 		ctx.offset = off;
@@ -1111,19 +1496,46 @@ ast_node* parse_lambda(parse_context& ctx) {
 	bool arrow = parse_literal(ctx, "->");
 
 	ignore_ws(ctx);
-	auto rtype = parse_symbol(ctx);
+	auto rtype = parse_type_name(ctx);
 
 	ignore_ws(ctx);
 	auto scope = parse_scope(ctx);
 
 	if (o_paren && c_paren && arrow && scope) {
-		return make_lambda(scope, arg_names);
+		return make_lambda(scope, arg_names, rtype);
 	}
 
 	ctx.offset = off;
 	return nullptr;
 }
 
+// '<T, U>' after a function name.
+std::optional<std::vector<std::string>> parse_type_params(parse_context& ctx) {
+	i64 off = ctx.offset;
+
+	if (!parse_literal(ctx, "<")) {
+		return std::vector<std::string>{};
+	}
+
+	std::vector<std::string> params;
+	do {
+		ignore_ws(ctx);
+		auto param = parse_symbol(ctx, false);
+		if (!param) {
+			ctx.offset = off;
+			return {};
+		}
+		params.push_back(*param);
+		ignore_ws(ctx);
+	} while (parse_literal(ctx, ","));
+
+	if (!parse_literal(ctx, ">")) {
+		ctx.offset = off;
+		return {};
+	}
+	return params;
+}
+
 ast_node* parse_function(parse_context& ctx) {
 	i64 off = ctx.offset;
 
@@ -1140,6 +1552,13 @@ ast_node* parse_function(parse_context& ctx) {
 		return nullptr;
 	}
 
+	ignore_ws(ctx);
+	auto type_params = parse_type_params(ctx);
+	if (!type_params) {
+		ctx.offset = off;
+		return nullptr;
+	}
+
 	ignore_ws(ctx);
 	auto body = parse_lambda(ctx);
 	if (!body) {
@@ -1147,12 +1566,15 @@ ast_node* parse_function(parse_context& ctx) {
 		return nullptr;
 	}
 
+	body->as_lambda.type_params = *type_params;
 	return make_function(*symbol, body);
 }
 
 struct library {
 	std::vector<ast_node*> functions;
 	std::vector<ast_node*> object_types;
+	std::vector<ast_node*> constants;	// Top-level 'const' initializers, in source order
+	std::vector<std::shared_ptr<ast_arena>> arenas;
 };
 
 ast_node* parse_object_type(parse_context& ctx) {
@@ -1198,19 +1620,41 @@ ast_node* parse_object_type(parse_context& ctx) {
 	return make_object_type(*sym, members);
 }
 
+// 'const NAME = expr;' outside of a function.
+ast_node* parse_constant(parse_context& ctx) {
+	i64 off = ctx.offset;
+
+	auto init = parse_initialize(ctx);
+	if (!init || !init->as_initialize.is_const) {
+		ctx.offset = off;
+		return nullptr;
+	}
+	ignore_ws(ctx);
+	if (!parse_literal(ctx, ";")) {
+		ctx.error("No ';' after const '" + init->as_initialize.symbol.name + "'.");
+		ctx.offset = off;
+		return nullptr;
+	}
+	return init;
+}
+
 library parse_library(parse_context& ctx) {
 	std::vector<ast_node*> functions;
 	std::vector<ast_node*> object_types;
+	std::vector<ast_node*> constants;
 	do {
 		ignore_ws(ctx);
 		ast_node* n = nullptr;
-		if (n = parse_function(ctx)) {
+		if ((n = parse_function(ctx))) {
 			functions.push_back(n);
 		}
-		else if (n = parse_object_type(ctx)) {
+		else if ((n = parse_constant(ctx))) {
+			constants.push_back(n);
+		}
+		else if ((n = parse_object_type(ctx))) {
 			object_types.push_back(n);
 		}
-		else if (n = parse_enum(ctx)) {
+		else if ((n = parse_enum(ctx))) {
 			object_types.push_back(n);
 		}
 		else {
@@ -1219,14 +1663,109 @@ library parse_library(parse_context& ctx) {
 	} while(true);
 	return library {
 		.functions = functions,
-		.object_types = object_types
+		.object_types = object_types,
+		.constants = constants
 	};
 }
 
-std::pair<library, std::vector<std::string>> parse_ast(const std::string& src) {
+// Splits the source into top-level declarations by balancing braces. Every declaration ('fn', 'object', 'enum')
+// ends with the '}' closing its body, a constant initialized with an object with the ';' after it. String
+// literals are skipped so braces inside them don't count. Other constants stay with the declaration after them.
+std::vector<std::pair<i64, i64>> split_declarations(const std::string& src) {
+	std::vector<std::pair<i64, i64>> decls;
+	i64 start = 0;
+	i64 depth = 0;
+	for (i64 i = 0; i < (i64)src.size(); i++) {
+		char c = src[i];
+		if (c == '\"') {
+			i++;
+			while (i < (i64)src.size() && src[i] != '\"') {
+				i += (src[i] == '\\') ? 2 : 1;
+			}
+		}
+		else if (c == '{') {
+			depth++;
+		}
+		else if (c == '}') {
+			depth--;
+			if (depth == 0) {
+				i64 next = i + 1;
+				while (next < (i64)src.size() && is_ws(src[next])) {
+					next++;
+				}
+				if (next < (i64)src.size() && src[next] == ';') {
+					i = next;
+				}
+				decls.push_back({ start, i + 1 });
+				start = i + 1;
+			}
+		}
+	}
+	while (start < (i64)src.size() && is_ws(src[start])) {
+		start++;
+	}
+	if (start < (i64)src.size()) {
+		decls.push_back({ start, (i64)src.size() });
+	}
+	return decls;
+}
+
+struct parse_chunk {
+	library lib;
+	std::vector<std::string> errors;
+	bool complete;
+};
+
+parse_chunk parse_chunk_source(const std::string& src) {
+	auto arena = std::make_shared<ast_arena>();
+	current_arena = arena.get();
+
 	parse_context ctx{ src, 0 };
 	library lib = parse_library(ctx);
 	ignore_ws(ctx);
-	//assert(ctx.offset == ctx.src.size()); // need to consume everything
-	return { lib, ctx.errors };
+	lib.arenas.push_back(arena);
+
+	current_arena = nullptr;
+	return parse_chunk{
+		.lib = lib,
+		.errors = ctx.errors,
+		.complete = ctx.offset >= (i64)src.size()
+	};
+}
+
+std::pair<library, std::vector<std::string>> parse_ast(const std::string& src) {
+	// Small sources aren't worth the hand-off to worker threads.
+	constexpr i64 min_decls_per_worker = 16;
+
+	auto decls = split_declarations(src);
+	i64 workers = std::min(default_thread_pool().size(), (i64)decls.size() / min_decls_per_worker);
+	if (workers <= 1) {
+		auto chunk = parse_chunk_source(src);
+		return { chunk.lib, chunk.errors };
+	}
+
+	// Every worker parses a contiguous run of declarations so merging in worker order keeps source order.
+	std::vector<parse_chunk> chunks(workers);
+	default_thread_pool().run(workers, [&](i64 w) {
+		i64 first = (i64)decls.size() * w / workers;
+		i64 last = (i64)decls.size() * (w + 1) / workers;
+		i64 begin = decls[first].first;
+		i64 end = decls[last - 1].second;
+		chunks[w] = parse_chunk_source(src.substr(begin, end - begin));
+	});
+
+	library lib{};
+	std::vector<std::string> errors;
+	for (auto& chunk : chunks) {
+		lib.functions.insert(lib.functions.end(), chunk.lib.functions.begin(), chunk.lib.functions.end());
+		lib.object_types.insert(lib.object_types.end(), chunk.lib.object_types.begin(), chunk.lib.object_types.end());
+		lib.constants.insert(lib.constants.end(), chunk.lib.constants.begin(), chunk.lib.constants.end());
+		lib.arenas.insert(lib.arenas.end(), chunk.lib.arenas.begin(), chunk.lib.arenas.end());
+		errors.insert(errors.end(), chunk.errors.begin(), chunk.errors.end());
+		// A sequential parse stops at the first declaration it can't read, so do the same here.
+		if (!chunk.complete) {
+			break;
+		}
+	}
+	return { lib, errors };
 }
\ No newline at end of file
@@ -0,0 +1,325 @@
+#pragma once
+
+// Compiled programs are cached in 'program_cache_dir', one file per source by the hash of its contents. Bump
+// 'program_cache_version' whenever program or anything in it changes layout, files of other versions are ignored.
+const char* const program_cache_dir = ".flcache";
+constexpr i64 program_cache_version = 3;
+constexpr char program_cache_magic[8] = { 'F', 'L', 'P', 'R', 'O', 'G', 0, 0 };
+// Differs between builds of the compiler, a cache is only used by the build that wrote it.
+constexpr uint64_t program_cache_build = hash_string(__DATE__ " " __TIME__);
+
+std::string program_cache_path(uint64_t source_hash, const char* extension = "flc") {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.%s", (unsigned long long)source_hash, extension);
+	return std::string(program_cache_dir) + "/" + name;
+}
+
+// Appends integers in native byte order and strings and lists prefixed by their size. Caches never move between
+// machines, the header rejects files written by another build.
+class program_writer {
+public:
+	void put(i64 v) { append(&v, sizeof(v)); }
+	void put(const std::string& s) {
+		put((i64)s.size());
+		append(s.data(), (i64)s.size());
+	}
+	void put(const std::vector<std::string>& list) {
+		put((i64)list.size());
+		for (auto& s : list) {
+			put(s);
+		}
+	}
+	template<typename T, typename F>
+	void put(const std::vector<T>& list, F put_item) {
+		put((i64)list.size());
+		for (auto& item : list) {
+			put_item(item);
+		}
+	}
+	void append(const void* data, i64 size) { mBytes.append((const char*)data, (size_t)size); }
+
+	const std::string& bytes() const { return mBytes; }
+
+private:
+	std::string mBytes;
+};
+
+// Reads what program_writer wrote. Running past the end or reading a size larger than what's left marks the
+// reader as failed, everything read after that is empty.
+class program_reader {
+public:
+	program_reader(const char* data, i64 size) : mData(data), mSize(size) {}
+
+	bool ok() const { return mOk; }
+	bool at_end() const { return mOffset == mSize; }
+	std::string_view rest() const { return std::string_view(mData + mOffset, (size_t)(mSize - mOffset)); }
+
+	i64 get_i64() {
+		i64 v = 0;
+		read(&v, sizeof(v));
+		return v;
+	}
+	std::string get_string() {
+		i64 size = get_size(1);
+		std::string s(mData + mOffset, (size_t)size);
+		mOffset += size;
+		return s;
+	}
+	// The characters of a string in place, valid as long as the data being read.
+	std::string_view get_view() {
+		i64 size = get_size(1);
+		std::string_view s(mData + mOffset, (size_t)size);
+		mOffset += size;
+		return s;
+	}
+	std::vector<std::string> get_strings() {
+		std::vector<std::string> list(get_size(sizeof(i64)));
+		for (auto& s : list) {
+			s = get_string();
+		}
+		return list;
+	}
+	template<typename T, typename F>
+	std::vector<T> get_list(F get_item) {
+		std::vector<T> list(get_size(sizeof(i64)));
+		for (auto& item : list) {
+			item = get_item();
+		}
+		return list;
+	}
+	// A size followed by at least 'size * item_size' bytes, 0 if they aren't there.
+	i64 get_size(i64 item_size) {
+		i64 size = get_i64();
+		if (size < 0 || size > (mSize - mOffset) / item_size) {
+			mOk = false;
+			return 0;
+		}
+		return size;
+	}
+	void read(void* out, i64 size) {
+		if (!mOk || size > mSize - mOffset) {
+			mOk = false;
+			return;
+		}
+		if (size == 0) {
+			return;
+		}
+		memcpy(out, mData + mOffset, (size_t)size);
+		mOffset += size;
+	}
+
+private:
+	const char* mData;
+	i64 mSize;
+	i64 mOffset = 0;
+	bool mOk = true;
+};
+
+// Ends with a checksum of everything after the header.
+void write_header(program_writer& w, uint64_t source_hash, uint64_t checksum) {
+	w.append(program_cache_magic, sizeof(program_cache_magic));
+	w.put(program_cache_version);
+	w.put((i64)program_cache_build);
+	w.put((i64)sizeof(instruction));
+	w.put((i64)opcode::ret + 1);
+	w.put((i64)source_hash);
+	w.put((i64)checksum);
+}
+
+// Everything but the natives, load_program links those again by name.
+std::string serialize_program(const program& prog, uint64_t source_hash) {
+	program_writer w;
+	auto put_names = [&](const std::string& name, const std::vector<std::string>& names) {
+		w.put(name);
+		w.put(names);
+	};
+	w.put(prog.functions, [&](const function_proto& fn) {
+		w.put(fn.name);
+		w.put(fn.index);
+		w.put(fn.args, [&](const argument_decl& arg) {
+			w.put(arg.name);
+			w.put(arg.type ? 1 : 0);
+			w.put(arg.type.value_or(""));
+		});
+		w.put(fn.locals);
+		w.put(fn.captures);
+		w.put((i64)fn.code.size());
+		w.append(fn.code.data(), (i64)(fn.code.size() * sizeof(instruction)));
+		w.put(fn.generator ? 1 : 0);
+	});
+	w.put(prog.strings);
+	w.put(prog.object_types, [&](const object_shape& s) { put_names(s.name, s.members); });
+	w.put(prog.enums, [&](const enum_def& e) { put_names(e.name, e.values); });
+	w.put(prog.object_inits, [&](const object_init_desc& o) { put_names(o.type, o.members); });
+	w.put(prog.constants, [&](const constant_decl& c) {
+		w.put(c.name);
+		w.put(c.init);
+		w.put((i64)c.push);
+		w.put(c.is_array ? 1 : 0);
+		w.put(c.operands, [&](i64 operand) { w.put(operand); });
+	});
+	w.put(prog.builtins);
+	w.put(prog.globals, [&](const global_decl& g) {
+		w.put(g.name);
+		w.put(g.function);
+		w.put(g.enum_type);
+	});
+
+	program_writer file;
+	write_header(file, source_hash, hash_string(w.bytes()));
+	file.append(w.bytes().data(), (i64)w.bytes().size());
+	return file.bytes();
+}
+
+// Every index an instruction, constant or global holds refers to something in the program and every function
+// ends with 'ret'. The checksum already turns away damaged files, this keeps the bounds the VM doesn't check from
+// resting on the hash alone. Stack depths and operand types aren't verified, the bytecode is trusted beyond that.
+bool operands_in_range(const program& prog) {
+	auto in = [](i64 i, size_t size) { return i >= 0 && i < (i64)size; };
+	for (auto& fn : prog.functions) {
+		if (fn.code.empty() || fn.code.back().op != opcode::ret || fn.args.size() > fn.locals.size()) {
+			return false;
+		}
+		for (auto& ins : fn.code) {
+			bool ok = ins.b >= 0;
+			switch (ins.op) {
+				case opcode::push_string:
+				case opcode::get_member:
+				case opcode::set_member:	ok = ok && in(ins.a, prog.strings.size()); break;
+				case opcode::push_const:	ok = ok && in(ins.a, prog.constants.size()); break;
+				case opcode::push_fn:
+				case opcode::make_closure:	ok = ok && in(ins.a, prog.functions.size()); break;
+				case opcode::call:
+				case opcode::spawn:			ok = ok && in(ins.a, prog.functions.size()) && ins.b == (i64)prog.functions[ins.a].args.size(); break;
+				case opcode::load_local:
+				case opcode::store_local:	ok = ok && in(ins.a, fn.locals.size()); break;
+				case opcode::load_global:
+				case opcode::store_global:	ok = ok && in(ins.a, prog.globals.size()); break;
+				case opcode::load_capture:	ok = ok && in(ins.a, fn.captures.size()); break;
+				case opcode::call_builtin:	ok = ok && in(ins.a, prog.builtins.size()); break;
+				case opcode::new_object:	ok = ok && in(ins.a, prog.object_inits.size()); break;
+				case opcode::new_frame_object:	ok = ok && in(ins.a, prog.object_inits.size()) && in(ins.b, fn.locals.size()); break;
+				case opcode::jump:
+				case opcode::jump_if_false:
+				case opcode::next:			ok = ok && in(ins.a, fn.code.size()); break;
+				default:					ok = ok && ins.op > opcode::unknown && ins.op <= opcode::ret; break;
+			}
+			if (!ok) {
+				return false;
+			}
+		}
+	}
+	for (auto& c : prog.constants) {
+		if (!in(c.init, prog.functions.size())) {
+			return false;
+		}
+		for (i64 operand : c.operands) {
+			if (c.push == opcode::push_string && !in(operand, prog.strings.size())) {
+				return false;
+			}
+		}
+	}
+	for (auto& g : prog.globals) {
+		if (g.function >= 0 ? !in(g.function, prog.functions.size()) : !in(g.enum_type, prog.enums.size())) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Rebuilds a program from a cache file, nothing if it's damaged, for another source or from another format.
+std::optional<program> deserialize_program(const char* data, i64 size, uint64_t source_hash) {
+	program_reader r(data, size);
+	char magic[sizeof(program_cache_magic)] = {};
+	r.read(magic, sizeof(magic));
+	bool matches = memcmp(magic, program_cache_magic, sizeof(magic)) == 0
+		&& r.get_i64() == program_cache_version
+		&& r.get_i64() == (i64)program_cache_build
+		&& r.get_i64() == (i64)sizeof(instruction)
+		&& r.get_i64() == (i64)opcode::ret + 1
+		&& r.get_i64() == (i64)source_hash;
+	uint64_t checksum = (uint64_t)r.get_i64();
+	if (!r.ok() || !matches || checksum != hash_string(r.rest())) {
+		return std::nullopt;
+	}
+
+	program prog{};
+	prog.functions = r.get_list<function_proto>([&]() {
+		function_proto fn{};
+		fn.name = r.get_string();
+		fn.index = r.get_i64();
+		fn.args = r.get_list<argument_decl>([&]() {
+			argument_decl arg{ .name = r.get_string(), .type = {} };
+			bool has_type = r.get_i64() != 0;
+			auto type = r.get_string();
+			if (has_type) {
+				arg.type = std::move(type);
+			}
+			return arg;
+		});
+		fn.locals = r.get_strings();
+		fn.captures = r.get_strings();
+		fn.code.resize(r.get_size(sizeof(instruction)));
+		r.read(fn.code.data(), (i64)(fn.code.size() * sizeof(instruction)));
+		fn.generator = r.get_i64() != 0;
+		return fn;
+	});
+	prog.strings = r.get_strings();
+	prog.object_types = r.get_list<object_shape>([&]() { return object_shape{ .name = r.get_string(), .members = r.get_strings() }; });
+	prog.enums = r.get_list<enum_def>([&]() { return enum_def{ .name = r.get_string(), .values = r.get_strings() }; });
+	prog.object_inits = r.get_list<object_init_desc>([&]() { return object_init_desc{ .type = r.get_string(), .members = r.get_strings() }; });
+	prog.constants = r.get_list<constant_decl>([&]() {
+		constant_decl c{ .name = r.get_string() };
+		c.init = r.get_i64();
+		c.push = (opcode)r.get_i64();
+		c.is_array = r.get_i64() != 0;
+		c.operands = r.get_list<i64>([&]() { return r.get_i64(); });
+		return c;
+	});
+	prog.builtins = r.get_strings();
+	prog.globals = r.get_list<global_decl>([&]() { return global_decl{ .name = r.get_string(), .function = r.get_i64(), .enum_type = r.get_i64() }; });
+	if (!r.ok() || !r.at_end() || !operands_in_range(prog)) {
+		return std::nullopt;
+	}
+
+	for (auto& s : prog.strings) {
+		prog.string_hashes.push_back(hash_string(s));
+	}
+	return prog;
+}
+
+// Maps the cached program of a source, if there is a usable one.
+std::optional<program> load_cached_program(uint64_t source_hash) {
+	std::string error;
+	auto mapping = map_file(program_cache_path(source_hash), error);
+	if (!mapping) {
+		return std::nullopt;
+	}
+	return deserialize_program(mapping->data, mapping->size, source_hash);
+}
+
+// Written to a temporary file first, so a run reading the cache never sees half a file.
+bool write_cache_file(const std::string& path, const std::string& bytes) {
+	std::error_code ec;
+	std::filesystem::create_directories(program_cache_dir, ec);
+	auto tmp = path + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+	{
+		std::ofstream fs(tmp, std::ios::binary | std::ios::trunc);
+		if (!fs.write(bytes.data(), (std::streamsize)bytes.size())) {
+			fs.close();
+			std::filesystem::remove(tmp, ec);
+			return false;
+		}
+	}
+	std::filesystem::rename(tmp, path, ec);
+	if (ec) {
+		std::filesystem::remove(tmp, ec);
+		return false;
+	}
+	return true;
+}
+
+// Failing to write the cache only costs the next run its head start.
+void save_cached_program(const program& prog, uint64_t source_hash) {
+	write_cache_file(program_cache_path(source_hash), serialize_program(prog, source_hash));
+}
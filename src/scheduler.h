@@ -0,0 +1,148 @@
+#pragma once
+
+// CPU time the calling thread has used, time it spent preempted or blocked doesn't count.
+std::chrono::nanoseconds thread_cpu_time() {
+#if defined(_WIN32)
+	FILETIME creation, exit, kernel, user;
+	GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+	auto ticks = [](FILETIME t) { return ((uint64_t)t.dwHighDateTime << 32) | t.dwLowDateTime; };
+	return std::chrono::nanoseconds((i64)(ticks(kernel) + ticks(user)) * 100);
+#else
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+#endif
+}
+
+// One script running on the scheduler. Its VM keeps all the state, so a fiber can stop at any safe point
+// and continue later on any worker.
+struct fiber {
+	i64 id;
+	std::string name;
+	eval_context ctx;
+
+	bool done = false;
+	i64 result = -1;
+	std::vector<std::string> errors;
+
+	std::chrono::nanoseconds cpu_time{};	// CPU time of the threads running its slices, while they ran them
+	i64 slices = 0;
+};
+
+// Runs many fibers on a fixed thread pool. A fiber runs for a slice of at most 'slice_instructions' instructions
+// or 'slice_time', then goes to the back of the ready queue, so one script spinning in a loop can't keep the
+// others waiting for a worker.
+class fiber_scheduler {
+public:
+	using clock = std::chrono::steady_clock;
+
+	fiber_scheduler(thread_pool& pool, i64 slice_instructions = 100000, clock::duration slice_time = std::chrono::milliseconds(2))
+		: mPool(pool), mSliceInstructions(slice_instructions), mSliceTime(slice_time) {}
+
+	// Starts 'main' of the program on a new fiber, returns its id.
+	i64 spawn(std::shared_ptr<const program> prog, const std::string& name) {
+		auto f = std::make_unique<fiber>();
+		f->name = name;
+		f->ctx = make_context(std::move(prog));
+
+		auto main_fn = find_function(f->ctx, "main");
+		if (!main_fn) {
+			f->errors.push_back("(Runtime) No 'main' function.");
+			f->done = true;
+		}
+		else if (!main_fn->args.empty()) {
+			f->errors.push_back("(Runtime) 'main' can't take arguments when scripts run as fibers.");
+			f->done = true;
+		}
+		else {
+			push_frame(f->ctx, main_fn, 0);
+		}
+
+		std::lock_guard<std::mutex> lock(mLock);
+		f->id = (i64)mFibers.size();
+		if (!f->done) {
+			mReady.push_back(f.get());
+			mLive.fetch_add(1);
+			mPool.submit([this]() { run_next(); });
+		}
+		mFibers.push_back(std::move(f));
+		return mFibers.back()->id;
+	}
+
+	// Returns once every fiber finished, the calling thread runs slices meanwhile.
+	void wait() {
+		mPool.help_until([&]() { return mLive.load() == 0; });
+	}
+
+	const std::vector<std::unique_ptr<fiber>>& fibers() const { return mFibers; }
+
+private:
+	// Every ready fiber has one job queued for it, jobs take fibers in queue order.
+	void run_next() {
+		fiber* f = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			assert(!mReady.empty());
+			f = mReady.front();
+			mReady.pop_front();
+		}
+		run_slice(*f);
+		if (f->done) {
+			mLive.fetch_sub(1);
+			return;
+		}
+		// A suspended fiber takes no worker until its I/O completes.
+		if (f->ctx.pending && f->ctx.pending->then([this, f]() { make_ready(f); })) {
+			return;
+		}
+		make_ready(f);
+	}
+
+	void make_ready(fiber* f) {
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			mReady.push_back(f);
+		}
+		mPool.submit([this]() { run_next(); });
+	}
+
+	// The clock is read every 'check_interval' instructions, between those the VM only counts down its budget.
+	void run_slice(fiber& f) {
+		constexpr i64 check_interval = 1024;
+
+		auto start = clock::now();
+		auto cpu_start = thread_cpu_time();
+		auto now = start;
+		i64 remaining = mSliceInstructions;
+		run_status status;
+		do {
+			i64 step = std::min(remaining, check_interval);
+			f.ctx.budget = step;
+			status = f.ctx.pending ? resume(f.ctx, 0) : run(f.ctx, 0);
+			remaining -= step - f.ctx.budget;
+			now = clock::now();
+		} while (status == run_status::yielded && remaining > 0 && now - start < mSliceTime);
+
+		f.cpu_time += thread_cpu_time() - cpu_start;
+		f.slices++;
+
+		if (status == run_status::finished) {
+			assert(f.ctx.ret_value.type == value_type::i64);
+			f.result = f.ctx.ret_value.as_i64;
+			f.done = true;
+		}
+		else if (status == run_status::error) {
+			f.errors = f.ctx.errors;
+			f.done = true;
+		}
+	}
+
+	thread_pool& mPool;
+	i64 mSliceInstructions;
+	clock::duration mSliceTime;
+
+	std::mutex mLock;
+	std::vector<std::unique_ptr<fiber>> mFibers;
+	std::deque<fiber*> mReady;
+	std::atomic<i64> mLive = 0;
+};
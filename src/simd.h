@@ -0,0 +1,285 @@
+#pragma once
+
+// Kernels over dense i64 buffers. Every kernel has a scalar version and, on x86-64, SSE4.2 and AVX2 versions
+// compiled with per-function target attributes. The best set the CPU supports is picked once at startup, so the
+// binary still runs on machines without AVX2.
+// Arithmetic wraps around like the vector instructions do, the scalar versions compute in unsigned.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+#define SIMD_TARGET(isa)
+#else
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+struct simd_kernels {
+	const char* name;
+	i64 (*sum)(const i64* a, i64 n);
+	i64 (*min)(const i64* a, i64 n);	// n > 0
+	i64 (*max)(const i64* a, i64 n);	// n > 0
+	i64 (*dot)(const i64* a, const i64* b, i64 n);
+	void (*add)(i64* a, const i64* b, i64 n);	// a[i] += b[i]
+	void (*mul)(i64* a, const i64* b, i64 n);	// a[i] *= b[i]
+	void (*fill)(i64* a, i64 n, i64 v);
+	i64 (*find)(const i64* a, i64 n, i64 v);	// First index of v, -1 if there is none
+};
+
+namespace simd_scalar {
+	using u64 = uint64_t;
+
+	i64 sum(const i64* a, i64 n) {
+		u64 s = 0;
+		for (i64 i = 0; i < n; i++) s += (u64)a[i];
+		return (i64)s;
+	}
+	i64 min(const i64* a, i64 n) {
+		i64 m = a[0];
+		for (i64 i = 1; i < n; i++) m = std::min(m, a[i]);
+		return m;
+	}
+	i64 max(const i64* a, i64 n) {
+		i64 m = a[0];
+		for (i64 i = 1; i < n; i++) m = std::max(m, a[i]);
+		return m;
+	}
+	i64 dot(const i64* a, const i64* b, i64 n) {
+		u64 s = 0;
+		for (i64 i = 0; i < n; i++) s += (u64)a[i] * (u64)b[i];
+		return (i64)s;
+	}
+	void add(i64* a, const i64* b, i64 n) {
+		for (i64 i = 0; i < n; i++) a[i] = (i64)((u64)a[i] + (u64)b[i]);
+	}
+	void mul(i64* a, const i64* b, i64 n) {
+		for (i64 i = 0; i < n; i++) a[i] = (i64)((u64)a[i] * (u64)b[i]);
+	}
+	void fill(i64* a, i64 n, i64 v) {
+		for (i64 i = 0; i < n; i++) a[i] = v;
+	}
+	i64 find(const i64* a, i64 n, i64 v) {
+		for (i64 i = 0; i < n; i++) {
+			if (a[i] == v) return i;
+		}
+		return -1;
+	}
+}
+
+#if defined(SIMD_X86)
+// Two lanes per register. SSE4.2 is the first level with a 64-bit signed compare for min and max.
+namespace simd_sse42 {
+	SIMD_TARGET("sse4.2") i64 sum(const i64* a, i64 n) {
+		__m128i s0 = _mm_setzero_si128(), s1 = _mm_setzero_si128();
+		i64 i = 0;
+		for (; i + 4 <= n; i += 4) {
+			s0 = _mm_add_epi64(s0, _mm_loadu_si128((const __m128i*)(a + i)));
+			s1 = _mm_add_epi64(s1, _mm_loadu_si128((const __m128i*)(a + i + 2)));
+		}
+		alignas(16) i64 lanes[2];
+		_mm_store_si128((__m128i*)lanes, _mm_add_epi64(s0, s1));
+		return (i64)((uint64_t)simd_scalar::sum(a + i, n - i) + (uint64_t)lanes[0] + (uint64_t)lanes[1]);
+	}
+	SIMD_TARGET("sse4.2") i64 min(const i64* a, i64 n) {
+		if (n < 2) return simd_scalar::min(a, n);
+		__m128i m = _mm_loadu_si128((const __m128i*)a);
+		i64 i = 2;
+		for (; i + 2 <= n; i += 2) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(a + i));
+			m = _mm_blendv_epi8(m, v, _mm_cmpgt_epi64(m, v));
+		}
+		alignas(16) i64 lanes[2];
+		_mm_store_si128((__m128i*)lanes, m);
+		i64 r = std::min(lanes[0], lanes[1]);
+		return i < n ? std::min(r, simd_scalar::min(a + i, n - i)) : r;
+	}
+	SIMD_TARGET("sse4.2") i64 max(const i64* a, i64 n) {
+		if (n < 2) return simd_scalar::max(a, n);
+		__m128i m = _mm_loadu_si128((const __m128i*)a);
+		i64 i = 2;
+		for (; i + 2 <= n; i += 2) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(a + i));
+			m = _mm_blendv_epi8(m, v, _mm_cmpgt_epi64(v, m));
+		}
+		alignas(16) i64 lanes[2];
+		_mm_store_si128((__m128i*)lanes, m);
+		i64 r = std::max(lanes[0], lanes[1]);
+		return i < n ? std::max(r, simd_scalar::max(a + i, n - i)) : r;
+	}
+	// The low 64 bits of a product from three 32x32 multiplies, there is no 64-bit multiply before AVX-512.
+	SIMD_TARGET("sse4.2") __m128i mul_lo(__m128i x, __m128i y) {
+		__m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), y), _mm_mul_epu32(x, _mm_srli_epi64(y, 32)));
+		return _mm_add_epi64(_mm_mul_epu32(x, y), _mm_slli_epi64(cross, 32));
+	}
+	SIMD_TARGET("sse4.2") i64 dot(const i64* a, const i64* b, i64 n) {
+		__m128i s = _mm_setzero_si128();
+		i64 i = 0;
+		for (; i + 2 <= n; i += 2) {
+			s = _mm_add_epi64(s, mul_lo(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i))));
+		}
+		alignas(16) i64 lanes[2];
+		_mm_store_si128((__m128i*)lanes, s);
+		return (i64)((uint64_t)simd_scalar::dot(a + i, b + i, n - i) + (uint64_t)lanes[0] + (uint64_t)lanes[1]);
+	}
+	SIMD_TARGET("sse4.2") void add(i64* a, const i64* b, i64 n) {
+		i64 i = 0;
+		for (; i + 2 <= n; i += 2) {
+			__m128i v = _mm_add_epi64(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+			_mm_storeu_si128((__m128i*)(a + i), v);
+		}
+		simd_scalar::add(a + i, b + i, n - i);
+	}
+	SIMD_TARGET("sse4.2") void mul(i64* a, const i64* b, i64 n) {
+		i64 i = 0;
+		for (; i + 2 <= n; i += 2) {
+			__m128i v = mul_lo(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+			_mm_storeu_si128((__m128i*)(a + i), v);
+		}
+		simd_scalar::mul(a + i, b + i, n - i);
+	}
+	SIMD_TARGET("sse4.2") void fill(i64* a, i64 n, i64 v) {
+		__m128i x = _mm_set1_epi64x(v);
+		i64 i = 0;
+		for (; i + 2 <= n; i += 2) {
+			_mm_storeu_si128((__m128i*)(a + i), x);
+		}
+		simd_scalar::fill(a + i, n - i, v);
+	}
+	SIMD_TARGET("sse4.2") i64 find(const i64* a, i64 n, i64 v) {
+		__m128i x = _mm_set1_epi64x(v);
+		i64 i = 0;
+		for (; i + 2 <= n; i += 2) {
+			int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(_mm_loadu_si128((const __m128i*)(a + i)), x)));
+			if (mask) return i + (mask & 1 ? 0 : 1);
+		}
+		i64 r = simd_scalar::find(a + i, n - i, v);
+		return r < 0 ? -1 : i + r;
+	}
+}
+
+// Four lanes per register, sum and find check two registers per iteration.
+namespace simd_avx2 {
+	SIMD_TARGET("avx2") i64 reduce_add(__m256i v) {
+		alignas(32) i64 lanes[4];
+		_mm256_store_si256((__m256i*)lanes, v);
+		return (i64)((uint64_t)lanes[0] + (uint64_t)lanes[1] + (uint64_t)lanes[2] + (uint64_t)lanes[3]);
+	}
+	SIMD_TARGET("avx2") i64 sum(const i64* a, i64 n) {
+		__m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+		i64 i = 0;
+		for (; i + 8 <= n; i += 8) {
+			s0 = _mm256_add_epi64(s0, _mm256_loadu_si256((const __m256i*)(a + i)));
+			s1 = _mm256_add_epi64(s1, _mm256_loadu_si256((const __m256i*)(a + i + 4)));
+		}
+		return (i64)((uint64_t)reduce_add(_mm256_add_epi64(s0, s1)) + (uint64_t)simd_scalar::sum(a + i, n - i));
+	}
+	SIMD_TARGET("avx2") i64 min(const i64* a, i64 n) {
+		if (n < 4) return simd_scalar::min(a, n);
+		__m256i m = _mm256_loadu_si256((const __m256i*)a);
+		i64 i = 4;
+		for (; i + 4 <= n; i += 4) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)(a + i));
+			m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(m, v));
+		}
+		alignas(32) i64 lanes[4];
+		_mm256_store_si256((__m256i*)lanes, m);
+		i64 r = simd_scalar::min(lanes, 4);
+		return i < n ? std::min(r, simd_scalar::min(a + i, n - i)) : r;
+	}
+	SIMD_TARGET("avx2") i64 max(const i64* a, i64 n) {
+		if (n < 4) return simd_scalar::max(a, n);
+		__m256i m = _mm256_loadu_si256((const __m256i*)a);
+		i64 i = 4;
+		for (; i + 4 <= n; i += 4) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)(a + i));
+			m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(v, m));
+		}
+		alignas(32) i64 lanes[4];
+		_mm256_store_si256((__m256i*)lanes, m);
+		i64 r = simd_scalar::max(lanes, 4);
+		return i < n ? std::max(r, simd_scalar::max(a + i, n - i)) : r;
+	}
+	SIMD_TARGET("avx2") __m256i mul_lo(__m256i x, __m256i y) {
+		__m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), y), _mm256_mul_epu32(x, _mm256_srli_epi64(y, 32)));
+		return _mm256_add_epi64(_mm256_mul_epu32(x, y), _mm256_slli_epi64(cross, 32));
+	}
+	SIMD_TARGET("avx2") i64 dot(const i64* a, const i64* b, i64 n) {
+		__m256i s = _mm256_setzero_si256();
+		i64 i = 0;
+		for (; i + 4 <= n; i += 4) {
+			s = _mm256_add_epi64(s, mul_lo(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i))));
+		}
+		return (i64)((uint64_t)reduce_add(s) + (uint64_t)simd_scalar::dot(a + i, b + i, n - i));
+	}
+	SIMD_TARGET("avx2") void add(i64* a, const i64* b, i64 n) {
+		i64 i = 0;
+		for (; i + 4 <= n; i += 4) {
+			__m256i v = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+			_mm256_storeu_si256((__m256i*)(a + i), v);
+		}
+		simd_scalar::add(a + i, b + i, n - i);
+	}
+	SIMD_TARGET("avx2") void mul(i64* a, const i64* b, i64 n) {
+		i64 i = 0;
+		for (; i + 4 <= n; i += 4) {
+			__m256i v = mul_lo(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+			_mm256_storeu_si256((__m256i*)(a + i), v);
+		}
+		simd_scalar::mul(a + i, b + i, n - i);
+	}
+	SIMD_TARGET("avx2") void fill(i64* a, i64 n, i64 v) {
+		__m256i x = _mm256_set1_epi64x(v);
+		i64 i = 0;
+		for (; i + 4 <= n; i += 4) {
+			_mm256_storeu_si256((__m256i*)(a + i), x);
+		}
+		simd_scalar::fill(a + i, n - i, v);
+	}
+	SIMD_TARGET("avx2") i64 find(const i64* a, i64 n, i64 v) {
+		__m256i x = _mm256_set1_epi64x(v);
+		i64 i = 0;
+		for (; i + 8 <= n; i += 8) {
+			__m256i e0 = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(a + i)), x);
+			__m256i e1 = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(a + i + 4)), x);
+			int mask = _mm256_movemask_pd(_mm256_castsi256_pd(e0)) | (_mm256_movemask_pd(_mm256_castsi256_pd(e1)) << 4);
+			if (mask) return i + std::countr_zero((unsigned)mask);
+		}
+		i64 r = simd_scalar::find(a + i, n - i, v);
+		return r < 0 ? -1 : i + r;
+	}
+}
+
+bool cpu_supports(const char* isa) {
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	if (strcmp(isa, "avx2") == 0) {
+		if (max_leaf < 7) return false;
+		// AVX2 also needs the OS to save the upper halves of the registers.
+		__cpuid(info, 1);
+		bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+		__cpuidex(info, 7, 0);
+		return os_avx && (info[1] & (1 << 5));
+	}
+	__cpuid(info, 1);
+	return info[2] & (1 << 20);
+#else
+	__builtin_cpu_init();
+	return strcmp(isa, "avx2") == 0 ? __builtin_cpu_supports("avx2") : __builtin_cpu_supports("sse4.2");
+#endif
+}
+#endif
+
+const simd_kernels& simd() {
+	static const simd_kernels kernels = []() {
+#define SIMD_KERNELS(ns, label) simd_kernels{ label, ns::sum, ns::min, ns::max, ns::dot, ns::add, ns::mul, ns::fill, ns::find }
+#if defined(SIMD_X86)
+		if (cpu_supports("avx2")) return SIMD_KERNELS(simd_avx2, "avx2");
+		if (cpu_supports("sse4.2")) return SIMD_KERNELS(simd_sse42, "sse4.2");
+#endif
+		return SIMD_KERNELS(simd_scalar, "scalar");
+#undef SIMD_KERNELS
+	}();
+	return kernels;
+}
@@ -0,0 +1,378 @@
+#pragma once
+
+// A snapshot is the compiled program together with the value its 'init' function returned, stored next to the
+// program cache. Runs of the same source map it and pass the value to 'main' without running 'init' again.
+constexpr i64 snapshot_version = 2;
+constexpr char snapshot_magic[8] = { 'F', 'L', 'S', 'N', 'A', 'P', 0, 0 };
+
+// Writes a value and everything it reaches. Shared data gets an id the first time it's written and later copies
+// only refer to it, so sharing and cycles survive the round trip. Tasks and generators can't be stored.
+class heap_writer {
+public:
+	heap_writer(program_writer& out, const program& prog) : mOut(out), mProg(prog) {}
+
+	const std::vector<std::string>& errors() const { return mErrors; }
+
+	void put(const value& v) {
+		mOut.put((i64)v.type);
+		switch (v.type) {
+			case value_type::i64:
+			case value_type::i32:
+			case value_type::u8:
+			{
+				mOut.put(v.as_i64);
+				break;
+			}
+			case value_type::f64:
+			{
+				mOut.put(std::bit_cast<i64>(v.as_f64));
+				break;
+			}
+			case value_type::string:
+			{
+				mOut.put(std::string(v.as_string.view()));
+				break;
+			}
+			case value_type::function:
+			{
+				mOut.put((i64)(v.as_function - mProg.functions.data()));
+				mOut.put(v.as_captures() ? 1 : 0);
+				if (v.as_captures() && put_ref(v.as_captures())) {
+					mOut.put((i64)v.as_captures()->size());
+					for (auto& c : *v.as_captures()) {
+						put(c);
+					}
+				}
+				break;
+			}
+			case value_type::object:
+			{
+				if (put_ref(v.as_object)) {
+					mOut.put(v.as_object->type_name);
+					mOut.put(v.as_object->members, [&](const std::pair<std::string, value>& m) {
+						mOut.put(m.first);
+						put(m.second);
+					});
+				}
+				break;
+			}
+			case value_type::array:
+			{
+				if (put_ref(v.as_array())) {
+					put_array(*v.as_array());
+				}
+				break;
+			}
+			case value_type::buffer:
+			{
+				if (put_ref(v.as_buffer())) {
+					mOut.put(v.as_buffer()->size);
+					mOut.append(v.as_buffer()->data, v.as_buffer()->size * (i64)sizeof(i64));
+				}
+				break;
+			}
+			case value_type::map:
+			{
+				if (put_ref(v.as_map())) {
+					mOut.put(v.as_map()->size());
+					for (auto& e : v.as_map()->entries) {
+						if (e.live) {
+							put(e.key);
+							put(e.val);
+						}
+					}
+				}
+				break;
+			}
+			case value_type::columns:
+			case value_type::row:
+			{
+				if (v.type == value_type::row) {
+					mOut.put(v.as_i64);
+				}
+				if (put_ref(v.as_columns())) {
+					auto& cols = *v.as_columns();
+					mOut.put(cols.type_name);
+					mOut.put(cols.members);
+					mOut.put(cols.rows);
+					for (auto& column : cols.columns) {
+						put_array(column);
+					}
+				}
+				break;
+			}
+			default:
+			{
+				mErrors.push_back("(Snapshot) A '" + get_value_type(v) + "' can't be stored in a snapshot.");
+				break;
+			}
+		}
+	}
+
+private:
+	// Writes the id of shared data, true the first time it's seen and its contents have to follow.
+	bool put_ref(const void* data) {
+		auto [it, added] = mIds.emplace(data, (i64)mIds.size());
+		mOut.put(it->second);
+		return added;
+	}
+
+	// Packed elements are written as they are, boxed ones one by one.
+	void put_array(const array_data& arr) {
+		mOut.put(arr.is_boxed ? 1 : 0);
+		mOut.put(arr.count);
+		if (arr.is_boxed) {
+			for (auto& e : arr.boxed) {
+				put(e);
+			}
+		}
+		else {
+			mOut.put((i64)arr.dense);
+			mOut.put((i64)arr.packed.size());
+			mOut.append(arr.packed.data(), (i64)arr.packed.size());
+		}
+	}
+
+	program_writer& mOut;
+	const program& mProg;
+	std::unordered_map<const void*, i64> mIds;
+	std::vector<std::string> mErrors;
+};
+
+// Reads what heap_writer wrote. Strings point into the snapshot, 'owner' keeps it mapped while they're alive.
+class heap_reader {
+public:
+	heap_reader(program_reader& in, const program& prog, std::shared_ptr<const void> owner)
+		: mIn(in), mProg(prog), mOwner(std::move(owner)) {}
+
+	bool ok() const { return mOk && mIn.ok(); }
+
+	value get() {
+		if (!ok()) {
+			return {};
+		}
+		auto type = (value_type)mIn.get_i64();
+		switch (type) {
+			case value_type::i64:	return make_i64(mIn.get_i64());
+			case value_type::f64:	return make_f64(std::bit_cast<double>(mIn.get_i64()));
+			case value_type::i32:	return make_i32((int32_t)mIn.get_i64());
+			case value_type::u8:	return make_u8((uint8_t)mIn.get_i64());
+			case value_type::string:
+			{
+				auto s = mIn.get_view();
+				return value{ .type = value_type::string, .as_string = { .data = s.data(), .size = (i64)s.size(), .hash = 0 }, .handle = mOwner };
+			}
+			case value_type::function:
+			{
+				i64 fn = mIn.get_i64();
+				bool has_captures = mIn.get_i64() != 0;
+				if (fn < 0 || fn >= (i64)mProg.functions.size()) {
+					mOk = false;
+					return {};
+				}
+				value v{ .type = value_type::function, .as_function = &mProg.functions[fn] };
+				if (has_captures) {
+					auto captures = std::make_shared<std::vector<value>>();
+					v.handle = get_shared(value_type::function, [&]() { return value{ .type = value_type::function, .handle = captures }; }, [&](value&) {
+						captures->resize(mIn.get_size(sizeof(i64)));
+						for (auto& c : *captures) {
+							c = get();
+						}
+					}).handle;
+				}
+				// load_capture trusts the function to come with all of its captures.
+				size_t count = v.as_captures() ? v.as_captures()->size() : 0;
+				if (!ok() || count != v.as_function->captures.size()) {
+					mOk = false;
+					return {};
+				}
+				return v;
+			}
+			case value_type::object:
+			{
+				return get_shared(value_type::object, [&]() { return value{ .type = value_type::object, .as_object = new object_data{} }; }, [&](value& v) {
+					v.as_object->type_name = mIn.get_string();
+					v.as_object->members = mIn.get_list<std::pair<std::string, value>>([&]() {
+						auto name = mIn.get_string();
+						return std::pair{ std::move(name), get() };
+					});
+				});
+			}
+			case value_type::array:
+			{
+				return get_shared(value_type::array, [&]() { return value{ .type = value_type::array, .handle = std::make_shared<array_data>() }; }, [&](value& v) {
+					get_array(*v.as_array());
+				});
+			}
+			case value_type::buffer:
+			{
+				return get_shared(value_type::buffer, [&]() { return make_buffer(std::make_shared<i64_buffer>(mIn.get_size(sizeof(i64)))); }, [&](value& v) {
+					mIn.read(v.as_buffer()->data, v.as_buffer()->size * (i64)sizeof(i64));
+				});
+			}
+			case value_type::map:
+			{
+				return get_shared(value_type::map, [&]() { return value{ .type = value_type::map, .handle = std::make_shared<map_data>() }; }, [&](value& v) {
+					for (i64 n = mIn.get_size(2 * sizeof(i64)); n > 0 && ok(); n--) {
+						value key = get();
+						if (!is_map_key(key)) {
+							mOk = false;
+							return;
+						}
+						v.as_map()->insert(std::move(key), get());
+					}
+				});
+			}
+			case value_type::columns:
+			case value_type::row:
+			{
+				i64 row = type == value_type::row ? mIn.get_i64() : 0;
+				value cols = get_shared(value_type::columns, [&]() { return value{ .type = value_type::columns, .handle = std::make_shared<columns_data>() }; }, [&](value& v) {
+					auto& c = *v.as_columns();
+					c.type_name = mIn.get_string();
+					c.members = mIn.get_strings();
+					c.rows = mIn.get_i64();
+					c.columns.resize(c.members.size());
+					for (auto& column : c.columns) {
+						get_array(column);
+						mOk = mOk && column.size() == c.rows;
+					}
+				});
+				if (type == value_type::columns) {
+					return cols;
+				}
+				if (!ok() || row < 0 || row >= cols.as_columns()->rows) {
+					mOk = false;
+					return {};
+				}
+				return make_row(cols, row);
+			}
+			default:	break;
+		}
+		mOk = false;
+		return {};
+	}
+
+private:
+	// Shared data read before, or made by 'make' and read by 'fill' now. It's registered before it's filled in,
+	// so cycles find it. Copies of a value share its data, filling the copy fills the registered one. Data read
+	// before has to be of the 'type' asked for, an id can't turn an array into a map.
+	template<typename M, typename F>
+	value get_shared(value_type type, M make, F fill) {
+		i64 id = mIn.get_i64();
+		if (id >= 0 && id < (i64)mShared.size()) {
+			if (mShared[id].type != type) {
+				mOk = false;
+				return {};
+			}
+			return mShared[id];
+		}
+		if (id != (i64)mShared.size()) {
+			mOk = false;
+			return {};
+		}
+		value shared = make();
+		mShared.push_back(shared);
+		fill(shared);
+		return shared;
+	}
+
+	void get_array(array_data& arr) {
+		bool boxed = mIn.get_i64() != 0;
+		i64 count = mIn.get_i64();
+		if (boxed) {
+			for (i64 i = 0; i < count && ok(); i++) {
+				value v = get();
+				if (!ok()) {
+					return;
+				}
+				arr.push(std::move(v));
+			}
+			return;
+		}
+		arr.dense = (value_type)mIn.get_i64();
+		i64 size = scalar_size(arr.dense);
+		// Only an empty array has no dense type, a packed one never holds anything but scalars.
+		if (count < 0 || (size == 0 && (count > 0 || arr.dense != value_type::unknown))) {
+			mOk = false;
+			return;
+		}
+		arr.packed.resize(mIn.get_size(1));
+		mIn.read(arr.packed.data(), (i64)arr.packed.size());
+		arr.count = count;
+		mOk = mOk && (i64)arr.packed.size() == count * size;
+	}
+
+	program_reader& mIn;
+	const program& mProg;
+	std::shared_ptr<const void> mOwner;
+	std::vector<value> mShared;
+	bool mOk = true;
+};
+
+struct snapshot {
+	std::shared_ptr<const program> prog;
+	value state;	// What 'init' returned
+};
+
+// Runs 'init' of a built program and writes the program together with everything its result reaches.
+std::vector<std::string> save_snapshot(const std::shared_ptr<const program>& prog, uint64_t source_hash) {
+	eval_context vm = make_context(prog);
+	auto init_fn = find_function(vm, "init");
+	if (!init_fn || !init_fn->args.empty()) {
+		return { "(Snapshot) The source needs an 'init' function without arguments." };
+	}
+	if (call_function(vm, init_fn, {}) != run_status::finished) {
+		return vm.errors;
+	}
+
+	program_writer w;
+	w.append(snapshot_magic, sizeof(snapshot_magic));
+	w.put(snapshot_version);
+	w.put((i64)source_hash);
+	w.put(serialize_program(*prog, source_hash));
+	heap_writer heap(w, *prog);
+	heap.put(vm.ret_value);
+	if (!heap.errors().empty()) {
+		return heap.errors();
+	}
+	auto path = program_cache_path(source_hash, "fli");
+	if (!write_cache_file(path, w.bytes())) {
+		return { "(Snapshot) Can't write '" + path + "'." };
+	}
+	return {};
+}
+
+// Maps the snapshot of a source, if there is a usable one. The program is linked like a freshly built one.
+std::optional<snapshot> load_snapshot(uint64_t source_hash) {
+	std::string error;
+	auto mapping = map_file(program_cache_path(source_hash, "fli"), error);
+	if (!mapping) {
+		return std::nullopt;
+	}
+	program_reader r(mapping->data, mapping->size);
+	char magic[sizeof(snapshot_magic)] = {};
+	r.read(magic, sizeof(magic));
+	bool matches = memcmp(magic, snapshot_magic, sizeof(magic)) == 0
+		&& r.get_i64() == snapshot_version
+		&& r.get_i64() == (i64)source_hash;
+	if (!r.ok() || !matches) {
+		return std::nullopt;
+	}
+	auto prog_bytes = r.get_view();
+	auto prog = deserialize_program(prog_bytes.data(), (i64)prog_bytes.size(), source_hash);
+	if (!prog) {
+		return std::nullopt;
+	}
+
+	snapshot snap{ .prog = load_program(std::move(*prog)), .state = {} };
+	if (!natives_linked(*snap.prog)) {
+		return std::nullopt;
+	}
+	heap_reader heap(r, *snap.prog, mapping);
+	snap.state = heap.get();
+	if (!heap.ok() || !r.at_end()) {
+		return std::nullopt;
+	}
+	return snap;
+}
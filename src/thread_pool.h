@@ -0,0 +1,167 @@
+#pragma once
+
+using i64 = int64_t;
+
+// Work-stealing pool. Every worker owns a deque: it pushes and pops its own jobs at the back, idle workers steal
+// the oldest jobs from the front of the others. Threads outside the pool submit to a shared queue.
+// Waiting is done by running other jobs (help_until), so jobs may submit and wait on further jobs without deadlocking.
+// A waiter with nothing to run sleeps until a job is submitted or finishes.
+class thread_pool {
+public:
+	using job = std::function<void()>;
+
+	thread_pool(i64 worker_count) {
+		for (i64 i = 0; i <= worker_count; i++) {
+			mQueues.push_back(std::make_unique<job_queue>());
+		}
+		for (i64 i = 0; i < worker_count; i++) {
+			mWorkers.emplace_back([this, i]() { worker_loop(i); });
+		}
+	}
+	~thread_pool() {
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			mShutdown = true;
+		}
+		mWake.notify_all();
+		for (auto& w : mWorkers) {
+			w.join();
+		}
+	}
+
+	i64 size() const { return (i64)mQueues.size(); }
+
+	void submit(job j) {
+		i64 q = (tPool == this) ? tIndex : shared_queue();
+		{
+			std::lock_guard<std::mutex> lock(mQueues[q]->lock);
+			mQueues[q]->jobs.push_back(std::move(j));
+		}
+		mPending.fetch_add(1);
+		if (mSleeping.load() > 0) {
+			std::lock_guard<std::mutex> lock(mLock);
+			mWake.notify_one();
+		}
+		wake_helpers();
+	}
+
+	// Runs queued jobs on the calling thread until 'done' returns true. 'done' may only become true when a job
+	// finishes or wake_helpers is called, that's when a parked waiter checks it again.
+	void help_until(const std::function<bool()>& done) {
+		i64 self = (tPool == this) ? tIndex : shared_queue();
+		while (!done()) {
+			if (run_one(self)) {
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mLock);
+			mHelpers.fetch_add(1);
+			mHelped.wait(lock, [&]() { return done() || mPending.load() > 0; });
+			mHelpers.fetch_sub(1);
+		}
+	}
+
+	// Has parked waiters check 'done' again, for waits on something that finishes outside of a job.
+	void wake_helpers() {
+		if (mHelpers.load() > 0) {
+			std::lock_guard<std::mutex> lock(mLock);
+			mHelped.notify_all();
+		}
+	}
+
+	// Runs job(0..count-1) and returns once every one of them has finished, the calling thread takes part.
+	void run(i64 count, const std::function<void(i64)>& job) {
+		if (mQueues.size() == 1 || count <= 1) {
+			for (i64 i = 0; i < count; i++) {
+				job(i);
+			}
+			return;
+		}
+		std::atomic<i64> remaining = count;
+		for (i64 i = 0; i < count; i++) {
+			submit([&job, &remaining, i]() {
+				job(i);
+				remaining.fetch_sub(1);
+			});
+		}
+		help_until([&]() { return remaining.load() == 0; });
+	}
+
+private:
+	struct job_queue {
+		std::mutex lock;
+		std::deque<job> jobs;
+	};
+
+	i64 shared_queue() const { return (i64)mQueues.size() - 1; }
+
+	bool take(i64 q, bool newest, job& out) {
+		std::lock_guard<std::mutex> lock(mQueues[q]->lock);
+		auto& jobs = mQueues[q]->jobs;
+		if (jobs.empty()) {
+			return false;
+		}
+		if (newest) {
+			out = std::move(jobs.back());
+			jobs.pop_back();
+		}
+		else {
+			out = std::move(jobs.front());
+			jobs.pop_front();
+		}
+		mPending.fetch_sub(1);
+		return true;
+	}
+
+	// Own queue first, newest job first. Then the shared queue, then the oldest job of every other worker.
+	bool run_one(i64 self) {
+		job j;
+		bool found = take(self, true, j) || take(shared_queue(), false, j);
+		for (i64 i = 1; !found && i < (i64)mQueues.size(); i++) {
+			found = take((self + i) % (i64)mQueues.size(), false, j);
+		}
+		if (found) {
+			j();
+			wake_helpers();
+		}
+		return found;
+	}
+
+	void worker_loop(i64 index) {
+		tPool = this;
+		tIndex = index;
+		while (true) {
+			if (run_one(index)) {
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mLock);
+			mSleeping.fetch_add(1);
+			mWake.wait(lock, [&]() { return mShutdown || mPending.load() > 0; });
+			mSleeping.fetch_sub(1);
+			if (mShutdown && mPending.load() == 0) {
+				return;
+			}
+		}
+	}
+
+	std::vector<std::thread> mWorkers;
+	std::vector<std::unique_ptr<job_queue>> mQueues;	// One per worker, the last one is shared
+
+	std::mutex mLock;
+	std::condition_variable mWake;
+	bool mShutdown = false;
+	std::atomic<i64> mPending = 0;
+	std::atomic<i64> mSleeping = 0;
+	std::condition_variable mHelped;	// Threads parked in help_until
+	std::atomic<i64> mHelpers = 0;
+
+	static thread_local thread_pool* tPool;
+	static thread_local i64 tIndex;
+};
+
+thread_local thread_pool* thread_pool::tPool = nullptr;
+thread_local i64 thread_pool::tIndex = 0;
+
+thread_pool& default_thread_pool() {
+	static thread_pool pool(std::max<i64>((i64)std::thread::hardware_concurrency() - 1, 0));
+	return pool;
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+// Object types and enums named by a type like 'columns<Person>' or '[Pixel]'. Builtin types and type
+// parameters come along too, they just never match a declaration.
+void collect_type_names(const std::optional<std::string>& type, std::vector<std::string>& names) {
+	if (!type) {
+		return;
+	}
+	std::string name;
+	for (char c : *type + " ") {
+		if (isalnum(c) || c == '_') {
+			name += c;
+		}
+		else if (!name.empty()) {
+			names.push_back(std::move(name));
+			name.clear();
+		}
+	}
+}
+
+// Every top-level name a node can refer to, by the first element of its path.
+void collect_references(const ast_node* node, std::vector<std::string>& names) {
+	if (!node) {
+		return;
+	}
+	auto root = [](const std::string& name) { return name.substr(0, name.find('.')); };
+
+	switch (node->type) {
+		case ast_node_type::symbol:
+		{
+			names.push_back(root(node->as_symbol));
+			break;
+		}
+		case ast_node_type::bin_op:
+		{
+			collect_references(node->as_bin_op.lhs, names);
+			collect_references(node->as_bin_op.rhs, names);
+			break;
+		}
+		case ast_node_type::comparison:
+		{
+			collect_references(node->as_comparison.lhs, names);
+			collect_references(node->as_comparison.rhs, names);
+			break;
+		}
+		case ast_node_type::sequence:
+		case ast_node_type::array:
+		{
+			for (auto& s : node->as_sequence) {
+				collect_references(s, names);
+			}
+			break;
+		}
+		case ast_node_type::call:
+		case ast_node_type::spawn:
+		{
+			names.push_back(root(node->as_call.target));
+			for (auto& arg : node->as_call.args) {
+				collect_references(arg, names);
+			}
+			break;
+		}
+		case ast_node_type::lambda:
+		{
+			for (auto& arg : node->as_lambda.args) {
+				collect_type_names(arg.type, names);
+			}
+			collect_type_names(node->as_lambda.return_type, names);
+			collect_references(node->as_lambda.scope, names);
+			break;
+		}
+		case ast_node_type::function:
+		{
+			collect_references(node->as_function.lambda, names);
+			break;
+		}
+		case ast_node_type::initialize:
+		{
+			collect_type_names(node->as_initialize.symbol.type, names);
+			collect_references(node->as_initialize.value, names);
+			break;
+		}
+		case ast_node_type::assign:
+		{
+			names.push_back(root(node->as_assign.symbol));
+			collect_references(node->as_assign.value, names);
+			break;
+		}
+		case ast_node_type::conditional:
+		{
+			collect_references(node->as_if.condition, names);
+			collect_references(node->as_if.scope, names);
+			collect_references(node->as_if.else_scope, names);
+			break;
+		}
+		case ast_node_type::loop:
+		{
+			collect_references(node->as_loop.condition, names);
+			collect_references(node->as_loop.scope, names);
+			break;
+		}
+		case ast_node_type::yield:
+		{
+			collect_references(node->as_yield, names);
+			break;
+		}
+		case ast_node_type::index:
+		case ast_node_type::index_assign:
+		{
+			collect_references(node->as_index.target, names);
+			collect_references(node->as_index.index, names);
+			collect_references(node->as_index.value, names);
+			break;
+		}
+		case ast_node_type::object_type:
+		{
+			for (auto& m : node->as_object_type.members) {
+				collect_type_names(m.type, names);
+			}
+			break;
+		}
+		case ast_node_type::object_init:
+		{
+			names.push_back(node->as_object_init.type);
+			for (auto& [name, value] : node->as_object_init.initial_values) {
+				collect_references(value, names);
+			}
+			break;
+		}
+		default:
+		{
+			break;
+		}
+	}
+}
+
+// Drops the functions, object types, enums and constants 'main' and 'init' can't reach through calls, symbols, object inits
+// and type annotations, so type checking, compiling and the VM never see them. A local shadowing a declaration
+// keeps it alive. Returns what was removed, by kind and in source order. Without a 'main' everything is kept.
+std::vector<std::string> tree_shake(library& lib) {
+	std::unordered_map<std::string, const ast_node*> decls;
+	for (auto& fn : lib.functions) {
+		decls[fn->as_function.symbol] = fn;
+	}
+	for (auto& obj : lib.object_types) {
+		decls[obj->type == ast_node_type::object_type ? obj->as_object_type.name : obj->as_enum_def.name] = obj;
+	}
+	for (auto& c : lib.constants) {
+		decls[c->as_initialize.symbol.name] = c;
+	}
+	if (!decls.count("main")) {
+		return {};
+	}
+
+	std::unordered_set<const ast_node*> reached;
+	std::vector<std::string> todo{ "main", "init" };
+	while (!todo.empty()) {
+		auto decl = decls.find(todo.back());
+		todo.pop_back();
+		if (decl != decls.end() && reached.insert(decl->second).second) {
+			collect_references(decl->second, todo);
+		}
+	}
+
+	std::vector<std::string> removed;
+	auto shake = [&](std::vector<ast_node*>& nodes, auto describe) {
+		std::erase_if(nodes, [&](const ast_node* n) {
+			if (reached.count(n)) {
+				return false;
+			}
+			removed.push_back(describe(n));
+			return true;
+		});
+	};
+	shake(lib.functions, [](const ast_node* n) { return "fn " + n->as_function.symbol; });
+	shake(lib.object_types, [](const ast_node* n) {
+		return n->type == ast_node_type::object_type ? "object " + n->as_object_type.name : "enum " + n->as_enum_def.name;
+	});
+	shake(lib.constants, [](const ast_node* n) { return "const " + n->as_initialize.symbol.name; });
+	return removed;
+}
@@ -1,125 +1,850 @@
 #pragma once
 
+using type_id = i64;
+
+// Built-in type ids, every type_table registers these first and in this order.
+constexpr type_id type_none = 0;	// Statements that don't produce a value, unresolved symbols
+constexpr type_id type_unknown = 1;	// "?", not known until runtime
+constexpr type_id type_fn = 2;
+constexpr type_id type_i64 = 3;
+constexpr type_id type_string = 4;
+constexpr type_id type_i64buf = 5;	// Dense integer buffer for the vector builtins
+constexpr type_id type_f64 = 6;
+constexpr type_id type_i32 = 7;
+constexpr type_id type_u8 = 8;
+
+// Interns type names into dense integer ids, members are looked up per type id.
+struct type_table {
+	std::vector<std::string> names;
+	std::unordered_map<std::string, type_id> ids;
+	std::vector<std::unordered_map<std::string, type_id>> members;
+
+	type_table() {
+		for (auto n : { "", "?", "fn", "i64", "string", "i64buf", "f64", "i32", "u8" }) {
+			intern(n);
+		}
+	}
+
+	type_id intern(const std::string& name) {
+		auto it = ids.find(name);
+		if (it != ids.end()) {
+			return it->second;
+		}
+		type_id id = (type_id)names.size();
+		names.push_back(name);
+		ids.emplace(name, id);
+		members.push_back({});
+		return id;
+	}
+
+	std::optional<type_id> find(const std::string& name) const {
+		auto it = ids.find(name);
+		if (it == ids.end()) {
+			return {};
+		}
+		return it->second;
+	}
+
+	// Only value types and 'fn' can be named in declarations, the other pseudo types before i64 can't.
+	bool is_type_name(const std::string& name) const {
+		auto id = find(name);
+		return id && (*id >= type_i64 || *id == type_fn);
+	}
+
+	type_id member_type(type_id type, const std::string& member) const {
+		auto it = members[type].find(member);
+		if (it == members[type].end()) {
+			return type_none;
+		}
+		return it->second;
+	}
+
+	const std::string& name(type_id id) const { return names[id]; }
+
+	// Handle types are typed by the value they produce: tasks by their result 'task<i64>', generators by the
+	// values they yield 'gen<i64>'. Interned up front by intern_handle_types.
+	type_id handle_of(const std::string& kind, type_id inner) const {
+		return find(kind + "<" + name(inner) + ">").value_or(type_unknown);
+	}
+
+	std::optional<type_id> handle_inner(const std::string& kind, type_id handle) const {
+		auto inner = handle_inner_name(kind, handle);
+		return inner ? find(*inner) : std::nullopt;
+	}
+
+	std::optional<std::string> handle_inner_name(const std::string& kind, type_id handle) const {
+		auto& n = name(handle);
+		if (n.size() < kind.size() + 2 || n.compare(0, kind.size() + 1, kind + "<") != 0) {
+			return {};
+		}
+		return n.substr(kind.size() + 1, n.size() - kind.size() - 2);
+	}
+
+	type_id task_of(type_id result) const { return handle_of("task", result); }
+	std::optional<type_id> task_result(type_id task) const { return handle_inner("task", task); }
+
+	type_id gen_of(type_id item) const { return handle_of("gen", item); }
+	std::optional<type_id> gen_item(type_id gen) const { return handle_inner("gen", gen); }
+
+	type_id array_of(type_id element) const { return handle_of("array", element); }
+	std::optional<type_id> array_element(type_id array) const { return handle_inner("array", array); }
+
+	// Columnar collections of an object type, interned for every object type before the other handle types.
+	type_id columns_of(type_id row) const { return handle_of("columns", row); }
+	std::optional<type_id> columns_row(type_id columns) const { return handle_inner("columns", columns); }
+
+	// 'map<K,V>', keys are always 'i64' or 'string' so the first comma splits the parameters.
+	std::optional<std::pair<type_id, type_id>> map_types(type_id map) const {
+		auto params = handle_inner_name("map", map);
+		i64 comma = params ? (i64)params->find(',') : -1;
+		if (comma < 0) {
+			return {};
+		}
+		auto key = find(params->substr(0, comma));
+		auto val = find(params->substr(comma + 1));
+		if (!key || !val) {
+			return {};
+		}
+		return std::make_pair(*key, *val);
+	}
+
+	// Interns a declared type along with the handle types nested in it, 'array<array<i64>>'. Names that don't
+	// resolve to known types, like type parameters, are left out and reported where they're used.
+	bool intern_declared(const std::string& type) {
+		if (find(type)) {
+			return true;
+		}
+		i64 open = (i64)type.find('<');
+		if (open < 0 || type.back() != '>') {
+			return false;
+		}
+		auto kind = type.substr(0, open);
+		auto params = type.substr(open + 1, type.size() - open - 2);
+		bool known = false;
+		if (kind == "array" || kind == "task" || kind == "gen") {
+			known = intern_declared(params);
+		}
+		else if (kind == "columns") {
+			known = find(params) && *find(params) > type_u8;
+		}
+		else if (kind == "map") {
+			i64 comma = (i64)params.find(',');
+			auto key = params.substr(0, std::max<i64>(comma, 0));
+			known = comma > 0 && (key == "i64" || key == "string") && intern_declared(params.substr(comma + 1));
+		}
+		if (known) {
+			intern(type);
+		}
+		return known;
+	}
+
+	// Arrays of every value type, maps to every value type including arrays, then tasks and generators of all of them.
+	void intern_handle_types() {
+		i64 value_count = (i64)names.size();
+		for (type_id id = type_i64; id < value_count; id++) {
+			intern("array<" + names[id] + ">");
+		}
+		value_count = (i64)names.size();
+		for (type_id id = type_i64; id < value_count; id++) {
+			intern("map<i64," + names[id] + ">");
+			intern("map<string," + names[id] + ">");
+		}
+		i64 count = (i64)names.size();
+		for (type_id id = type_unknown; id < count; id++) {
+			if (id != type_fn) {
+				intern("task<" + names[id] + ">");
+				intern("gen<" + names[id] + ">");
+			}
+		}
+	}
+};
+
+// Operand types the type checker has proven for an operation, unknown operands are checked at runtime.
+enum struct operand_type {
+	unknown = 0,
+	i64,
+	f64,
+	i32,
+	u8,
+};
+
+// Operations on two values of the same numeric type can be specialized.
+operand_type numeric_operands(type_id lhs, type_id rhs) {
+	if (lhs != rhs) {
+		return operand_type::unknown;
+	}
+	switch (lhs) {
+		case type_i64:	return operand_type::i64;
+		case type_f64:	return operand_type::f64;
+		case type_i32:	return operand_type::i32;
+		case type_u8:	return operand_type::u8;
+	}
+	return operand_type::unknown;
+}
+
+// Argument and return types of a callable. Arguments typed '?' accept any value.
+struct fn_signature {
+	std::vector<type_id> args;
+	type_id return_type;
+	bool variadic;
+	const ast_node* generic = nullptr;	// The function declaring type parameters, its signature is only known per instance
+};
+
+struct generic_instance;
+
+// Facts proven by the type checker, kept beside the ast so a checked library stays immutable.
+struct type_annotations {
+	std::unordered_map<const ast_node*, operand_type> operands;
+	std::unordered_map<const call*, std::string> generic_calls;	// Calls of generic functions, by instance name
+	std::vector<generic_instance> instances;	// Every instance of the library, only in the library's annotations
+};
+
+// A generic function checked for one set of type arguments, compiled to its own function 'max<i64>'.
+struct generic_instance {
+	std::string name;
+	const ast_node* function;
+	std::unordered_map<std::string, std::string> type_args;	// 'T' -> 'i64'
+	fn_signature signature;
+	type_annotations annotations;	// Facts about the body for these type arguments
+};
+
+// Replaces every type parameter in a type name, 'array<T>' -> 'array<i64>'.
+std::string substitute_type_args(const std::string& type, const std::unordered_map<std::string, std::string>& type_args) {
+	std::string result;
+	for (i64 i = 0; i < (i64)type.size();) {
+		i64 end = (i64)type.find_first_of("<>,", i);
+		if (end == i) {
+			result.push_back(type[i++]);
+			continue;
+		}
+		if (end < 0) {
+			end = (i64)type.size();
+		}
+		auto name = type.substr(i, end - i);
+		auto it = type_args.find(name);
+		result += (it == type_args.end()) ? name : it->second;
+		i = end;
+	}
+	return result;
+}
+
+// Matches a declared type against the type of a value and binds the type parameters in it. Returns false if the
+// value doesn't fit the declared type or a parameter is already bound to another type.
+bool infer_type_args(const std::string& declared, const std::string& actual, const std::vector<std::string>& params, std::unordered_map<std::string, std::string>& type_args) {
+	i64 d = 0, a = 0;
+	while (d < (i64)declared.size() && a < (i64)actual.size()) {
+		i64 d_end = (i64)declared.find_first_of("<>,", d);
+		if (d_end == d) {
+			if (declared[d++] != actual[a++]) {
+				return false;
+			}
+			continue;
+		}
+		if (d_end < 0) {
+			d_end = (i64)declared.size();
+		}
+		auto name = declared.substr(d, d_end - d);
+		d = d_end;
+
+		// A parameter takes one whole type, including its own parameters.
+		i64 a_end = a;
+		i64 depth = 0;
+		while (a_end < (i64)actual.size() && (depth > 0 || (actual[a_end] != ',' && actual[a_end] != '>'))) {
+			depth += (actual[a_end] == '<') - (actual[a_end] == '>');
+			a_end++;
+		}
+		bool is_param = std::find(params.begin(), params.end(), name) != params.end();
+		if (!is_param) {
+			a_end = (i64)actual.find_first_of("<>,", a);
+			a_end = (a_end < 0) ? (i64)actual.size() : a_end;
+		}
+		auto type = actual.substr(a, a_end - a);
+		a = a_end;
+
+		if (!is_param) {
+			if (type != name) {
+				return false;
+			}
+			continue;
+		}
+		auto [it, added] = type_args.emplace(name, type);
+		if (!added && it->second != type) {
+			return false;
+		}
+	}
+	return d == (i64)declared.size() && a == (i64)actual.size();
+}
+
+// Instances found while checking calls, shared by every batch. Their bodies are checked once the batches are done.
+struct generic_registry {
+	std::mutex lock;
+	std::deque<generic_instance> instances;	// Stable references while more instances are added
+	std::unordered_map<std::string, i64> by_name;
+};
+
+// Signature of a builtin by type names, handle types like 'gen<string>' only get their ids once a type table is built.
+struct builtin_signature {
+	std::vector<std::string> args;
+	std::string return_type;
+	bool variadic;
+};
+
+// Builtins registered by the VM, kept in sync with register_internal_function calls in load_program.
+const std::vector<std::pair<std::string, builtin_signature>> builtin_signatures = {
+	{ "print", { .args = {}, .return_type = "i64", .variadic = true } },
+	{ "println", { .args = {}, .return_type = "i64", .variadic = true } },
+	{ "join", { .args = { "?" }, .return_type = "?", .variadic = false } },
+	{ "parallel_for", { .args = { "i64", "i64", "fn" }, .return_type = "i64", .variadic = false } },
+	{ "parallel_sum", { .args = { "i64", "i64", "fn" }, .return_type = "i64", .variadic = false } },
+	{ "parallel_min", { .args = { "i64", "i64", "fn" }, .return_type = "i64", .variadic = false } },
+	{ "parallel_max", { .args = { "i64", "i64", "fn" }, .return_type = "i64", .variadic = false } },
+	{ "len", { .args = { "?" }, .return_type = "i64", .variadic = false } },
+	{ "read_line", { .args = { "i64" }, .return_type = "string", .variadic = false } },
+	{ "read_file", { .args = { "string" }, .return_type = "string", .variadic = false } },
+	{ "write", { .args = { "i64", "string" }, .return_type = "i64", .variadic = false } },
+	{ "open", { .args = { "string", "string" }, .return_type = "i64", .variadic = false } },
+	{ "close", { .args = { "i64" }, .return_type = "i64", .variadic = false } },
+	{ "lines", { .args = { "string" }, .return_type = "gen<string>", .variadic = false } },
+	{ "split", { .args = { "string", "string" }, .return_type = "gen<string>", .variadic = false } },
+	{ "to_i64", { .args = { "?" }, .return_type = "i64", .variadic = false } },
+	{ "to_f64", { .args = { "?" }, .return_type = "f64", .variadic = false } },
+	{ "to_i32", { .args = { "?" }, .return_type = "i32", .variadic = false } },
+	{ "to_u8", { .args = { "?" }, .return_type = "u8", .variadic = false } },
+	{ "push", { .args = { "?", "?" }, .return_type = "i64", .variadic = false } },
+	{ "buf_new", { .args = { "i64" }, .return_type = "i64buf", .variadic = false } },
+	{ "sum", { .args = { "i64buf" }, .return_type = "i64", .variadic = false } },
+	{ "min", { .args = { "i64buf" }, .return_type = "i64", .variadic = false } },
+	{ "max", { .args = { "i64buf" }, .return_type = "i64", .variadic = false } },
+	{ "dot", { .args = { "i64buf", "i64buf" }, .return_type = "i64", .variadic = false } },
+	{ "add", { .args = { "i64buf", "i64buf" }, .return_type = "i64buf", .variadic = false } },
+	{ "mul", { .args = { "i64buf", "i64buf" }, .return_type = "i64buf", .variadic = false } },
+	{ "fill", { .args = { "i64buf", "i64" }, .return_type = "i64buf", .variadic = false } },
+	{ "find", { .args = { "i64buf", "i64" }, .return_type = "i64", .variadic = false } },
+	{ "map_new", { .args = {}, .return_type = "?", .variadic = false } },
+	{ "has", { .args = { "?", "?" }, .return_type = "i64", .variadic = false } },
+	{ "erase", { .args = { "?", "?" }, .return_type = "i64", .variadic = false } },
+	{ "keys", { .args = { "?" }, .return_type = "?", .variadic = false } },
+	{ "columns_new", { .args = {}, .return_type = "?", .variadic = false } },
+	{ "rows", { .args = { "?" }, .return_type = "?", .variadic = false } },
+	{ "column", { .args = { "?", "string" }, .return_type = "i64buf", .variadic = false } },
+};
+
 struct type_context {
 	std::vector<std::string> errors;
-	std::string result_type;
+	type_id result_type;
+
+	// Shared between every function being checked, read only once function bodies are visited.
+	const type_table* types;
+	const std::unordered_map<std::string, type_id>* globals;
+	const std::unordered_map<std::string, fn_signature>* functions;
 
-	std::vector<std::vector<std::pair<std::string, std::string>>> value_types;
-	std::vector<std::string> types;
-	std::vector<std::pair<std::string, std::vector<std::pair<std::string, std::string>>>> member_types;
+	// Signature of the function being checked, the target of 'this'.
+	const fn_signature* current_fn;
+
+	type_annotations* annotations;
+	generic_registry* generics;
+	const std::unordered_map<std::string, std::string>* type_args;	// Of the generic instance being checked
+
+	std::vector<std::unordered_map<std::string, type_id>> value_types;
 
 	void error(const std::string& msg){ errors.push_back(msg); }
+	const std::string& type_name(type_id id) const { return types->name(id); }
+
+	// Declared type names in a generic instance refer to its type arguments.
+	std::string resolve(const std::string& type) const { return type_args ? substitute_type_args(type, *type_args) : type; }
 };
 
-void type_check(type_context& ctx, library& lib, ast_node* node) {
-	auto is_type_name = [&](const std::string& name) {
-		for (auto& s : ctx.types) {
-			if (s == name)
-				return true;
+type_id get_symbol_type(type_context& ctx, const std::string& name) {
+	i64 dot = name.find_first_of('.');
+	std::string sub = name.substr(0, dot);
+
+	type_id t = type_none;
+	bool found = false;
+	for (i64 i = (i64)ctx.value_types.size() - 1; i >= 0 && !found; i--) {
+		auto it = ctx.value_types[i].find(sub);
+		if (it != ctx.value_types[i].end()) {
+			t = it->second;
+			found = true;
 		}
-		return false;
-	};
-	/*auto get_member_type = [&](const std::string& type, const std::string& member) -> std::string {
-		for (auto& [m, t] : ctx.member_types) {
-			if (m == type) {
-				for (auto& [aa, tt] : t) {
-					if(aa == member)
-						return tt;
-				}
+	}
+	if (!found) {
+		auto it = ctx.globals->find(sub);
+		if (it != ctx.globals->end()) {
+			t = it->second;
+			found = true;
+		}
+	}
+	// Enum values are referenced through the enum's type name.
+	if (!found && dot != (i64)name.npos && ctx.types->is_type_name(sub)) {
+		t = *ctx.types->find(sub);
+	}
+
+	while (dot != (i64)name.npos && t != type_none) {
+		i64 next = name.find_first_of('.', dot + 1);
+		t = ctx.types->member_type(t, name.substr(dot + 1, next == (i64)name.npos ? name.npos : next - dot - 1));
+		dot = next;
+	}
+	return t;
+}
+
+void type_check(type_context& ctx, const library& lib, const ast_node* node);
+
+// Every type named by an argument, return type or declaration in 'node', nested lambdas included.
+void collect_declared_types(const ast_node* node, std::vector<std::string>& types) {
+	if (!node) {
+		return;
+	}
+	switch (node->type) {
+		case ast_node_type::bin_op:
+		{
+			collect_declared_types(node->as_bin_op.lhs, types);
+			collect_declared_types(node->as_bin_op.rhs, types);
+			break;
+		}
+		case ast_node_type::comparison:
+		{
+			collect_declared_types(node->as_comparison.lhs, types);
+			collect_declared_types(node->as_comparison.rhs, types);
+			break;
+		}
+		case ast_node_type::sequence:
+		case ast_node_type::array:
+		{
+			for (auto& s : node->as_sequence) {
+				collect_declared_types(s, types);
 			}
+			break;
 		}
-		return "";
-	};*/
-	auto get_member_type = [&](const std::string& type, const std::string& mem) -> std::string {
-		for (auto& [tname, tmembers] : ctx.member_types) {
-			if (tname == type) {
-				for (auto& [n, v] : tmembers) {
-					if (mem == n)
-						return v;
+		case ast_node_type::call:
+		case ast_node_type::spawn:
+		{
+			for (auto& arg : node->as_call.args) {
+				collect_declared_types(arg, types);
+			}
+			break;
+		}
+		case ast_node_type::lambda:
+		{
+			for (auto& arg : node->as_lambda.args) {
+				if (arg.type) {
+					types.push_back(*arg.type);
 				}
 			}
+			if (node->as_lambda.return_type) {
+				types.push_back(*node->as_lambda.return_type);
+			}
+			collect_declared_types(node->as_lambda.scope, types);
+			break;
 		}
-		return "";
-	};
-	std::function<std::string(const std::string&)> get_symbol_type = [&](const std::string& name) -> std::string {
-		if (name.find_first_of('.') != name.npos) {
-			std::string sub = name.substr(0, name.find_first_of('.'));
-			if (is_type_name(sub)) {
-				return get_member_type(sub, name.substr(name.find_first_of('.') + 1));
-			}
-			return get_member_type(get_symbol_type(sub), name.substr(name.find_first_of('.') + 1));
-		}
-		else{
-			for (auto& t : ctx.value_types) {
-				for (auto& [n, v] : t) {
-					if(n == name)
-						return v;
+		case ast_node_type::function:
+		{
+			collect_declared_types(node->as_function.lambda, types);
+			break;
+		}
+		case ast_node_type::initialize:
+		{
+			if (node->as_initialize.symbol.type) {
+				types.push_back(*node->as_initialize.symbol.type);
+			}
+			collect_declared_types(node->as_initialize.value, types);
+			break;
+		}
+		case ast_node_type::assign:
+		{
+			collect_declared_types(node->as_assign.value, types);
+			break;
+		}
+		case ast_node_type::conditional:
+		{
+			collect_declared_types(node->as_if.condition, types);
+			collect_declared_types(node->as_if.scope, types);
+			collect_declared_types(node->as_if.else_scope, types);
+			break;
+		}
+		case ast_node_type::loop:
+		{
+			collect_declared_types(node->as_loop.condition, types);
+			collect_declared_types(node->as_loop.scope, types);
+			break;
+		}
+		case ast_node_type::yield:
+		{
+			collect_declared_types(node->as_yield, types);
+			break;
+		}
+		case ast_node_type::index:
+		case ast_node_type::index_assign:
+		{
+			collect_declared_types(node->as_index.target, types);
+			collect_declared_types(node->as_index.index, types);
+			collect_declared_types(node->as_index.value, types);
+			break;
+		}
+		case ast_node_type::object_type:
+		{
+			for (auto& m : node->as_object_type.members) {
+				if (m.type) {
+					types.push_back(*m.type);
 				}
 			}
-			return "";
+			break;
 		}
-	};
-	
+		case ast_node_type::object_init:
+		{
+			for (auto& [name, value] : node->as_object_init.initial_values) {
+				collect_declared_types(value, types);
+			}
+			break;
+		}
+		default:
+		{
+			break;
+		}
+	}
+}
+
+// Values typed '?' are only known at runtime and are checked there.
+bool types_match(type_id a, type_id b) {
+	return a == b || a == type_unknown || b == type_unknown;
+}
+
+fn_signature make_signature(const type_table& types, const lambda& l) {
+	fn_signature sig{ .args = {}, .return_type = type_unknown, .variadic = false };
+	for (auto& arg : l.args) {
+		sig.args.push_back(arg.type ? types.find(*arg.type).value_or(type_none) : type_unknown);
+	}
+	if (l.return_type) {
+		sig.return_type = types.find(*l.return_type).value_or(type_none);
+	}
+	return sig;
+}
+
+fn_signature make_signature(type_context& ctx, const lambda& l) {
+	lambda resolved = l;
+	for (auto& arg : resolved.args) {
+		if (arg.type) {
+			arg.type = ctx.resolve(*arg.type);
+		}
+		if (arg.type && !ctx.types->is_type_name(*arg.type)) {
+			ctx.error("(Unknown type) '" + *arg.type + "'");
+		}
+	}
+	if (resolved.return_type) {
+		resolved.return_type = ctx.resolve(*resolved.return_type);
+	}
+	if (resolved.return_type && !ctx.types->is_type_name(*resolved.return_type)) {
+		ctx.error("(Unknown type) '" + *resolved.return_type + "'");
+	}
+	return make_signature(*ctx.types, resolved);
+}
+
+// Checks a lambda body in its own scope, the final expression has to match the declared return type.
+// Generators produce their values with 'yield' instead.
+void check_function(type_context& ctx, const library& lib, const ast_node* node, const fn_signature& sig, const std::string& name) {
+	auto& l = node->as_lambda;
+	auto outer_fn = ctx.current_fn;
+	ctx.current_fn = &sig;
+	ctx.value_types.push_back({});
+	for (i64 i = 0; i < (i64)l.args.size(); i++) {
+		if (!l.args[i].type.has_value())
+			ctx.error("Function '" + name + "' arg '" + l.args[i].name + "' doesn't have a type.");
+		else
+			ctx.value_types.back()[l.args[i].name] = sig.args[i];
+	}
+
+	type_check(ctx, lib, l.scope);
+	bool is_generator = ctx.types->gen_item(sig.return_type).has_value();
+	if (l.return_type && !is_generator && !types_match(ctx.result_type, sig.return_type)) {
+		ctx.error("(Return) Function '" + name + "' returns '" + ctx.type_name(ctx.result_type) + "', declared '" + ctx.type_name(sig.return_type) + "'.");
+	}
+
+	ctx.value_types.pop_back();
+	ctx.current_fn = outer_fn;
+}
+
+// Infers the type arguments of a generic function from the argument types and returns the signature of the
+// instance for them. The instance's body is checked later, once per distinct set of type arguments.
+std::optional<fn_signature> instantiate(type_context& ctx, const call& c, const ast_node* fn, const std::vector<type_id>& arg_types) {
+	auto& name = fn->as_function.symbol;
+	auto& l = fn->as_function.lambda->as_lambda;
+	if (arg_types.size() != l.args.size()) {
+		ctx.error("(Call) '" + name + "' expects " + std::to_string(l.args.size()) + " arguments, got " + std::to_string(arg_types.size()) + ".");
+		return {};
+	}
+
+	std::unordered_map<std::string, std::string> type_args;
+	for (i64 i = 0; i < (i64)l.args.size(); i++) {
+		if (arg_types[i] == type_unknown || !l.args[i].type) {
+			continue;
+		}
+		if (!infer_type_args(*l.args[i].type, ctx.type_name(arg_types[i]), l.type_params, type_args)) {
+			ctx.error("(Call) Argument " + std::to_string(i) + " of '" + name + "' type mismatch: '" + *l.args[i].type + "' != '" + ctx.type_name(arg_types[i]) + "'.");
+			return {};
+		}
+	}
+
+	std::string instance = name + "<";
+	for (auto& param : l.type_params) {
+		if (!type_args.count(param)) {
+			ctx.error("(Generic) Can't infer '" + param + "' in call to '" + name + "'.");
+			return {};
+		}
+		instance += type_args[param] + (&param == &l.type_params.back() ? ">" : ",");
+	}
+
+	std::lock_guard<std::mutex> lock(ctx.generics->lock);
+	auto it = ctx.generics->by_name.find(instance);
+	if (it == ctx.generics->by_name.end()) {
+		fn_signature sig{ .args = {}, .return_type = type_unknown, .variadic = false };
+		for (auto& arg : l.args) {
+			auto type = arg.type ? substitute_type_args(*arg.type, type_args) : "?";
+			sig.args.push_back(ctx.types->find(type).value_or(type_none));
+			if (sig.args.back() == type_none) {
+				ctx.error("(Generic) Unknown type '" + type + "' in '" + instance + "'.");
+			}
+		}
+		if (l.return_type) {
+			auto type = substitute_type_args(*l.return_type, type_args);
+			sig.return_type = ctx.types->find(type).value_or(type_none);
+			if (sig.return_type == type_none) {
+				ctx.error("(Generic) Unknown type '" + type + "' in '" + instance + "'.");
+			}
+		}
+		it = ctx.generics->by_name.emplace(instance, (i64)ctx.generics->instances.size()).first;
+		ctx.generics->instances.push_back({ .name = instance, .function = fn, .type_args = type_args, .signature = sig, .annotations = {} });
+	}
+	ctx.annotations->generic_calls[&c] = instance;
+	return ctx.generics->instances[it->second].signature;
+}
+
+// Checks the arguments of a call against the callee's signature and returns its result type.
+type_id check_call(type_context& ctx, const library& lib, const call& c) {
+	std::vector<type_id> arg_types;
+	for (auto& arg : c.args) {
+		type_check(ctx, lib, arg);
+		arg_types.push_back(ctx.result_type);
+	}
+
+	auto& target = c.target;
+	bool is_local = false;
+	for (auto& scope : ctx.value_types) {
+		is_local = is_local || scope.count(target);
+	}
+
+	// Locals shadow functions, a lambda held in a value isn't known until runtime.
+	const fn_signature* sig = nullptr;
+	if (target == "this") {
+		sig = ctx.current_fn;
+	}
+	else if (!is_local) {
+		auto it = ctx.functions->find(target);
+		if (it == ctx.functions->end()) {
+			ctx.error("(Call) Unknown function '" + target + "'.");
+		}
+		else {
+			sig = &it->second;
+		}
+	}
+
+	if (!sig) {
+		return type_unknown;
+	}
+
+	std::optional<fn_signature> instance;
+	if (sig->generic) {
+		instance = instantiate(ctx, c, sig->generic, arg_types);
+		if (!instance) {
+			return type_unknown;
+		}
+		sig = &*instance;
+	}
+
+	if (!sig->variadic) {
+		if (arg_types.size() != sig->args.size()) {
+			ctx.error("(Call) '" + target + "' expects " + std::to_string(sig->args.size()) + " arguments, got " + std::to_string(arg_types.size()) + ".");
+		}
+		for (i64 i = 0; i < (i64)std::min(arg_types.size(), sig->args.size()); i++) {
+			if (!types_match(sig->args[i], arg_types[i])) {
+				ctx.error("(Call) Argument " + std::to_string(i) + " of '" + target + "' type mismatch: '" + ctx.type_name(sig->args[i]) + "' != '" + ctx.type_name(arg_types[i]) + "'.");
+			}
+		}
+	}
+	return sig->return_type;
+}
+
+// has, erase and keys take their key type from the map. Returns false for other calls and user functions.
+bool check_map_call(type_context& ctx, const library& lib, const call& c) {
+	bool is_map_builtin = (c.target == "has" && c.args.size() == 2) || (c.target == "erase" && c.args.size() == 2) || (c.target == "keys" && c.args.size() == 1);
+	if (!is_map_builtin || ctx.globals->count(c.target)) {
+		return false;
+	}
+
+	type_check(ctx, lib, c.args[0]);
+	auto types = ctx.types->map_types(ctx.result_type);
+	if (!types && ctx.result_type != type_unknown) {
+		ctx.error("(Call) '" + c.target + "' expects a map, got '" + ctx.type_name(ctx.result_type) + "'.");
+	}
+	if (c.args.size() == 2) {
+		type_check(ctx, lib, c.args[1]);
+		if (types && !types_match(types->first, ctx.result_type)) {
+			ctx.error("(Call) '" + c.target + "' key type mismatch: '" + ctx.type_name(types->first) + "' != '" + ctx.type_name(ctx.result_type) + "'.");
+		}
+		ctx.result_type = type_i64;
+	}
+	else {
+		ctx.result_type = types ? ctx.types->gen_of(types->first) : type_unknown;
+	}
+	return true;
+}
+
+// rows yields the row type of the columns, column reads a member that has to be an i64.
+bool check_columns_call(type_context& ctx, const library& lib, const call& c) {
+	bool is_columns_builtin = (c.target == "rows" && c.args.size() == 1) || (c.target == "column" && c.args.size() == 2);
+	if (!is_columns_builtin || ctx.globals->count(c.target)) {
+		return false;
+	}
+
+	type_check(ctx, lib, c.args[0]);
+	auto row = ctx.types->columns_row(ctx.result_type);
+	if (!row && ctx.result_type != type_unknown) {
+		ctx.error("(Call) '" + c.target + "' expects columns, got '" + ctx.type_name(ctx.result_type) + "'.");
+	}
+	if (c.target == "rows") {
+		ctx.result_type = row ? ctx.types->gen_of(*row) : type_unknown;
+		return true;
+	}
+
+	type_check(ctx, lib, c.args[1]);
+	if (!types_match(ctx.result_type, type_string)) {
+		ctx.error("(Call) 'column' expects a member name, got '" + ctx.type_name(ctx.result_type) + "'.");
+	}
+	// A literal name can be checked against the row type.
+	if (row && c.args[1]->type == ast_node_type::string) {
+		auto member = ctx.types->member_type(*row, c.args[1]->as_string);
+		if (member == type_none) {
+			ctx.error("(Call) 'column': '" + ctx.type_name(*row) + "' has no member '" + c.args[1]->as_string + "'.");
+		}
+		else if (member != type_i64) {
+			ctx.error("(Call) 'column' needs an i64 member, '" + ctx.type_name(*row) + "." + c.args[1]->as_string + "' is '" + ctx.type_name(member) + "'.");
+		}
+	}
+	ctx.result_type = type_i64buf;
+	return true;
+}
+
+void type_check(type_context& ctx, const library& lib, const ast_node* node) {
 	switch (node->type) {
 		case ast_node_type::lambda:
 		{
-			for (auto& s : node->as_lambda.scope->as_sequence) {
+			// Lambda values are checked like functions, calls through them are resolved at runtime.
+			fn_signature sig = make_signature(ctx, node->as_lambda);
+			check_function(ctx, lib, node, sig, "lambda");
+			ctx.result_type = type_fn;
+			break;
+		}
+		case ast_node_type::sequence:
+		{
+			ctx.result_type = type_none;
+			for (auto& s : node->as_sequence) {
 				type_check(ctx, lib, s);
-				// ctx.result_type = "";
 			}
 			break;
 		}
-		case ast_node_type::initialize: 
+		case ast_node_type::conditional:
+		{
+			type_check(ctx, lib, node->as_if.condition);
+			if (ctx.result_type != type_i64 && ctx.result_type != type_unknown) {
+				ctx.error("(Conditional) Condition must be 'i64', got '" + ctx.type_name(ctx.result_type) + "'.");
+			}
+
+			type_check(ctx, lib, node->as_if.scope);
+			auto then_t = ctx.result_type;
+			auto else_t = type_none;
+			if (node->as_if.else_scope) {
+				type_check(ctx, lib, node->as_if.else_scope);
+				else_t = ctx.result_type;
+			}
+
+			// Only an if/else whose branches agree produces a value.
+			ctx.result_type = (then_t == else_t) ? then_t : type_none;
+			break;
+		}
+		case ast_node_type::initialize:
 		{
 			type_check(ctx, lib, node->as_initialize.value);
 
-			if (node->as_initialize.symbol.type.value_or(ctx.result_type) != ctx.result_type) {
-				ctx.error("(Initialize) Type mismatch: '" + *node->as_initialize.symbol.type + "' != '" + ctx.result_type + "'.");
+			// A declared type wins over the value's, 'a: [i64] = []' is an array of i64 even though '[]' isn't.
+			auto& declared = node->as_initialize.symbol.type;
+			auto declared_t = declared ? ctx.types->find(ctx.resolve(*declared)).value_or(type_none) : type_unknown;
+			if (declared && !ctx.types->is_type_name(ctx.resolve(*declared))) {
+				ctx.error("(Unknown type) '" + ctx.resolve(*declared) + "'");
+			}
+			else if (declared && !types_match(declared_t, ctx.result_type)) {
+				ctx.error("(Initialize) Type mismatch: '" + ctx.resolve(*declared) + "' != '" + ctx.type_name(ctx.result_type) + "'.");
 			}
 			else {
-				node->as_initialize.symbol.type = ctx.result_type;
-				ctx.value_types[ctx.value_types.size() - 1].push_back({node->as_initialize.symbol.name, node->as_initialize.symbol.type.value_or("?")});
+				ctx.value_types.back()[node->as_initialize.symbol.name] = declared ? declared_t : ctx.result_type;
 			}
 			break;
 		}
-		case ast_node_type::number: 
+		case ast_node_type::number:
 		{
-			ctx.result_type = "i64";
+			switch (node->as_number_type) {
+				case number_type::i64:	ctx.result_type = type_i64; break;
+				case number_type::f64:	ctx.result_type = type_f64; break;
+				case number_type::i32:	ctx.result_type = type_i32; break;
+				case number_type::u8:	ctx.result_type = type_u8; break;
+			}
+			bool fits = (node->as_number_type == number_type::i32) ? node->as_number <= INT32_MAX : (node->as_number_type == number_type::u8) ? node->as_number <= UINT8_MAX : true;
+			if (!fits) {
+				ctx.error("(Literal) " + std::to_string(node->as_number) + " doesn't fit in '" + ctx.type_name(ctx.result_type) + "'.");
+			}
 			break;
 		}
 		case ast_node_type::string:
 		{
-			ctx.result_type = "string";
+			ctx.result_type = type_string;
 			break;
 		}
-		case ast_node_type::loop: 
+		case ast_node_type::loop:
 		{
 			if(node->as_loop.condition)
 				type_check(ctx, lib, node->as_loop.condition);
 			ctx.value_types.push_back({});
+			if (node->as_loop.type == loop_type::loop_for) {
+				auto item = ctx.types->gen_item(ctx.result_type);
+				if (!item && ctx.result_type != type_unknown) {
+					ctx.error("(For) Expected a generator, got '" + ctx.type_name(ctx.result_type) + "'.");
+				}
+				ctx.value_types.back()[node->as_loop.symbol] = item.value_or(type_unknown);
+			}
 			for (auto& s : node->as_loop.scope->as_sequence) {
 				type_check(ctx, lib, s);
 			}
 			ctx.value_types.pop_back();
-			ctx.result_type = "";
+			ctx.result_type = type_none;
 			break;
 		}
-		case ast_node_type::comparison: 
+		case ast_node_type::comparison:
 		{
 			type_check(ctx, lib, node->as_comparison.lhs);
 			auto lhs_type = ctx.result_type;
 			type_check(ctx, lib, node->as_comparison.rhs);
 			auto rhs_type = ctx.result_type;
 
-			if(lhs_type != rhs_type)
-				ctx.error("(Comparison) Type mismatch: '" + lhs_type + "' != '" + rhs_type + "'.");
+			if(!types_match(lhs_type, rhs_type))
+				ctx.error("(Comparison) Type mismatch: '" + ctx.type_name(lhs_type) + "' != '" + ctx.type_name(rhs_type) + "'.");
+			else if (lhs_type == rhs_type && lhs_type != type_unknown && numeric_operands(lhs_type, rhs_type) == operand_type::unknown)
+				ctx.error("(Comparison) Can't compare values of type '" + ctx.type_name(lhs_type) + "'.");
+			if (auto op = numeric_operands(lhs_type, rhs_type); op != operand_type::unknown)
+				ctx.annotations->operands[node] = op;
 
-			ctx.result_type = "i64";
+			ctx.result_type = type_i64;
 			break;
 		}
-		case ast_node_type::symbol: 
+		case ast_node_type::symbol:
 		{
-			ctx.result_type = get_symbol_type(node->as_symbol);
+			ctx.result_type = get_symbol_type(ctx, node->as_symbol);
 			break;
 		}
 		case ast_node_type::bin_op:
@@ -129,48 +854,157 @@ void type_check(type_context& ctx, library& lib, ast_node* node) {
 			type_check(ctx, lib, node->as_bin_op.rhs);
 			auto rhs_type = ctx.result_type;
 
-			if(lhs_type != rhs_type)
-				ctx.error("(Binary Op) Type mismatch: '" + lhs_type + "' != '" + rhs_type + "'.");
+			if(!types_match(lhs_type, rhs_type))
+				ctx.error("(Binary Op) Type mismatch: '" + ctx.type_name(lhs_type) + "' != '" + ctx.type_name(rhs_type) + "'.");
+			else if (lhs_type == rhs_type && lhs_type != type_unknown && numeric_operands(lhs_type, rhs_type) == operand_type::unknown)
+				ctx.error("(Binary Op) Arithmetic on values of type '" + ctx.type_name(lhs_type) + "'.");
+			if (auto op = numeric_operands(lhs_type, rhs_type); op != operand_type::unknown)
+				ctx.annotations->operands[node] = op;
 
-			ctx.result_type = lhs_type;
+			ctx.result_type = (lhs_type == type_unknown) ? rhs_type : lhs_type;
 
 			break;
 		}
 		case ast_node_type::assign:
 		{
-			auto lhs_t = get_symbol_type(node->as_assign.symbol);
+			auto lhs_t = get_symbol_type(ctx, node->as_assign.symbol);
 			type_check(ctx, lib, node->as_assign.value);
 			auto rhs_t = ctx.result_type;
 
-			if (lhs_t != rhs_t) {
-				ctx.error("(Assign) Type mismatch in assign: '" + lhs_t + "' != '" + rhs_t + "'.");
+			if (!types_match(lhs_t, rhs_t)) {
+				ctx.error("(Assign) Type mismatch in assign: '" + ctx.type_name(lhs_t) + "' != '" + ctx.type_name(rhs_t) + "'.");
 			}
-			ctx.result_type = "";
+			ctx.result_type = type_none;
 
 			break;
 		}
-		case ast_node_type::call: 
+		case ast_node_type::array:
 		{
-			ctx.result_type = "?";
+			// The element type is taken from the elements, an empty literal is only typed by its declaration.
+			type_id element = type_unknown;
+			for (auto& e : node->as_sequence) {
+				type_check(ctx, lib, e);
+				if (!types_match(element, ctx.result_type)) {
+					ctx.error("(Array) Element type mismatch: '" + ctx.type_name(element) + "' != '" + ctx.type_name(ctx.result_type) + "'.");
+				}
+				else if (element == type_unknown) {
+					element = ctx.result_type;
+				}
+			}
+			ctx.result_type = (element == type_unknown) ? type_unknown : ctx.types->array_of(element);
+			break;
+		}
+		case ast_node_type::index:
+		case ast_node_type::index_assign:
+		{
+			// Arrays, buffers and columns are indexed by position, maps by their key type.
+			auto& idx = node->as_index;
+			type_check(ctx, lib, idx.target);
+			auto map = ctx.types->map_types(ctx.result_type);
+			auto key = map ? map->first : type_i64;
+			auto element = map ? map->second : (ctx.result_type == type_i64buf) ? type_i64 : ctx.types->array_element(ctx.result_type);
+			if (!element) {
+				element = ctx.types->columns_row(ctx.result_type);
+			}
+			if (!element && ctx.result_type != type_unknown) {
+				ctx.error("(Index) Expected an array or a map, got '" + ctx.type_name(ctx.result_type) + "'.");
+			}
+			type_check(ctx, lib, idx.index);
+			if (!types_match(ctx.result_type, key)) {
+				ctx.error("(Index) Index must be '" + ctx.type_name(key) + "', got '" + ctx.type_name(ctx.result_type) + "'.");
+			}
+			if (idx.value) {
+				type_check(ctx, lib, idx.value);
+				if (element && !types_match(*element, ctx.result_type)) {
+					ctx.error("(Index) Type mismatch in assign: '" + ctx.type_name(*element) + "' != '" + ctx.type_name(ctx.result_type) + "'.");
+				}
+				ctx.result_type = type_none;
+			}
+			else {
+				ctx.result_type = element.value_or(type_unknown);
+			}
+			break;
+		}
+		case ast_node_type::call:
+		{
+			if (check_map_call(ctx, lib, node->as_call)) {
+				break;
+			}
+			if (check_columns_call(ctx, lib, node->as_call)) {
+				break;
+			}
+			// push appends to an array or columns of the value's type.
+			if (node->as_call.target == "push" && node->as_call.args.size() == 2) {
+				type_check(ctx, lib, node->as_call.args[0]);
+				auto element = ctx.types->array_element(ctx.result_type);
+				if (!element) {
+					element = ctx.types->columns_row(ctx.result_type);
+				}
+				if (!element && ctx.result_type != type_unknown) {
+					ctx.error("(Call) 'push' expects an array or columns, got '" + ctx.type_name(ctx.result_type) + "'.");
+				}
+				type_check(ctx, lib, node->as_call.args[1]);
+				if (element && !types_match(*element, ctx.result_type)) {
+					ctx.error("(Call) 'push' type mismatch: '" + ctx.type_name(*element) + "' != '" + ctx.type_name(ctx.result_type) + "'.");
+				}
+				ctx.result_type = type_i64;
+				break;
+			}
+			// join's result is the return type of the function the task runs.
+			if (node->as_call.target == "join" && node->as_call.args.size() == 1) {
+				type_check(ctx, lib, node->as_call.args[0]);
+				auto result = ctx.types->task_result(ctx.result_type);
+				if (!result && ctx.result_type != type_unknown) {
+					ctx.error("(Call) 'join' expects a task, got '" + ctx.type_name(ctx.result_type) + "'.");
+				}
+				ctx.result_type = result.value_or(type_unknown);
+				break;
+			}
+			ctx.result_type = check_call(ctx, lib, node->as_call);
+			break;
+		}
+		case ast_node_type::spawn:
+		{
+			if (ctx.functions->count(node->as_call.target) && !ctx.globals->count(node->as_call.target)) {
+				ctx.error("(Spawn) Builtin '" + node->as_call.target + "' can't be spawned.");
+			}
+			type_id ret = check_call(ctx, lib, node->as_call);
+			ctx.result_type = ctx.types->task_of(ret);
+			break;
+		}
+		case ast_node_type::yield:
+		{
+			type_check(ctx, lib, node->as_yield);
+			// Functions without a declared return type may yield anything.
+			auto ret = ctx.current_fn ? ctx.current_fn->return_type : type_none;
+			auto item = ctx.types->gen_item(ret);
+			if (!item && ret != type_unknown) {
+				ctx.error("(Yield) 'yield' in a function returning '" + ctx.type_name(ret) + "', expected a generator.");
+			}
+			else if (item && !types_match(*item, ctx.result_type)) {
+				ctx.error("(Yield) Type mismatch: '" + ctx.type_name(*item) + "' != '" + ctx.type_name(ctx.result_type) + "'.");
+			}
+			ctx.result_type = type_none;
 			break;
 		}
 		case ast_node_type::object_init:
 		{
-			if (!is_type_name(node->as_object_init.type)) {
+			auto type = ctx.types->find(node->as_object_init.type);
+			if (!ctx.types->is_type_name(node->as_object_init.type)) {
 				ctx.error("(Object Init) Unknown type name '" + node->as_object_init.type + "'.");
 			}
 			for (auto& [name, value] : node->as_object_init.initial_values) {
 				type_check(ctx, lib, value);
 				auto rhs_t = ctx.result_type;
-				auto lhs_t = get_member_type(node->as_object_init.type, name);
-				if (lhs_t != rhs_t) {
-					ctx.error("(Object Init) Member type doesn't match type defined. '" + lhs_t + "' != '" + rhs_t + "'.");
+				auto lhs_t = type ? ctx.types->member_type(*type, name) : type_none;
+				if (!types_match(lhs_t, rhs_t)) {
+					ctx.error("(Object Init) Member type doesn't match type defined. '" + ctx.type_name(lhs_t) + "' != '" + ctx.type_name(rhs_t) + "'.");
 				}
 			}
-			ctx.result_type = node->as_object_init.type;
+			ctx.result_type = type.value_or(type_none);
 			break;
 		}
-		default: 
+		default:
 		{
 			assert(false);
 			break;
@@ -179,65 +1013,151 @@ void type_check(type_context& ctx, library& lib, ast_node* node) {
 }
 
 
-std::vector<std::string> type_check(library& lib) {
-	type_context ctx{
-		.errors = {},
-		.result_type = "",
-		.value_types = {},
-		.types = {
-			"i64",
-			"string"
-		},
-		.member_types = {},
-	};
+std::pair<type_annotations, std::vector<std::string>> type_check(const library& lib) {
+	type_table types;
+	std::unordered_map<std::string, type_id> globals;
+	std::vector<std::string> errors;
 
-	auto is_type_name = [&](const std::string& name) {
-		for (auto& s : ctx.types) {
-			if (s == name)
-				return true;
+	// Register every name first so members can refer to types declared later in the file.
+	for (auto& obj : lib.object_types) {
+		if (obj->type == ast_node_type::object_type) {
+			types.intern(obj->as_object_type.name);
 		}
-		return false;
-	};
-	ctx.value_types.push_back({});
+		else if (obj->type == ast_node_type::enum_def) {
+			types.intern(obj->as_enum_def.name);
+		}
+		else {
+			assert(false);
+		}
+	}
+	// Declared handle types can nest, '[[i64]]'. Their ids have to exist before function bodies are checked in
+	// parallel, the table is read only from then on.
+	std::vector<std::string> declared;
+	for (auto& nodes : { &lib.object_types, &lib.functions, &lib.constants }) {
+		for (auto& n : *nodes) {
+			collect_declared_types(n, declared);
+		}
+	}
+	for (auto& t : declared) {
+		types.intern_declared(t);
+	}
 	for (auto& obj : lib.object_types) {
 		if(obj->type == ast_node_type::object_type){
-			ctx.types.push_back(obj->as_object_type.name);
-			std::vector<std::pair<std::string, std::string>> member_types;
+			auto& members = types.members[*types.find(obj->as_object_type.name)];
 			for (auto& [n, t] : obj->as_object_type.members) {
 				if (t.has_value()) {
-					if (!is_type_name(*t)) {
-						ctx.error("(Unknown type) '" + *t + "'");
+					if (!types.is_type_name(*t)) {
+						errors.push_back("(Unknown type) '" + *t + "'");
 					}
-					member_types.push_back({ n, *t });
+					members[n] = types.find(*t).value_or(type_none);
 				}
 				else
-					ctx.error("(Object types) Object doesn't have type definition.");
+					errors.push_back("(Object types) Object doesn't have type definition.");
 			}
-			ctx.member_types.push_back({ obj->as_object_type.name, member_types });
 		}
 		else if (obj->type == ast_node_type::enum_def) {
-			ctx.types.push_back(obj->as_enum_def.name);
-			std::vector<std::pair<std::string, std::string>> mem_types;
+			type_id id = *types.find(obj->as_enum_def.name);
 			for (auto& m : obj->as_enum_def.values) {
-				mem_types.push_back({m, obj->as_enum_def.name});
+				types.members[id][m] = id;
 			}
-			ctx.member_types.push_back({obj->as_enum_def.name, mem_types});
 		}
-		else {
-			assert(false);
+	}
+	for (auto& obj : lib.object_types) {
+		if (obj->type == ast_node_type::object_type) {
+			types.intern("columns<" + obj->as_object_type.name + ">");
+		}
+	}
+	types.intern_handle_types();
+
+	std::unordered_map<std::string, fn_signature> functions;
+	for (auto& [name, sig] : builtin_signatures) {
+		fn_signature& resolved = functions[name];
+		for (auto& arg : sig.args) {
+			resolved.args.push_back(*types.find(arg));
 		}
+		resolved.return_type = *types.find(sig.return_type);
+		resolved.variadic = sig.variadic;
 	}
 	for (auto& fn : lib.functions) {
-		ctx.value_types[0].push_back({fn->as_function.symbol, "fn"});
-		ctx.value_types.push_back({});
-		for (auto& [name, type] : fn->as_function.lambda->as_lambda.args) {
-			if(!type.has_value()) 
-				ctx.error("Function '" + name + "' arg '" + name + "' doesn't have a type.");
-			else
-				ctx.value_types[0].push_back({name, *type});
-		}
-		type_check(ctx, lib, fn->as_function.lambda);
-		ctx.value_types.pop_back();
-	}
-	return ctx.errors;
-}
\ No newline at end of file
+		globals[fn->as_function.symbol] = type_fn;
+		functions[fn->as_function.symbol] = make_signature(types, fn->as_function.lambda->as_lambda);
+		if (!fn->as_function.lambda->as_lambda.type_params.empty()) {
+			functions[fn->as_function.symbol].generic = fn;
+		}
+	}
+
+	generic_registry generics;
+	type_context ctx{
+		.errors = {},
+		.result_type = type_none,
+		.types = &types,
+		.globals = &globals,
+		.functions = &functions,
+		.current_fn = nullptr,
+		.annotations = nullptr,
+		.generics = &generics,
+		.type_args = nullptr,
+		.value_types = {},
+	};
+
+	// Constants are checked in source order, each one can use those before it. They become typed globals.
+	type_annotations const_annotations;
+	type_context const_ctx = ctx;
+	const_ctx.annotations = &const_annotations;
+	const_ctx.value_types.push_back({});
+	for (auto& c : lib.constants) {
+		type_check(const_ctx, lib, c);
+		auto& name = c->as_initialize.symbol.name;
+		if (const_ctx.value_types.back().count(name)) {
+			globals[name] = const_ctx.value_types.back()[name];
+		}
+	}
+	errors.insert(errors.end(), const_ctx.errors.begin(), const_ctx.errors.end());
+
+	// With the global tables built, function bodies only read shared state and can be checked independently.
+	// Each batch checks a contiguous run of functions with its own context, errors are merged in source order.
+	constexpr i64 batches_per_worker = 4;
+	i64 fn_count = (i64)lib.functions.size();
+	i64 batch_count = std::min(fn_count, default_thread_pool().size() * batches_per_worker);
+	std::vector<std::vector<std::string>> fn_errors(fn_count);
+	std::vector<type_annotations> batch_annotations(batch_count);
+
+	default_thread_pool().run(batch_count, [&](i64 b) {
+		type_context fn_ctx = ctx;
+		fn_ctx.annotations = &batch_annotations[b];
+		for (i64 i = fn_count * b / batch_count; i < fn_count * (b + 1) / batch_count; i++) {
+			auto& fn = lib.functions[i];
+			auto& sig = functions.at(fn->as_function.symbol);
+			// Generic bodies are only checked per instance, with their type arguments known.
+			if (sig.generic) {
+				continue;
+			}
+			make_signature(fn_ctx, fn->as_function.lambda->as_lambda);
+			check_function(fn_ctx, lib, fn->as_function.lambda, sig, fn->as_function.symbol);
+			fn_errors[i] = std::move(fn_ctx.errors);
+			fn_ctx.errors.clear();
+		}
+	});
+
+	// Checking an instance can find further instances, which are appended and checked in turn.
+	for (i64 i = 0; i < (i64)generics.instances.size(); i++) {
+		auto& inst = generics.instances[i];
+		type_context inst_ctx = ctx;
+		inst_ctx.annotations = &inst.annotations;
+		inst_ctx.type_args = &inst.type_args;
+		make_signature(inst_ctx, inst.function->as_function.lambda->as_lambda);
+		check_function(inst_ctx, lib, inst.function->as_function.lambda, inst.signature, inst.name);
+		fn_errors.push_back(std::move(inst_ctx.errors));
+	}
+
+	type_annotations annotations = std::move(const_annotations);
+	for (auto& a : batch_annotations) {
+		annotations.operands.insert(a.operands.begin(), a.operands.end());
+		annotations.generic_calls.insert(a.generic_calls.begin(), a.generic_calls.end());
+	}
+	annotations.instances.assign(std::make_move_iterator(generics.instances.begin()), std::make_move_iterator(generics.instances.end()));
+	for (auto& errs : fn_errors) {
+		errors.insert(errors.end(), errs.begin(), errs.end());
+	}
+	return { std::move(annotations), errors };
+}
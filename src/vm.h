@@ -3,20 +3,364 @@
 enum struct value_type {
 	unknown = 0,
 	i64,
+	f64,
+	i32,	// Sign extended in as_i64
+	u8,		// Zero extended in as_i64
 	string,
 	function,
 	object,
+	task,
+	generator,
+	array,
+	buffer,
+	map,
+	columns,
+	row,	// One row of a columns value, the row index is in as_i64
 };
 
 struct object_data;
+struct task_data;
+struct generator_data;
+struct array_data;
+struct i64_buffer;
+struct map_data;
+struct columns_data;
 
+// Immutable characters shared by every copy of a string value, copying a value never copies the string. The
+// value's handle owns them, it's empty for constants, they live in the program which outlives its VMs.
+struct string_ref {
+	const char* data;
+	i64 size;
+	uint64_t hash;	// hash_string of the characters, 0 until something needs it
+
+	std::string_view view() const { return std::string_view(data, (size_t)size); }
+};
+
+struct value;
+
+// Values a closure copied when it was created, read by load_capture. Shared by every copy of the closure.
+using capture_list = std::shared_ptr<const std::vector<value>>;
+
+// Scalars are the type and 8 bytes, everything else also holds its data through the one handle, so copying
+// a number never touches a reference count.
 struct value {
 	value_type type;
 
-	i64 as_i64;
-	std::string as_string;
-	lambda* as_function;
-	object_data* as_object;
+	union {
+		i64 as_i64;	// Also the row index of a row
+		double as_f64;
+		string_ref as_string;
+		const function_proto* as_function;
+		object_data* as_object;
+	};
+	std::shared_ptr<const void> handle;	// Characters of a string, captures of a closure or the shared data
+
+	const std::vector<value>* as_captures() const { return (const std::vector<value>*)handle.get(); }
+	task_data* as_task() const { return (task_data*)handle.get(); }
+	generator_data* as_generator() const { return (generator_data*)handle.get(); }
+	array_data* as_array() const { return (array_data*)handle.get(); }
+	i64_buffer* as_buffer() const { return (i64_buffer*)handle.get(); }
+	map_data* as_map() const { return (map_data*)handle.get(); }
+	columns_data* as_columns() const { return (columns_data*)handle.get(); }	// Also set for rows
+
+	// The handle as a shared_ptr of its type, for code that keeps the data alive past the value.
+	template<typename T>
+	std::shared_ptr<T> shared() const { return std::const_pointer_cast<T>(std::static_pointer_cast<const T>(handle)); }
+};
+
+value make_i64(i64 v);
+value make_string_value(std::string s);
+
+value make_f64(double v) {
+	return value{ .type = value_type::f64, .as_f64 = v };
+}
+
+value make_i32(int32_t v) {
+	return value{ .type = value_type::i32, .as_i64 = v };
+}
+
+value make_u8(uint8_t v) {
+	return value{ .type = value_type::u8, .as_i64 = v };
+}
+
+bool is_int_type(value_type type) {
+	return type == value_type::i64 || type == value_type::i32 || type == value_type::u8;
+}
+
+// Bytes a scalar takes when packed into an array, 0 for values that are always boxed.
+i64 scalar_size(value_type type) {
+	switch (type) {
+		case value_type::i64:	return 8;
+		case value_type::f64:	return 8;
+		case value_type::i32:	return 4;
+		case value_type::u8:	return 1;
+		default:	break;
+	}
+	return 0;
+}
+
+value load_scalar(value_type type, const uint8_t* p) {
+	switch (type) {
+		case value_type::i64:	{ i64 v; memcpy(&v, p, 8); return make_i64(v); }
+		case value_type::f64:	{ double v; memcpy(&v, p, 8); return make_f64(v); }
+		case value_type::i32:	{ int32_t v; memcpy(&v, p, 4); return make_i32(v); }
+		case value_type::u8:	return make_u8(*p);
+		default:	break;
+	}
+	assert(false);
+	return {};
+}
+
+void store_scalar(const value& v, uint8_t* p) {
+	switch (v.type) {
+		case value_type::i64:	memcpy(p, &v.as_i64, 8); break;
+		case value_type::f64:	memcpy(p, &v.as_f64, 8); break;
+		case value_type::i32:	{ int32_t x = (int32_t)v.as_i64; memcpy(p, &x, 4); break; }
+		case value_type::u8:	*p = (uint8_t)v.as_i64; break;
+		default:				assert(false); break;
+	}
+}
+
+// Elements of an array, shared by every copy of the value. Packed as raw scalars while every element has the
+// scalar type of the first one (i64, f64, i32 or u8, so a byte array takes a byte per element), the first
+// other value stored boxes all of them.
+struct array_data {
+	value_type dense = value_type::unknown;	// Type of the packed elements, unknown while empty
+	std::vector<uint8_t> packed;
+	std::vector<value> boxed;
+	bool is_boxed = false;
+	bool read_only = false;	// Arrays of constants, shared by every read of the constant
+	i64 count = 0;
+
+	i64 size() const { return count; }
+
+	value get(i64 i) const { return is_boxed ? boxed[i] : load_scalar(dense, packed.data() + i * scalar_size(dense)); }
+
+	void set(i64 i, value v) {
+		if (!is_boxed && v.type == dense) {
+			store_scalar(v, packed.data() + i * scalar_size(dense));
+			return;
+		}
+		box();
+		boxed[i] = std::move(v);
+	}
+
+	void push(value v) {
+		if (!is_boxed && count == 0 && scalar_size(v.type) > 0) {
+			dense = v.type;
+		}
+		if (!is_boxed && v.type == dense) {
+			i64 at = (i64)packed.size();
+			packed.resize(at + scalar_size(dense));
+			store_scalar(v, packed.data() + at);
+		}
+		else {
+			box();
+			boxed.push_back(std::move(v));
+		}
+		count++;
+	}
+
+	void reserve(i64 n, value_type type) {
+		if (!is_boxed && (dense == type || count == 0)) {
+			packed.reserve(n * scalar_size(type));
+		}
+	}
+
+private:
+	void box() {
+		if (is_boxed) {
+			return;
+		}
+		boxed.reserve(count);
+		for (i64 i = 0; i < count; i++) {
+			boxed.push_back(get(i));
+		}
+		packed = {};
+		is_boxed = true;
+	}
+};
+
+// Fixed size integers for the vector builtins, zeroed and aligned for full width loads.
+struct i64_buffer {
+	static constexpr std::align_val_t alignment{ 32 };
+
+	i64* data;
+	i64 size;
+
+	explicit i64_buffer(i64 n) : data((i64*)::operator new(sizeof(i64) * std::max<i64>(n, 1), alignment)), size(n) {
+		memset(data, 0, sizeof(i64) * n);
+	}
+	~i64_buffer() { ::operator delete(data, alignment); }
+
+	i64_buffer(const i64_buffer&) = delete;
+	i64_buffer& operator=(const i64_buffer&) = delete;
+};
+
+// Rows of one object type stored member by member, each member in its own array. A row value refers to the
+// collection and an index, reading 'p.age' through it touches only the age column. The columns are laid out
+// by the first object pushed.
+struct columns_data {
+	std::string type_name;
+	std::vector<std::string> members;
+	std::vector<array_data> columns;
+	i64 rows = 0;
+
+	i64 column_index(const std::string& name) const {
+		for (i64 i = 0; i < (i64)members.size(); i++) {
+			if (members[i] == name) {
+				return i;
+			}
+		}
+		return -1;
+	}
+};
+
+value make_row(const value& cols, i64 row) {
+	return value{ .type = value_type::row, .as_i64 = row, .handle = cols.handle };
+}
+
+// Maps are keyed by i64 or string values.
+bool is_map_key(const value& v) {
+	return v.type == value_type::i64 || v.type == value_type::string;
+}
+
+// Strings reuse the hash computed by the compiler for constants, integers are mixed so sequential keys spread out.
+uint64_t hash_key(const value& key) {
+	if (key.type == value_type::string) {
+		return key.as_string.hash ? key.as_string.hash : hash_string(key.as_string.view());
+	}
+	uint64_t h = (uint64_t)key.as_i64;
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+	h ^= h >> 31;
+	return h ? h : 1;
+}
+
+bool keys_equal(const value& a, const value& b) {
+	if (a.type != b.type) {
+		return false;
+	}
+	if (a.type == value_type::i64) {
+		return a.as_i64 == b.as_i64;
+	}
+	return a.as_string.size == b.as_string.size && memcmp(a.as_string.data, b.as_string.data, (size_t)a.as_string.size) == 0;
+}
+
+// Hash map in insertion order. Entries are appended to 'entries', the open addressing index only holds their
+// hashes and positions, so a lookup probes 16 byte buckets and touches one entry. Erased entries stay behind as
+// holes until the next rehash compacts them, which waits while keys() is iterating the map.
+struct map_data {
+	static constexpr i64 empty = -1;
+	static constexpr i64 erased = -2;
+
+	struct entry {
+		value key;
+		value val;
+		uint64_t hash;
+		bool live;
+	};
+	struct bucket {
+		uint64_t hash;
+		i64 entry;	// Index into entries, 'empty' or 'erased'
+	};
+
+	std::vector<entry> entries;
+	std::vector<bucket> buckets;	// Power of two size, at most 3/4 used
+	i64 live = 0;
+	i64 used = 0;	// Buckets that aren't empty, erased ones included
+	i64 iterators = 0;
+
+	i64 size() const { return live; }
+
+	value* find(const value& key) {
+		i64 b = probe(key, hash_key(key));
+		return b < 0 ? nullptr : &entries[buckets[b].entry].val;
+	}
+
+	void insert(value key, value val) {
+		uint64_t hash = hash_key(key);
+		i64 b = probe(key, hash);
+		if (b >= 0) {
+			entries[buckets[b].entry].val = std::move(val);
+			return;
+		}
+		if ((used + 1) * 4 > (i64)buckets.size() * 3) {
+			rehash();
+		}
+		// The key isn't present, so the first erased bucket on its probe sequence can be reused.
+		size_t mask = buckets.size() - 1;
+		size_t i = hash & mask;
+		while (buckets[i].entry >= 0) {
+			i = (i + 1) & mask;
+		}
+		used += buckets[i].entry == empty;
+		buckets[i] = bucket{ .hash = hash, .entry = (i64)entries.size() };
+		entries.push_back(entry{ .key = std::move(key), .val = std::move(val), .hash = hash, .live = true });
+		live++;
+	}
+
+	bool erase(const value& key) {
+		i64 b = probe(key, hash_key(key));
+		if (b < 0) {
+			return false;
+		}
+		auto& e = entries[buckets[b].entry];
+		e = entry{ .key = {}, .val = {}, .hash = 0, .live = false };
+		buckets[b].entry = erased;
+		live--;
+		return true;
+	}
+
+private:
+	// Bucket holding 'key', -1 if there is none. There is always an empty bucket to stop at.
+	i64 probe(const value& key, uint64_t hash) const {
+		if (buckets.empty()) {
+			return -1;
+		}
+		size_t mask = buckets.size() - 1;
+		for (size_t i = hash & mask;; i = (i + 1) & mask) {
+			auto& b = buckets[i];
+			if (b.entry == empty) {
+				return -1;
+			}
+			if (b.hash == hash && b.entry >= 0 && keys_equal(entries[b.entry].key, key)) {
+				return (i64)i;
+			}
+		}
+	}
+
+	// Sized for twice the live entries, which also drops every erased bucket. Stored hashes are reused.
+	void rehash() {
+		if (iterators == 0 && live < (i64)entries.size()) {
+			std::erase_if(entries, [](const entry& e) { return !e.live; });
+		}
+		size_t capacity = 8;
+		while (capacity < (size_t)(live + 1) * 2) {
+			capacity *= 2;
+		}
+		buckets.assign(capacity, bucket{ .hash = 0, .entry = empty });
+		size_t mask = capacity - 1;
+		for (i64 e = 0; e < (i64)entries.size(); e++) {
+			if (!entries[e].live) {
+				continue;
+			}
+			size_t i = entries[e].hash & mask;
+			while (buckets[i].entry != empty) {
+				i = (i + 1) & mask;
+			}
+			buckets[i] = bucket{ .hash = entries[e].hash, .entry = e };
+		}
+		used = live;
+	}
+};
+
+// Keeps a map from compacting its entries while keys() walks them.
+struct map_iteration {
+	std::shared_ptr<map_data> map;
+
+	explicit map_iteration(std::shared_ptr<map_data> m) : map(std::move(m)) { map->iterators++; }
+	~map_iteration() { map->iterators--; }
 };
 
 struct object_data {
@@ -24,15 +368,99 @@ struct object_data {
 	std::vector<std::pair<std::string, value>> members;
 };
 
-struct eval_scope {
-	std::vector<std::pair<std::string, value>> values;
+// A suspended generator. Between resumptions its stack slots are moved out of the VM into 'slots'.
+// Builtins produce generators with a native 'next' instead, they don't run a frame.
+struct generator_data {
+	const function_proto* fn;
+	capture_list captures;
+	std::vector<value> slots;	// Locals and temporaries of the frame
+	i64 pc = 0;
+	bool running = false;
+	bool done = false;
+	std::function<bool(value&)> native;	// Sets the next value, false once exhausted
+};
+
+// Frames of script functions being executed, kept on the heap instead of the native stack.
+struct call_frame {
+	const function_proto* fn;
+	i64 pc;
+	i64 base;	// Index of the first local slot on the value stack
+	generator_data* gen = nullptr;	// Set for a resumed generator, owned by the value the consumer holds
+	capture_list captures;
+	i64 objects = 0;	// Size of eval_context::frame_objects when the frame was entered
+};
+
+enum struct run_status {
+	finished,
+	error,
+	yielded,	// Ran out of budget, calling run again resumes where it stopped
+	suspended,	// A builtin is waiting for I/O, resume once its pending_call is done
+};
+
+// Result of a builtin that suspended the script, set from whichever thread finishes the operation.
+struct pending_call {
+	std::mutex lock;
+	bool done = false;
+	value result;
+	std::vector<std::string> errors;
+	std::function<void()> on_done;
+
+	void complete(value v) { finish(std::move(v), {}); }
+	void fail(const std::string& msg) { finish(value{}, msg); }
+
+	// Runs 'f' once the call is done. Returns false without calling it if it's done already.
+	bool then(std::function<void()> f) {
+		std::lock_guard<std::mutex> l(lock);
+		if (done) {
+			return false;
+		}
+		on_done = std::move(f);
+		return true;
+	}
+
+	bool is_done() {
+		std::lock_guard<std::mutex> l(lock);
+		return done;
+	}
+
+private:
+	void finish(value v, const std::string& err) {
+		std::function<void()> f;
+		{
+			std::lock_guard<std::mutex> l(lock);
+			result = std::move(v);
+			if (!err.empty()) {
+				errors.push_back(err);
+			}
+			done = true;
+			f = std::move(on_done);
+		}
+		if (f) {
+			f();
+		}
+	}
 };
 
+// One VM instance. Everything mutable lives here, the program is shared and read only.
 struct eval_context {
-	const library* ast;
+	std::shared_ptr<const program> prog;
 	value ret_value;
-	std::vector<eval_scope> scopes;
-	std::vector<std::pair<std::string, std::function<void(eval_context&, std::vector<value> args)>>> internal_functions;
+
+	std::vector<value> stack;
+	std::vector<call_frame> frames;
+	std::vector<value> globals;
+	std::vector<value> constants;	// Of program::constants, built once per VM
+
+	i64 max_call_depth = 1 << 16;
+	i64 budget = INT64_MAX;	// Instructions left before run yields at the next loop back-edge or call
+	std::shared_ptr<pending_call> pending;	// Set by a builtin that suspends the script
+	std::vector<std::string> errors;
+
+	// Objects made by new_frame_object belong to the frame that made them, they're recycled once it returns.
+	std::vector<std::unique_ptr<object_data>> frame_objects;
+	std::vector<std::unique_ptr<object_data>> free_objects;
+
+	void error(const std::string& msg){ errors.push_back(msg); }
 };
 
 value construct_object(eval_context& ctx, const std::string& name, std::vector<std::pair<std::string, value>> values) {
@@ -43,8 +471,8 @@ value construct_object(eval_context& ctx, const std::string& name, std::vector<s
 		return values[0].second;
 	}
 	else{
-		for (auto& t : ctx.ast->object_types) {
-			if (t->as_object_type.name == name) {
+		for (auto& t : ctx.prog->object_types) {
+			if (t.name == name) {
 				value rv{};
 				rv.type = value_type::object;
 
@@ -57,8 +485,8 @@ value construct_object(eval_context& ctx, const std::string& name, std::vector<s
 					// assert(false); // No value given in initializer for 'name'
 					return value{.type = value_type::unknown};
 				};
-				for (auto& m : t->as_object_type.members) {
-					rv.as_object->members.push_back({m.name, get_value(m.name)});
+				for (auto& m : t.members) {
+					rv.as_object->members.push_back({m, get_value(m)});
 				}
 
 				return rv;
@@ -69,98 +497,107 @@ value construct_object(eval_context& ctx, const std::string& name, std::vector<s
 	return {};
 }
 
-value get_value(value& v, const std::string& name) {
-	std::string sub = name.substr(0, name.find_first_of('.'));
-	switch (v.type) {
-		case value_type::object:
-		{
-			for (auto& [member, val] : v.as_object->members) {
-				if (member == sub) {
-					if (name.find_first_of('.') != name.npos) {
-						return get_value(val, name.substr(name.find_first_of('.') + 1));
-					}
-					return val;
-				}
-			}
+// Sets every member of 'obj' from the values of an initializer that gives all of them, keeping its storage.
+void fill_object(eval_context& ctx, object_data& obj, const object_init_desc& init, std::vector<value>::iterator values) {
+	obj.type_name = init.type;
+	for (auto& t : ctx.prog->object_types) {
+		if (t.name != init.type) {
+			continue;
 		}
+		obj.members.resize(t.members.size());
+		for (i64 i = 0; i < (i64)t.members.size(); i++) {
+			i64 given = std::find(init.members.begin(), init.members.end(), t.members[i]) - init.members.begin();
+			obj.members[i].first = t.members[i];
+			obj.members[i].second = std::move(values[given]);
+		}
+		return;
 	}
-	return v;
+	assert(false);
 }
 
-value get_value(eval_context& ctx, const std::string& name) {
-	std::string sub = name.substr(0, name.find_first_of('.'));
-	for (i64 i = 0; i < ctx.scopes.size(); i++) {
-		i64 rind = ctx.scopes.size() - 1 - i;
-		auto& s = ctx.scopes[rind];
-
-		for (auto& [n, v] : s.values) {
-			if (n == sub) {
-				if (name.find_first_of('.') != name.npos) {
-					return get_value(v, name.substr(name.find_first_of('.') + 1));
-				}
-				return v;
-			}
+value* find_member(value& v, const std::string& name) {
+	if (v.type != value_type::object) {
+		return nullptr;
+	}
+	for (auto& [member, val] : v.as_object->members) {
+		if (member == name) {
+			return &val;
 		}
 	}
-	assert(false); // Couldn't find value (enums fail)
-	return {};
+	return nullptr;
+}
+
+std::string get_value_type(const value& v);
+
+// Declared handle types carry their parameter, 'gen<i64>', a value only knows its kind. Enum values are i64.
+bool value_has_type(const program& prog, const value& v, std::string_view type) {
+	auto kind = type.substr(0, type.find('<'));
+	if (v.type == value_type::i64 && kind != "i64") {
+		return std::any_of(prog.enums.begin(), prog.enums.end(), [&](const enum_def& e) { return e.name == kind; });
+	}
+	return kind == get_value_type(v);
 }
 
 std::string get_value_type(const value& v) {
 	switch (v.type) {
 		case value_type::i64:		return "i64";
+		case value_type::f64:		return "f64";
+		case value_type::i32:		return "i32";
+		case value_type::u8:		return "u8";
 		case value_type::string:	return "string";
 		case value_type::function:	return "fn";
 		case value_type::object:	return v.as_object->type_name;
+		case value_type::task:		return "task";
+		case value_type::generator:	return "gen";
+		case value_type::array:		return "array";
+		case value_type::buffer:	return "i64buf";
+		case value_type::map:		return "map";
+		case value_type::columns:	return "columns";
+		case value_type::row:		return v.as_columns()->type_name;
 	}
 	return "???";
 }
 
-void set_value(value& target, const std::string& mem, value new_v) {
-	std::string sub = mem.substr(0, mem.find_first_of('.'));
-
-	if (target.type == value_type::object) {
-		for (auto& [n, v] : target.as_object->members) {
-			if (n == sub) {
-				if (mem.find_first_of('.') != mem.npos) {
-					set_value(v, mem.substr(mem.find_first_of('.') + 1), new_v);
-				}
-				else {
-					v = new_v;
-				}
-			}
-		}
+// Members of an object or a row by name, rows read them out of their columns.
+std::vector<std::pair<std::string, value>> row_members(const value& v) {
+	if (v.type == value_type::object) {
+		return v.as_object->members;
 	}
-	else {
-		assert(false);
+	std::vector<std::pair<std::string, value>> members;
+	auto& cols = *v.as_columns();
+	for (i64 i = 0; i < (i64)cols.members.size(); i++) {
+		members.emplace_back(cols.members[i], cols.columns[i].get(v.as_i64));
 	}
+	return members;
 }
 
-void set_value(eval_context& ctx, const std::string& name, value new_v) {
-	std::string sub = name.substr(0, name.find_first_of('.'));
-	for (i64 i = 0; i < ctx.scopes.size(); i++) {
-		i64 rind = ctx.scopes.size() - 1 - i;
-		auto& s = ctx.scopes[rind];
-
-		for (auto& [n, v] : s.values) {
-			if (n == sub) {
-				if (name.find_first_of('.') != name.npos) {
-					set_value(v, name.substr(name.find_first_of('.') + 1), new_v);
-				}
-				else {
-					v = new_v;
-				}
-				return;
-			}
+// Stores an object or a row at 'row', one past the end appends it. Returns false if its type doesn't match.
+bool columns_store(columns_data& cols, i64 row, const value& v) {
+	if (v.type != value_type::object && v.type != value_type::row) {
+		return false;
+	}
+	auto members = row_members(v);
+	if (cols.type_name.empty()) {
+		cols.type_name = get_value_type(v);
+		for (auto& [name, val] : members) {
+			cols.members.push_back(name);
 		}
+		cols.columns.resize(members.size());
 	}
-	auto& last_scope = ctx.scopes[ctx.scopes.size() - 1];
-	last_scope.values.push_back({ name, new_v });
-}
-
-void init_value(eval_context& ctx, const std::string& name, value new_v) {
-	auto& s = ctx.scopes[ctx.scopes.size() - 1];
-	s.values.push_back({ name, new_v });
+	if (get_value_type(v) != cols.type_name) {
+		return false;
+	}
+	for (auto& [name, val] : members) {
+		auto& column = cols.columns[cols.column_index(name)];
+		if (row == cols.rows) {
+			column.push(std::move(val));
+		}
+		else {
+			column.set(row, std::move(val));
+		}
+	}
+	cols.rows += (row == cols.rows);
+	return true;
 }
 
 void set_rval_i64(eval_context& ctx, i64 v) {
@@ -171,380 +608,1931 @@ void set_rval_i64(eval_context& ctx, i64 v) {
 }
 
 void set_rval_str(eval_context& ctx, const std::string& v) {
-	ctx.ret_value = value{
-		.type = value_type::string,
-		.as_string = v
-	};
+	ctx.ret_value = make_string_value(v);
 }
 
-void set_value_fn(eval_context& ctx, const std::string& name, lambda* fn) {
-	set_value(ctx, name, value{
+void set_rval_fn(eval_context& ctx, const function_proto* fn) {
+	ctx.ret_value = value{
 		.type = value_type::function,
 		.as_function = fn
-	});
+	};
 }
 
-void set_value_str(eval_context& ctx, const std::string& name, const std::string& v) {
-	set_value(ctx, name, value{
-		.type = value_type::string,
-		.as_string = v
-	});
+value make_i64(i64 v) {
+	return value{
+		.type = value_type::i64,
+		.as_i64 = v
+	};
 }
 
-void set_rval_fn(eval_context& ctx, lambda* fn) {
-	ctx.ret_value = value{
-		.type = value_type::function,
-		.as_function = fn
+value make_string_value(std::string s) {
+	auto owned = std::make_shared<const std::string>(std::move(s));
+	return value{
+		.type = value_type::string,
+		.as_string = { .data = owned->data(), .size = (i64)owned->size(), .hash = 0 },
+		.handle = owned
 	};
 }
 
+// Integer results wrap to the width of their operands.
+value make_int(value_type type, i64 v) {
+	switch (type) {
+		case value_type::i32:	return make_i32((int32_t)(uint32_t)v);
+		case value_type::u8:	return make_u8((uint8_t)v);
+		default:	break;
+	}
+	return make_i64(v);
+}
+
+// Operands the generic arithmetic and comparison opcodes accept, run reports anything else.
+bool same_number_type(const value& lhs, const value& rhs) {
+	return lhs.type == rhs.type && (is_int_type(lhs.type) || lhs.type == value_type::f64);
+}
+
 value add(value lhs, value rhs) {
-	if (lhs.type == rhs.type && lhs.type == value_type::i64) {
-		return value{
-			.type = value_type::i64,
-			.as_i64 = lhs.as_i64 + rhs.as_i64
-		};
+	if (lhs.type == rhs.type && is_int_type(lhs.type)) {
+		return make_int(lhs.type, lhs.as_i64 + rhs.as_i64);
+	}
+	if (lhs.type == rhs.type && lhs.type == value_type::f64) {
+		return make_f64(lhs.as_f64 + rhs.as_f64);
 	}
 	assert(false);
 	return {};
 }
 
 value sub(value lhs, value rhs) {
-	if (lhs.type == rhs.type && lhs.type == value_type::i64) {
-		return value{
-			.type = value_type::i64,
-			.as_i64 = lhs.as_i64 - rhs.as_i64
-		};
+	if (lhs.type == rhs.type && is_int_type(lhs.type)) {
+		return make_int(lhs.type, lhs.as_i64 - rhs.as_i64);
+	}
+	if (lhs.type == rhs.type && lhs.type == value_type::f64) {
+		return make_f64(lhs.as_f64 - rhs.as_f64);
 	}
 	assert(false);
 	return {};
 }
 
 value mul(value lhs, value rhs) {
-	if (lhs.type == rhs.type && lhs.type == value_type::i64) {
-		return value{
-			.type = value_type::i64,
-			.as_i64 = lhs.as_i64 * rhs.as_i64
-		};
+	if (lhs.type == rhs.type && is_int_type(lhs.type)) {
+		return make_int(lhs.type, lhs.as_i64 * rhs.as_i64);
+	}
+	if (lhs.type == rhs.type && lhs.type == value_type::f64) {
+		return make_f64(lhs.as_f64 * rhs.as_f64);
 	}
 	assert(false);
 	return {};
 }
 
 value div(value lhs, value rhs) {
-	if (lhs.type == rhs.type && lhs.type == value_type::i64) {
+	if (lhs.type == rhs.type && is_int_type(lhs.type)) {
 		assert(rhs.as_i64 != 0);
-		return value{
-			.type = value_type::i64,
-			.as_i64 = lhs.as_i64 / rhs.as_i64
-		};
+		return make_int(lhs.type, lhs.as_i64 / rhs.as_i64);
+	}
+	if (lhs.type == rhs.type && lhs.type == value_type::f64) {
+		return make_f64(lhs.as_f64 / rhs.as_f64);
 	}
 	assert(false);
 	return {};
 }
 
-i64 evaluate(eval_context& ctx, ast_node* v) {
-	auto get_rv = [&](i64 v) {
-		return ctx.ret_value;
-	};
-	switch (v->type) {
-		case ast_node_type::number:
-		{
-			set_rval_i64(ctx, v->as_number);
-			return v->as_number;
+value compare(value lhs, value rhs, opcode op) {
+	assert(lhs.type == rhs.type && (is_int_type(lhs.type) || lhs.type == value_type::f64));
+	if (lhs.type == value_type::f64) {
+		switch (op) {
+			case opcode::cmp_eq:	return make_i64(lhs.as_f64 == rhs.as_f64);
+			case opcode::cmp_lt:	return make_i64(lhs.as_f64 < rhs.as_f64);
+			case opcode::cmp_gt:	return make_i64(lhs.as_f64 > rhs.as_f64);
+			case opcode::cmp_lte:	return make_i64(lhs.as_f64 <= rhs.as_f64);
+			case opcode::cmp_gte:	return make_i64(lhs.as_f64 >= rhs.as_f64);
+			default:	break;
 		}
-		case ast_node_type::bin_op:
-		{
-			evaluate(ctx, v->as_bin_op.lhs);
-			value lhs = ctx.ret_value;
-
-			evaluate(ctx, v->as_bin_op.rhs);
-			value rhs = ctx.ret_value;
+	}
+	switch (op) {
+		case opcode::cmp_eq:	return make_i64(lhs.as_i64 == rhs.as_i64);
+		case opcode::cmp_lt:	return make_i64(lhs.as_i64 < rhs.as_i64);
+		case opcode::cmp_gt:	return make_i64(lhs.as_i64 > rhs.as_i64);
+		case opcode::cmp_lte:	return make_i64(lhs.as_i64 <= rhs.as_i64);
+		case opcode::cmp_gte:	return make_i64(lhs.as_i64 >= rhs.as_i64);
+		default:	break;
+	}
+	assert(false);
+	return {};
+}
 
-			value res{};
-			switch (v->as_bin_op.type) {
-				case bin_op_type::add: res = add(lhs, rhs); break;
-				case bin_op_type::sub: res = sub(lhs, rhs); break;
-				case bin_op_type::mul: res = mul(lhs, rhs); break;
-				case bin_op_type::div: res = div(lhs, rhs); break;
-			}
-			ctx.ret_value = res;
-			return 0;
+// Enters 'fn' with the 'argc' arguments on top of the stack, which are dropped if it can't be entered.
+bool push_frame(eval_context& ctx, const function_proto* fn, i64 argc, capture_list captures = nullptr) {
+	if ((i64)ctx.frames.size() >= ctx.max_call_depth) {
+		ctx.error("(Runtime) Maximum call depth of " + std::to_string(ctx.max_call_depth) + " exceeded in '" + fn->name + "'.");
+		ctx.stack.resize(ctx.stack.size() - argc);
+		return false;
+	}
+	if ((i64)fn->args.size() != argc) {
+		ctx.error("(Runtime) '" + fn->name + "' takes " + std::to_string(fn->args.size()) + " arguments, called with " + std::to_string(argc) + ".");
+		ctx.stack.resize(ctx.stack.size() - argc);
+		return false;
+	}
+	i64 base = (i64)ctx.stack.size() - argc;
+	// Calls through a function value have no signature the checker could match, the i64 fast paths in the
+	// body would trust whatever they were passed.
+	for (i64 i = 0; i < argc; i++) {
+		auto& arg = ctx.stack[base + i];
+		if (fn->args[i].type && !value_has_type(*ctx.prog, arg, *fn->args[i].type)) {
+			ctx.error("(Runtime) Argument " + std::to_string(i) + " of '" + fn->name + "' is a '" + get_value_type(arg) + "', expected '" + *fn->args[i].type + "'.");
+			ctx.stack.resize(base);
+			return false;
 		}
-		case ast_node_type::sequence:
-		{
-			value rv{};
-			for (auto& e : v->as_sequence) {
-				evaluate(ctx, e);
-				rv = ctx.ret_value;
-			}
-			ctx.ret_value = rv;
-			return 0;
+	}
+	// Calling a generator function only captures the arguments, the body runs as the generator is iterated.
+	if (fn->generator) {
+		auto gen = std::make_shared<generator_data>();
+		gen->fn = fn;
+		gen->captures = std::move(captures);
+		gen->slots.assign(std::make_move_iterator(ctx.stack.begin() + base), std::make_move_iterator(ctx.stack.end()));
+		gen->slots.resize(fn->locals.size());
+		ctx.stack.resize(base);
+		ctx.stack.push_back(value{ .type = value_type::generator, .handle = gen });
+		return true;
+	}
+	ctx.stack.resize(base + fn->locals.size());
+	ctx.frames.push_back(call_frame{ .fn = fn, .pc = 0, .base = base, .gen = nullptr, .captures = std::move(captures), .objects = (i64)ctx.frame_objects.size() });
+	return true;
+}
+
+value spawn_task(eval_context& ctx, const function_proto* fn, std::vector<value> args, capture_list captures);
+
+// Drops the frames above 'stop_depth' after an error, their objects go back to the free list like on a return.
+void unwind(eval_context& ctx, i64 stop_depth) {
+	if ((i64)ctx.frames.size() > stop_depth) {
+		i64 objects = ctx.frames[stop_depth].objects;
+		for (i64 i = objects; i < (i64)ctx.frame_objects.size(); i++) {
+			ctx.free_objects.push_back(std::move(ctx.frame_objects[i]));
 		}
-		case ast_node_type::call:
-		{
-			std::vector<value> args;
-			for (auto& arg : v->as_call.args) {
-				evaluate(ctx, arg);
-				args.push_back(ctx.ret_value);
-			}
+		ctx.frame_objects.resize(objects);
+	}
+	ctx.frames.resize(stop_depth);
+}
 
-			for (auto& [name, cb] : ctx.internal_functions) {
-				if (name == v->as_call.target) {
-					cb(ctx, args);
-					return 0;
-				}
-			}
+// Runs until the frame stack unwinds to 'stop_depth' frames, the returned value is left in ctx.ret_value.
+// Script calls only push frames, so recursion in the script never recurses in here.
+// Once ctx.budget runs out it returns run_status::yielded at the next loop back-edge or call.
+run_status run(eval_context& ctx, i64 stop_depth) {
+	auto pop = [&]() {
+		value v = std::move(ctx.stack.back());
+		ctx.stack.pop_back();
+		return v;
+	};
+	auto fail = [&]() {
+		unwind(ctx, stop_depth);
+		return run_status::error;
+	};
 
-			value fn = get_value(ctx, v->as_call.target);
+	while ((i64)ctx.frames.size() > stop_depth) {
+		auto& frame = ctx.frames.back();
+		const instruction& ins = frame.fn->code[frame.pc++];
+		ctx.budget--;
 
-			ctx.scopes.push_back({});
-			init_value(ctx, "this", value{
-				.type = value_type::function,
-				.as_function = fn.as_function
-			});
-			for (i64 i = 0; i < fn.as_function->args.size(); i++) {
-				if (fn.as_function->args[i].type) {
-					assert(*fn.as_function->args[i].type == get_value_type(args[i]));
-				}
-				init_value(ctx, fn.as_function->args[i].name, args[i]);
+		switch (ins.op) {
+			case opcode::push_i64:
+			{
+				ctx.stack.push_back(make_i64(ins.a));
+				break;
 			}
-			assert(fn.as_function->args.size() == args.size()); // Passed arg count must match function signature
-			evaluate(ctx, fn.as_function->scope);
-			ctx.scopes.pop_back();
-			return 0;
-		}
-		case ast_node_type::lambda:
-		{
-			set_rval_fn(ctx, &v->as_lambda);
-			return 0;
-		}
-		case ast_node_type::assign:
-		{
-			evaluate(ctx, v->as_assign.value);
-			set_value(ctx, v->as_assign.symbol, ctx.ret_value);
-			// std::cout << v->as_assign.symbol << " = " << ctx.ret_value.as_i64 << "\n";
-			return 0;
-		}
-		case ast_node_type::initialize:
-		{
-			evaluate(ctx, v->as_initialize.value);
-			assert(v->as_initialize.symbol.type.value_or(get_value_type(ctx.ret_value)) == get_value_type(ctx.ret_value));
-			init_value(ctx, v->as_initialize.symbol.name, ctx.ret_value);
-			// std::cout << v->as_initialize.symbol.name << " := " << ctx.ret_value.as_i64 << "\n";
-			return 0;
-		}
-		case ast_node_type::symbol:
-		{
-			ctx.ret_value = get_value(ctx, v->as_symbol);
-			return 0;
-		}
-		case ast_node_type::string: 
-		{
-			set_rval_str(ctx, v->as_string);
-			return 0;
-		}
-		case ast_node_type::conditional: 
-		{
-			evaluate(ctx, v->as_if.condition);
-			value res = ctx.ret_value;
-			assert(res.type == value_type::i64);
-			if (res.as_i64 > 0) {
-				evaluate(ctx, v->as_if.scope);
+			case opcode::push_f64:
+			{
+				ctx.stack.push_back(make_f64(std::bit_cast<double>(ins.a)));
+				break;
 			}
-			else if (v->as_if.else_scope) {
-				evaluate(ctx, v->as_if.else_scope);
+			case opcode::push_i32:
+			{
+				ctx.stack.push_back(make_i32((int32_t)ins.a));
+				break;
 			}
-			return 0;
-		}
-		case ast_node_type::comparison: 
-		{
-			evaluate(ctx, v->as_comparison.lhs);
-			value lhs = ctx.ret_value;
-			evaluate(ctx, v->as_comparison.rhs);
-			value rhs = ctx.ret_value;
-
-			switch (v->as_comparison.type) {
-				case comparison_type::eq: 
-				{
-					set_rval_i64(ctx, lhs.as_i64 == rhs.as_i64);
+			case opcode::push_u8:
+			{
+				ctx.stack.push_back(make_u8((uint8_t)ins.a));
+				break;
+			}
+			case opcode::push_string:
+			{
+				auto& str = ctx.prog->strings[ins.a];
+				ctx.stack.push_back(value{ .type = value_type::string, .as_string = { .data = str.data(), .size = (i64)str.size(), .hash = ctx.prog->string_hashes[ins.a] } });
+				break;
+			}
+			case opcode::push_const:
+			{
+				ctx.stack.push_back(ctx.constants[ins.a]);
+				break;
+			}
+			case opcode::push_fn:
+			{
+				ctx.stack.push_back(value{ .type = value_type::function, .as_function = &ctx.prog->functions[ins.a] });
+				break;
+			}
+			case opcode::make_closure:
+			{
+				auto captures = std::make_shared<std::vector<value>>(std::make_move_iterator(ctx.stack.end() - ins.b), std::make_move_iterator(ctx.stack.end()));
+				ctx.stack.resize(ctx.stack.size() - ins.b);
+				ctx.stack.push_back(value{ .type = value_type::function, .as_function = &ctx.prog->functions[ins.a], .handle = std::move(captures) });
+				break;
+			}
+			case opcode::push_this:
+			{
+				ctx.stack.push_back(value{ .type = value_type::function, .as_function = frame.fn, .handle = frame.captures });
+				break;
+			}
+			case opcode::load_local:
+			{
+				ctx.stack.push_back(ctx.stack[frame.base + ins.a]);
+				break;
+			}
+			case opcode::store_local:
+			{
+				ctx.stack[frame.base + ins.a] = ctx.stack.back();
+				break;
+			}
+			case opcode::load_global:
+			{
+				ctx.stack.push_back(ctx.globals[ins.a]);
+				break;
+			}
+			case opcode::store_global:
+			{
+				ctx.globals[ins.a] = ctx.stack.back();
+				break;
+			}
+			case opcode::load_capture:
+			{
+				ctx.stack.push_back((*frame.captures)[ins.a]);
+				break;
+			}
+			case opcode::get_member:
+			{
+				value obj = pop();
+				if (obj.type == value_type::row) {
+					i64 column = obj.as_columns()->column_index(ctx.prog->strings[ins.a]);
+					if (column < 0) {
+						ctx.error("(Runtime) '" + get_value_type(obj) + "' has no member '" + ctx.prog->strings[ins.a] + "'.");
+						return fail();
+					}
+					ctx.stack.push_back(obj.as_columns()->columns[column].get(obj.as_i64));
 					break;
 				}
-				case comparison_type::lt: 
-				{
-					set_rval_i64(ctx, lhs.as_i64 < rhs.as_i64);
-					break;
+				value* m = find_member(obj, ctx.prog->strings[ins.a]);
+				if (!m) {
+					ctx.error("(Runtime) '" + get_value_type(obj) + "' has no member '" + ctx.prog->strings[ins.a] + "'.");
+					return fail();
 				}
-				case comparison_type::gt: 
-				{
-					set_rval_i64(ctx, lhs.as_i64 > rhs.as_i64);
+				ctx.stack.push_back(*m);
+				break;
+			}
+			case opcode::set_member:
+			{
+				value v = pop();
+				value obj = pop();
+				if (obj.type == value_type::row) {
+					i64 column = obj.as_columns()->column_index(ctx.prog->strings[ins.a]);
+					if (column < 0) {
+						ctx.error("(Runtime) '" + get_value_type(obj) + "' has no member '" + ctx.prog->strings[ins.a] + "'.");
+						return fail();
+					}
+					obj.as_columns()->columns[column].set(obj.as_i64, v);
+					ctx.stack.push_back(std::move(v));
 					break;
 				}
-				case comparison_type::lte: 
-				{
-					set_rval_i64(ctx, lhs.as_i64 <= rhs.as_i64);
-					break;
+				value* m = find_member(obj, ctx.prog->strings[ins.a]);
+				if (!m) {
+					ctx.error("(Runtime) '" + get_value_type(obj) + "' has no member '" + ctx.prog->strings[ins.a] + "'.");
+					return fail();
 				}
-				case comparison_type::gte: 
-				{
-					set_rval_i64(ctx, lhs.as_i64 >= rhs.as_i64);
-					break;
+				*m = v;
+				ctx.stack.push_back(v);
+				break;
+			}
+			case opcode::pop:
+			{
+				ctx.stack.pop_back();
+				break;
+			}
+			case opcode::add:
+			case opcode::sub:
+			case opcode::mul:
+			case opcode::div:
+			{
+				value rhs = pop();
+				value lhs = pop();
+				if (!same_number_type(lhs, rhs)) {
+					ctx.error("(Runtime) Arithmetic on '" + get_value_type(lhs) + "' and '" + get_value_type(rhs) + "' in '" + frame.fn->name + "'.");
+					return fail();
 				}
-				default: 
-				{
-					assert(false);
-					break;
+				if (ins.op == opcode::div && is_int_type(rhs.type) && rhs.as_i64 == 0) {
+					ctx.error("(Runtime) Division by zero in '" + frame.fn->name + "'.");
+					return fail();
+				}
+				switch (ins.op) {
+					case opcode::add: ctx.stack.push_back(add(lhs, rhs)); break;
+					case opcode::sub: ctx.stack.push_back(sub(lhs, rhs)); break;
+					case opcode::mul: ctx.stack.push_back(mul(lhs, rhs)); break;
+					case opcode::div: ctx.stack.push_back(div(lhs, rhs)); break;
+					default: assert(false); break;
 				}
+				break;
 			}
-
-			return 0;
-		}
-		case ast_node_type::function: 
+			// Operands proven to be i64 by the type checker skip the tag checks.
+			case opcode::add_i64:
+			{
+				i64 rhs = ctx.stack.back().as_i64;
+				ctx.stack.pop_back();
+				ctx.stack.back().as_i64 += rhs;
+				break;
+			}
+			case opcode::sub_i64:
+			{
+				i64 rhs = ctx.stack.back().as_i64;
+				ctx.stack.pop_back();
+				ctx.stack.back().as_i64 -= rhs;
+				break;
+			}
+			case opcode::mul_i64:
+			{
+				i64 rhs = ctx.stack.back().as_i64;
+				ctx.stack.pop_back();
+				ctx.stack.back().as_i64 *= rhs;
+				break;
+			}
+			case opcode::div_i64:
+			{
+				i64 rhs = ctx.stack.back().as_i64;
+				if (rhs == 0) {
+					ctx.error("(Runtime) Division by zero in '" + frame.fn->name + "'.");
+					return fail();
+				}
+				ctx.stack.pop_back();
+				ctx.stack.back().as_i64 /= rhs;
+				break;
+			}
+			case opcode::add_f64:
+			case opcode::sub_f64:
+			case opcode::mul_f64:
+			case opcode::div_f64:
+			{
+				double rhs = ctx.stack.back().as_f64;
+				ctx.stack.pop_back();
+				double& lhs = ctx.stack.back().as_f64;
+				switch (ins.op) {
+					case opcode::add_f64:	lhs += rhs; break;
+					case opcode::sub_f64:	lhs -= rhs; break;
+					case opcode::mul_f64:	lhs *= rhs; break;
+					case opcode::div_f64:	lhs /= rhs; break;
+					default:	assert(false); break;
+				}
+				break;
+			}
+			case opcode::wrap_i32:
+			{
+				i64& v = ctx.stack.back().as_i64;
+				v = (int32_t)(uint32_t)v;
+				break;
+			}
+			case opcode::wrap_u8:
+			{
+				ctx.stack.back().as_i64 &= 0xff;
+				break;
+			}
+			case opcode::cmp_eq:
+			case opcode::cmp_lt:
+			case opcode::cmp_gt:
+			case opcode::cmp_lte:
+			case opcode::cmp_gte:
+			{
+				value rhs = pop();
+				value lhs = pop();
+				if (!same_number_type(lhs, rhs)) {
+					ctx.error("(Runtime) Compared '" + get_value_type(lhs) + "' and '" + get_value_type(rhs) + "' in '" + frame.fn->name + "'.");
+					return fail();
+				}
+				ctx.stack.push_back(compare(lhs, rhs, ins.op));
+				break;
+			}
+			case opcode::cmp_eq_i64:
+			case opcode::cmp_lt_i64:
+			case opcode::cmp_gt_i64:
+			case opcode::cmp_lte_i64:
+			case opcode::cmp_gte_i64:
+			{
+				// Also used for i32 and u8 operands, the result is always an i64.
+				i64 rhs = ctx.stack.back().as_i64;
+				ctx.stack.pop_back();
+				ctx.stack.back().type = value_type::i64;
+				i64& lhs = ctx.stack.back().as_i64;
+				switch (ins.op) {
+					case opcode::cmp_eq_i64:	lhs = lhs == rhs; break;
+					case opcode::cmp_lt_i64:	lhs = lhs < rhs; break;
+					case opcode::cmp_gt_i64:	lhs = lhs > rhs; break;
+					case opcode::cmp_lte_i64:	lhs = lhs <= rhs; break;
+					case opcode::cmp_gte_i64:	lhs = lhs >= rhs; break;
+					default:	assert(false); break;
+				}
+				break;
+			}
+			case opcode::cmp_eq_f64:
+			case opcode::cmp_lt_f64:
+			case opcode::cmp_gt_f64:
+			case opcode::cmp_lte_f64:
+			case opcode::cmp_gte_f64:
+			{
+				double rhs = ctx.stack.back().as_f64;
+				ctx.stack.pop_back();
+				double lhs = ctx.stack.back().as_f64;
+				i64 r = 0;
+				switch (ins.op) {
+					case opcode::cmp_eq_f64:	r = lhs == rhs; break;
+					case opcode::cmp_lt_f64:	r = lhs < rhs; break;
+					case opcode::cmp_gt_f64:	r = lhs > rhs; break;
+					case opcode::cmp_lte_f64:	r = lhs <= rhs; break;
+					case opcode::cmp_gte_f64:	r = lhs >= rhs; break;
+					default:	assert(false); break;
+				}
+				ctx.stack.back() = make_i64(r);
+				break;
+			}
+			case opcode::jump:
+			{
+				bool back_edge = ins.a < frame.pc;
+				frame.pc = ins.a;
+				if (back_edge && ctx.budget <= 0) {
+					return run_status::yielded;
+				}
+				break;
+			}
+			case opcode::jump_if_false:
+			{
+				value cond = pop();
+				assert(cond.type == value_type::i64);
+				if (cond.as_i64 == 0) {
+					frame.pc = ins.a;
+				}
+				break;
+			}
+			case opcode::call:
+			{
+				if (!push_frame(ctx, &ctx.prog->functions[ins.a], ins.b)) {
+					return fail();
+				}
+				if (ctx.budget <= 0) {
+					return run_status::yielded;
+				}
+				break;
+			}
+			case opcode::call_value:
+			{
+				i64 callee = (i64)ctx.stack.size() - ins.b - 1;
+				if (ctx.stack[callee].type != value_type::function) {
+					ctx.error("(Runtime) Called a value of type '" + get_value_type(ctx.stack[callee]) + "' in '" + frame.fn->name + "'.");
+					return fail();
+				}
+				const function_proto* fn = ctx.stack[callee].as_function;
+				capture_list captures = ctx.stack[callee].shared<const std::vector<value>>();
+				ctx.stack.erase(ctx.stack.begin() + callee);
+				if (!push_frame(ctx, fn, ins.b, std::move(captures))) {
+					return fail();
+				}
+				if (ctx.budget <= 0) {
+					return run_status::yielded;
+				}
+				break;
+			}
+			case opcode::call_builtin:
+			{
+				if (!ctx.prog->natives[ins.a]) {
+					ctx.error("(Runtime) Builtin '" + ctx.prog->builtins[ins.a] + "' isn't registered.");
+					return fail();
+				}
+				std::vector<value> args(std::make_move_iterator(ctx.stack.end() - ins.b), std::make_move_iterator(ctx.stack.end()));
+				ctx.stack.resize(ctx.stack.size() - ins.b);
+				i64 error_count = (i64)ctx.errors.size();
+				ctx.prog->natives[ins.a](ctx, args);
+				if ((i64)ctx.errors.size() > error_count) {
+					return fail();
+				}
+				if (ctx.pending) {
+					return run_status::suspended;
+				}
+				ctx.stack.push_back(std::move(ctx.ret_value));
+				break;
+			}
+			case opcode::new_object:
+			{
+				auto& init = ctx.prog->object_inits[ins.a];
+				std::vector<std::pair<std::string, value>> values;
+				for (i64 i = 0; i < ins.b; i++) {
+					values.emplace_back(init.members[i], std::move(ctx.stack[ctx.stack.size() - ins.b + i]));
+				}
+				ctx.stack.resize(ctx.stack.size() - ins.b);
+				ctx.stack.push_back(construct_object(ctx, init.type, values));
+				break;
+			}
+			case opcode::new_frame_object:
+			{
+				// The local still holds the object from this site's last run, nothing else can reach it.
+				auto& init = ctx.prog->object_inits[ins.a];
+				value& local = ctx.stack[frame.base + ins.b];
+				object_data* obj = (local.type == value_type::object) ? local.as_object : nullptr;
+				if (!obj) {
+					if (ctx.free_objects.empty()) {
+						ctx.free_objects.push_back(std::make_unique<object_data>());
+					}
+					ctx.frame_objects.push_back(std::move(ctx.free_objects.back()));
+					ctx.free_objects.pop_back();
+					obj = ctx.frame_objects.back().get();
+				}
+				fill_object(ctx, *obj, init, ctx.stack.end() - init.members.size());
+				ctx.stack.resize(ctx.stack.size() - init.members.size());
+				ctx.stack.push_back(value{ .type = value_type::object, .as_object = obj });
+				break;
+			}
+			case opcode::new_array:
+			{
+				auto arr = std::make_shared<array_data>();
+				auto first = ctx.stack.end() - ins.b;
+				if (ins.b > 0) {
+					arr->reserve(ins.b, first->type);
+				}
+				for (auto it = first; it != ctx.stack.end(); it++) {
+					arr->push(std::move(*it));
+				}
+				ctx.stack.resize(ctx.stack.size() - ins.b);
+				ctx.stack.push_back(value{ .type = value_type::array, .handle = std::move(arr) });
+				break;
+			}
+			case opcode::get_index:
+			case opcode::set_index:
+			{
+				value v = (ins.op == opcode::set_index) ? pop() : value{};
+				value index = pop();
+				value arr = pop();
+				if (arr.type == value_type::map) {
+					if (!is_map_key(index)) {
+						ctx.error("(Runtime) Map key of type '" + get_value_type(index) + "' in '" + frame.fn->name + "'.");
+						return fail();
+					}
+					if (ins.op == opcode::set_index) {
+						arr.as_map()->insert(std::move(index), v);
+						ctx.stack.push_back(std::move(v));
+						break;
+					}
+					value* found = arr.as_map()->find(index);
+					if (!found) {
+						std::string key = (index.type == value_type::i64) ? std::to_string(index.as_i64) : "\"" + std::string(index.as_string.view()) + "\"";
+						ctx.error("(Runtime) Key " + key + " not in map in '" + frame.fn->name + "'.");
+						return fail();
+					}
+					ctx.stack.push_back(*found);
+					break;
+				}
+				if (arr.type != value_type::array && arr.type != value_type::buffer && arr.type != value_type::columns) {
+					ctx.error("(Runtime) Indexed a value of type '" + get_value_type(arr) + "' in '" + frame.fn->name + "'.");
+					return fail();
+				}
+				if (index.type != value_type::i64) {
+					ctx.error("(Runtime) Index of type '" + get_value_type(index) + "' in '" + frame.fn->name + "'.");
+					return fail();
+				}
+				i64 size = (arr.type == value_type::buffer) ? arr.as_buffer()->size : (arr.type == value_type::columns) ? arr.as_columns()->rows : arr.as_array()->size();
+				if (index.as_i64 < 0 || index.as_i64 >= size) {
+					ctx.error("(Runtime) Index " + std::to_string(index.as_i64) + " out of bounds for " + get_value_type(arr) + " of length " + std::to_string(size) + " in '" + frame.fn->name + "'.");
+					return fail();
+				}
+				if (arr.type == value_type::columns) {
+					if (ins.op == opcode::get_index) {
+						ctx.stack.push_back(make_row(arr, index.as_i64));
+						break;
+					}
+					if (!columns_store(*arr.as_columns(), index.as_i64, v)) {
+						ctx.error("(Runtime) Stored a value of type '" + get_value_type(v) + "' in columns of '" + arr.as_columns()->type_name + "' in '" + frame.fn->name + "'.");
+						return fail();
+					}
+					ctx.stack.push_back(std::move(v));
+				}
+				else if (arr.type == value_type::buffer) {
+					if (ins.op == opcode::get_index) {
+						ctx.stack.push_back(make_i64(arr.as_buffer()->data[index.as_i64]));
+						break;
+					}
+					if (v.type != value_type::i64) {
+						ctx.error("(Runtime) Stored a value of type '" + get_value_type(v) + "' in an i64buf in '" + frame.fn->name + "'.");
+						return fail();
+					}
+					arr.as_buffer()->data[index.as_i64] = v.as_i64;
+					ctx.stack.push_back(std::move(v));
+				}
+				else if (ins.op == opcode::set_index) {
+					if (arr.as_array()->read_only) {
+						ctx.error("(Runtime) Assigned to an element of a const array in '" + frame.fn->name + "'.");
+						return fail();
+					}
+					arr.as_array()->set(index.as_i64, v);
+					ctx.stack.push_back(std::move(v));
+				}
+				else {
+					ctx.stack.push_back(arr.as_array()->get(index.as_i64));
+				}
+				break;
+			}
+			case opcode::spawn:
+			case opcode::spawn_value:
+			{
+				std::vector<value> args(std::make_move_iterator(ctx.stack.end() - ins.b), std::make_move_iterator(ctx.stack.end()));
+				ctx.stack.resize(ctx.stack.size() - ins.b);
+				const function_proto* fn = &ctx.prog->functions[ins.a];
+				capture_list captures;
+				if (ins.op == opcode::spawn_value) {
+					value callee = pop();
+					if (callee.type != value_type::function) {
+						ctx.error("(Runtime) Spawned a value of type '" + get_value_type(callee) + "' in '" + frame.fn->name + "'.");
+						return fail();
+					}
+					fn = callee.as_function;
+					captures = callee.shared<const std::vector<value>>();
+				}
+				ctx.stack.push_back(spawn_task(ctx, fn, std::move(args), std::move(captures)));
+				break;
+			}
+			case opcode::next:
+			{
+				value gen_value = pop();
+				if (gen_value.type != value_type::generator) {
+					ctx.error("(Runtime) Iterated a value of type '" + get_value_type(gen_value) + "' in '" + frame.fn->name + "'.");
+					return fail();
+				}
+				// Kept alive by the consumer's hidden local while it runs.
+				generator_data* gen = gen_value.as_generator();
+				if (gen->done) {
+					frame.pc = ins.a;
+					break;
+				}
+				if (gen->native) {
+					value item;
+					if (gen->native(item)) {
+						ctx.stack.push_back(std::move(item));
+					}
+					else {
+						gen->done = true;
+						frame.pc = ins.a;
+					}
+					break;
+				}
+				if (gen->running) {
+					ctx.error("(Runtime) Generator '" + gen->fn->name + "' resumed while running in '" + frame.fn->name + "'.");
+					return fail();
+				}
+				if ((i64)ctx.frames.size() >= ctx.max_call_depth) {
+					ctx.error("(Runtime) Maximum call depth of " + std::to_string(ctx.max_call_depth) + " exceeded in '" + gen->fn->name + "'.");
+					return fail();
+				}
+				i64 base = (i64)ctx.stack.size();
+				ctx.stack.insert(ctx.stack.end(), std::make_move_iterator(gen->slots.begin()), std::make_move_iterator(gen->slots.end()));
+				gen->slots.clear();
+				gen->running = true;
+				ctx.frames.push_back(call_frame{ .fn = gen->fn, .pc = gen->pc, .base = base, .gen = gen, .captures = gen->captures, .objects = (i64)ctx.frame_objects.size() });
+				if (ctx.budget <= 0) {
+					return run_status::yielded;
+				}
+				break;
+			}
+			case opcode::yield:
+			{
+				assert(frame.gen); // Only generator functions contain yield
+				value v = pop();
+				generator_data* gen = frame.gen;
+				gen->pc = frame.pc;
+				gen->slots.assign(std::make_move_iterator(ctx.stack.begin() + frame.base), std::make_move_iterator(ctx.stack.end()));
+				gen->running = false;
+				ctx.stack.resize(frame.base);
+				ctx.frames.pop_back();
+				ctx.stack.push_back(std::move(v));
+				break;
+			}
+			case opcode::ret:
+			{
+				// A generator returning is exhausted, its consumer continues at the exit of its loop.
+				if (frame.gen) {
+					frame.gen->done = true;
+					frame.gen->running = false;
+					ctx.stack.resize(frame.base);
+					ctx.frames.pop_back();
+					auto& consumer = ctx.frames.back();
+					consumer.pc = consumer.fn->code[consumer.pc - 1].a;
+					break;
+				}
+				ctx.ret_value = pop();
+				ctx.stack.resize(frame.base);
+				for (i64 i = frame.objects; i < (i64)ctx.frame_objects.size(); i++) {
+					ctx.free_objects.push_back(std::move(ctx.frame_objects[i]));
+				}
+				ctx.frame_objects.resize(frame.objects);
+				ctx.frames.pop_back();
+				if ((i64)ctx.frames.size() > stop_depth) {
+					ctx.stack.push_back(ctx.ret_value);
+				}
+				break;
+			}
+			default:
+			{
+				assert(false);
+				return fail();
+			}
+		}
+	}
+	return run_status::finished;
+}
+
+// Continues a script suspended by a builtin once its pending call is done, the builtin's result is pushed first.
+run_status resume(eval_context& ctx, i64 stop_depth) {
+	auto call = std::move(ctx.pending);
+	if (!call->errors.empty()) {
+		ctx.errors.insert(ctx.errors.end(), call->errors.begin(), call->errors.end());
+		unwind(ctx, stop_depth);
+		return run_status::error;
+	}
+	ctx.stack.push_back(std::move(call->result));
+	return run(ctx, stop_depth);
+}
+
+// Calls a script function from native code, the result is left in ctx.ret_value.
+// The native caller needs the result right away, so the call isn't preempted. While a builtin is suspended the
+// thread runs other queued jobs, like join, so a task waiting on I/O doesn't take its worker out of the pool.
+// A call still running after 'budget' instructions is unwound and returns run_status::yielded.
+run_status call_function(eval_context& ctx, const function_proto* fn, const std::vector<value>& args, capture_list captures = nullptr, i64 budget = INT64_MAX) {
+	i64 depth = (i64)ctx.frames.size();
+	for (auto& a : args) {
+		ctx.stack.push_back(a);
+	}
+	if (!push_frame(ctx, fn, (i64)args.size(), std::move(captures))) {
+		return run_status::error;
+	}
+	if (fn->generator) {
+		ctx.ret_value = std::move(ctx.stack.back());
+		ctx.stack.pop_back();
+		return run_status::finished;
+	}
+	i64 outer_budget = std::exchange(ctx.budget, budget);
+	run_status status = run(ctx, depth);
+	while (status == run_status::suspended) {
+		// Tasks run meanwhile may use this VM too, the call is put back once they're done with it.
+		auto call = std::move(ctx.pending);
+		call->then([]() { default_thread_pool().wake_helpers(); });
+		default_thread_pool().help_until([&]() { return call->is_done(); });
+		ctx.pending = std::move(call);
+		status = resume(ctx, depth);
+	}
+	if (status == run_status::yielded) {
+		unwind(ctx, depth);
+	}
+	ctx.budget = outer_budget;
+	return status;
+}
+
+const function_proto* find_function(eval_context& ctx, const std::string& name) {
+	for (auto& g : ctx.prog->globals) {
+		if (g.name == name && g.function >= 0) {
+			return &ctx.prog->functions[g.function];
+		}
+	}
+	return nullptr;
+}
+
+eval_context make_context(std::shared_ptr<const program> prog);
+
+// A function call running on the thread pool. Written by the worker that runs it, read once 'done' is set.
+struct task_data {
+	std::shared_ptr<const program> prog;
+	const function_proto* fn;
+	std::vector<value> args;
+	capture_list captures;
+
+	value result;
+	std::vector<std::string> errors;
+	std::atomic<bool> done = false;
+};
+
+// Tasks run on the VM their thread keeps for the program, a task joining another may run further tasks on it.
+// While no task runs on it the VM only refers to its program weakly, so idle workers never keep a finished
+// program alive. VMs of programs that are gone are dropped the next time the thread looks for one.
+class task_context {
+public:
+	explicit task_context(const std::shared_ptr<const program>& prog) {
+		auto& cache = cached_vms();
+		std::erase_if(cache, [](const std::unique_ptr<cached_vm>& c) { return c->users == 0 && c->prog.expired(); });
+		auto it = std::find_if(cache.begin(), cache.end(), [&](const std::unique_ptr<cached_vm>& c) {
+			return !c->prog.owner_before(prog) && !prog.owner_before(c->prog);
+		});
+		if (it == cache.end()) {
+			cache.push_back(std::make_unique<cached_vm>(cached_vm{ .prog = prog, .ctx = make_context(prog), .users = 0 }));
+			it = cache.end() - 1;
+		}
+		mVM = it->get();
+		if (mVM->users++ == 0) {
+			mVM->ctx.prog = prog;
+		}
+	}
+	~task_context() {
+		if (--mVM->users == 0) {
+			mVM->ctx.prog.reset();
+			mVM->ctx.ret_value = {};
+		}
+	}
+	task_context(const task_context&) = delete;
+	task_context& operator=(const task_context&) = delete;
+
+	eval_context& ctx() { return mVM->ctx; }
+
+private:
+	struct cached_vm {
+		std::weak_ptr<const program> prog;
+		eval_context ctx;
+		i64 users = 0;	// Tasks running on it, nested when one joins another
+	};
+
+	static std::vector<std::unique_ptr<cached_vm>>& cached_vms() {
+		thread_local std::vector<std::unique_ptr<cached_vm>> vms;
+		return vms;
+	}
+
+	cached_vm* mVM;
+};
+
+void run_task(task_data& task) {
+	task_context vm(task.prog);
+	eval_context& ctx = vm.ctx();
+	i64 error_count = (i64)ctx.errors.size();
+	if (call_function(ctx, task.fn, task.args, task.captures) == run_status::finished) {
+		task.result = ctx.ret_value;
+	}
+	else {
+		task.errors.assign(ctx.errors.begin() + error_count, ctx.errors.end());
+		ctx.errors.resize(error_count);
+	}
+	task.args.clear();
+	task.captures.reset();
+	task.done.store(true);
+}
+
+value spawn_task(eval_context& ctx, const function_proto* fn, std::vector<value> args, capture_list captures) {
+	auto task = std::make_shared<task_data>();
+	task->prog = ctx.prog;
+	task->fn = fn;
+	task->args = std::move(args);
+	task->captures = std::move(captures);
+	default_thread_pool().submit([task]() { run_task(*task); });
+	return value{ .type = value_type::task, .handle = task };
+}
+
+// Waits for a task by running other queued tasks on this thread, so fork-join recursion never blocks a worker.
+void builtin_join(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() != 1 || vals[0].type != value_type::task) {
+		ctx.error("(Runtime) 'join' expects a task.");
+		return;
+	}
+	auto& task = *vals[0].as_task();
+	default_thread_pool().help_until([&]() { return task.done.load(); });
+	if (!task.errors.empty()) {
+		ctx.errors.insert(ctx.errors.end(), task.errors.begin(), task.errors.end());
+		return;
+	}
+	ctx.ret_value = task.result;
+}
+
+enum struct reduce_op {
+	none,
+	sum,
+	min,
+	max,
+};
+
+// Calls fn(i) for every i in [lo, hi). The range is split into chunks run on the thread pool, each worker calls
+// 'fn' on the VM its thread keeps for the program. Chunk results are combined in chunk order, so reductions
+// and the reported error don't depend on scheduling.
+void parallel_range(eval_context& ctx, const std::vector<value>& vals, reduce_op op, const std::string& name) {
+	if (vals.size() != 3 || vals[0].type != value_type::i64 || vals[1].type != value_type::i64 || vals[2].type != value_type::function) {
+		ctx.error("(Runtime) '" + name + "' expects (i64, i64, fn).");
+		return;
+	}
+	constexpr i64 chunks_per_worker = 4;
+	constexpr i64 min_chunk_size = 256;
+
+	i64 lo = vals[0].as_i64;
+	i64 count = std::max<i64>(vals[1].as_i64 - lo, 0);
+	const function_proto* fn = vals[2].as_function;
+	capture_list captures = vals[2].shared<const std::vector<value>>();
+	i64 chunks = std::min(default_thread_pool().size() * chunks_per_worker, (count + min_chunk_size - 1) / min_chunk_size);
+
+	struct chunk_result {
+		i64 value;
+		std::vector<std::string> errors;
+	};
+	std::vector<chunk_result> results(chunks);
+
+	default_thread_pool().run(chunks, [&](i64 c) {
+		task_context worker(ctx.prog);
+		eval_context& vm = worker.ctx();
+		auto& result = results[c];
+		result.value = (op == reduce_op::min) ? INT64_MAX : (op == reduce_op::max) ? INT64_MIN : 0;
+
+		for (i64 i = lo + count * c / chunks; i < lo + count * (c + 1) / chunks; i++) {
+			i64 error_count = (i64)vm.errors.size();
+			if (call_function(vm, fn, { make_i64(i) }, captures) != run_status::finished) {
+				result.errors.assign(vm.errors.begin() + error_count, vm.errors.end());
+				vm.errors.resize(error_count);
+				return;
+			}
+			if (op == reduce_op::none) {
+				continue;
+			}
+			if (vm.ret_value.type != value_type::i64) {
+				result.errors.push_back("(Runtime) '" + name + "' body returned '" + get_value_type(vm.ret_value) + "', expected 'i64'.");
+				return;
+			}
+			i64 v = vm.ret_value.as_i64;
+			switch (op) {
+				case reduce_op::sum: result.value += v; break;
+				case reduce_op::min: result.value = std::min(result.value, v); break;
+				case reduce_op::max: result.value = std::max(result.value, v); break;
+				default: break;
+			}
+		}
+	});
+
+	i64 total = (op == reduce_op::min) ? INT64_MAX : (op == reduce_op::max) ? INT64_MIN : 0;
+	for (auto& r : results) {
+		if (!r.errors.empty()) {
+			ctx.errors.insert(ctx.errors.end(), r.errors.begin(), r.errors.end());
+			return;
+		}
+		switch (op) {
+			case reduce_op::sum: total += r.value; break;
+			case reduce_op::min: total = std::min(total, r.value); break;
+			case reduce_op::max: total = std::max(total, r.value); break;
+			default: break;
+		}
+	}
+	set_rval_i64(ctx, op == reduce_op::none ? 0 : total);
+}
+
+void builtin_parallel_for(eval_context& ctx, std::vector<value> vals) { parallel_range(ctx, vals, reduce_op::none, "parallel_for"); }
+void builtin_parallel_sum(eval_context& ctx, std::vector<value> vals) { parallel_range(ctx, vals, reduce_op::sum, "parallel_sum"); }
+void builtin_parallel_min(eval_context& ctx, std::vector<value> vals) { parallel_range(ctx, vals, reduce_op::min, "parallel_min"); }
+void builtin_parallel_max(eval_context& ctx, std::vector<value> vals) { parallel_range(ctx, vals, reduce_op::max, "parallel_max"); }
+
+// Provides the implementation of a builtin the program calls, before the program is shared with any VM.
+void register_internal_function(program& prog, const std::string& name, internal_function fn) {
+	prog.natives.resize(prog.builtins.size());
+	for (i64 i = 0; i < (i64)prog.builtins.size(); i++) {
+		if (prog.builtins[i] == name) {
+			prog.natives[i] = fn;
+		}
+	}
+}
+
+void print_value(const value& v) {
+	switch (v.type) {
+		case value_type::string:
 		{
-			set_value_fn(ctx, v->as_function.symbol, &v->as_function.lambda->as_lambda);
-			return 0;
+			std::cout << v.as_string.view();
+			break;
 		}
-		case ast_node_type::object_init: 
+		case value_type::i64:
+		case value_type::i32:
+		case value_type::u8:
 		{
-			std::vector<std::pair<std::string, value>> values;
-			for (auto& [n, v] : v->as_object_init.initial_values) {
-				evaluate(ctx, v);
-				values.emplace_back(n, ctx.ret_value);
+			std::cout << v.as_i64;
+			break;
+		}
+		case value_type::f64:
+		{
+			// Shortest text that reads back as the same double.
+			char buf[32];
+			auto end = std::to_chars(buf, buf + sizeof(buf), v.as_f64).ptr;
+			std::cout << std::string_view(buf, end - buf);
+			break;
+		}
+		case value_type::object:
+		case value_type::row:
+		{
+			std::cout << get_value_type(v) << " { ";
+			bool is_first = true;
+			for (auto& [name, val] : row_members(v)) {
+				if (!is_first) {
+					std::cout << " , ";
+				}
+				is_first = false;
+				std::cout << "." << name << " = ";
+				print_value(val);
 			}
-			
-			value rv = construct_object(ctx, v->as_object_init.type, values);
-			ctx.ret_value = rv;
-			return 0;
+			std::cout << " }";
+			break;
 		}
-		case ast_node_type::loop:
+		case value_type::columns:
 		{
-			switch (v->as_loop.type) {
-				case loop_type::loop_while: 
-				{
-					while (true) {
-						evaluate(ctx, v->as_loop.condition);
-						value rhs = ctx.ret_value;
-						if (rhs.as_i64 == 0) {
-							break;
-						}
-						ctx.scopes.push_back({});
-						evaluate(ctx, v->as_loop.scope);
-						ctx.scopes.pop_back();
-					}
-					return 0;
+			std::cout << "[";
+			for (i64 i = 0; i < v.as_columns()->rows; i++) {
+				std::cout << (i > 0 ? ", " : "");
+				print_value(make_row(v, i));
+			}
+			std::cout << "]";
+			break;
+		}
+		case value_type::map:
+		{
+			std::cout << "{";
+			bool is_first = true;
+			for (auto& e : v.as_map()->entries) {
+				if (!e.live) {
+					continue;
 				}
-				default:
-				{
-					assert(false); // Unknown loop type
-					return 0;
+				std::cout << (is_first ? "" : ", ");
+				is_first = false;
+				print_value(e.key);
+				std::cout << ": ";
+				print_value(e.val);
+			}
+			std::cout << "}";
+			break;
+		}
+		case value_type::buffer:
+		{
+			std::cout << "[";
+			for (i64 i = 0; i < v.as_buffer()->size; i++) {
+				std::cout << (i > 0 ? ", " : "") << v.as_buffer()->data[i];
+			}
+			std::cout << "]";
+			break;
+		}
+		case value_type::array:
+		{
+			std::cout << "[";
+			for (i64 i = 0; i < v.as_array()->size(); i++) {
+				if (i > 0) {
+					std::cout << ", ";
 				}
+				print_value(v.as_array()->get(i));
 			}
-
-			return 0;
+			std::cout << "]";
+			break;
 		}
-		default: 
+		default:
 		{
-			assert(false);
-			return 0;
+			std::cout << "[unknown]";
+			break;
 		}
 	}
-	return 0;
 }
 
-lambda* find_function(eval_context& ctx, const std::string& name) {
-	for (auto& [n, v] : ctx.scopes[0].values) {
-		if (n == name) {
-			assert(v.type == value_type::function);
-			return v.as_function;
+void builtin_print(eval_context& ctx, std::vector<value> vals) {
+	for (auto& v : vals) {
+		print_value(v);
+	}
+	set_rval_i64(ctx, 0);
+}
+
+void builtin_println(eval_context& ctx, std::vector<value> vals) {
+	builtin_print(ctx, vals);
+	std::cout << "\n";
+}
+
+void builtin_len(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() == 1 && vals[0].type == value_type::array) {
+		ctx.ret_value = make_i64(vals[0].as_array()->size());
+		return;
+	}
+	if (vals.size() == 1 && vals[0].type == value_type::buffer) {
+		ctx.ret_value = make_i64(vals[0].as_buffer()->size);
+		return;
+	}
+	if (vals.size() == 1 && vals[0].type == value_type::map) {
+		ctx.ret_value = make_i64(vals[0].as_map()->size());
+		return;
+	}
+	if (vals.size() == 1 && vals[0].type == value_type::columns) {
+		ctx.ret_value = make_i64(vals[0].as_columns()->rows);
+		return;
+	}
+	if (vals.size() != 1 || vals[0].type != value_type::string) {
+		ctx.error("(Runtime) 'len' expects a string, an array, an i64buf, a map or columns.");
+		return;
+	}
+	ctx.ret_value = make_i64(vals[0].as_string.size);
+}
+
+// Appends to the array in place, every copy of the value sees the new element. Returns the new length.
+void builtin_push(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() == 2 && vals[0].type == value_type::columns) {
+		auto& cols = *vals[0].as_columns();
+		if (!columns_store(cols, cols.rows, vals[1])) {
+			std::string target = cols.type_name.empty() ? "columns" : "columns of '" + cols.type_name + "'";
+			ctx.error("(Runtime) Pushed a value of type '" + get_value_type(vals[1]) + "' to " + target + ".");
+			return;
 		}
+		ctx.ret_value = make_i64(cols.rows);
+		return;
 	}
-	return nullptr;
+	if (vals.size() != 2 || vals[0].type != value_type::array) {
+		ctx.error("(Runtime) 'push' expects an array or columns.");
+		return;
+	}
+	if (vals[0].as_array()->read_only) {
+		ctx.error("(Runtime) 'push' can't change a const array.");
+		return;
+	}
+	vals[0].as_array()->push(std::move(vals[1]));
+	ctx.ret_value = make_i64(vals[0].as_array()->size());
 }
 
-void register_internal_function(eval_context& ctx, const std::string& name, std::function<void(eval_context&, std::vector<value>)> fn) {
-	ctx.internal_functions.push_back({name, fn});
+// Called by a builtin that finishes later. The script stops once the builtin returns, the returned call
+// is completed with the builtin's result from whichever thread finishes the operation.
+std::shared_ptr<pending_call> suspend(eval_context& ctx) {
+	ctx.pending = std::make_shared<pending_call>();
+	return ctx.pending;
 }
 
-i64 evaluate(const library& lib) {
-	eval_context ctx{};
-	ctx.ast = &lib;
-
-	std::function<void(eval_context&, std::vector<value>)> print = [&print](eval_context& ctx, std::vector<value> vals) {
-		bool first = true;
-		for (auto& v : vals) {
-			if (!first) {
-				std::cout << " ";
-			}
-			first = true;
-			switch (v.type) {
-				case value_type::string: 
-				{
-					std::cout << v.as_string;
-					break;
-				}
-				case value_type::i64: 
-				{
-					std::cout << v.as_i64;
-					break;
-				}
-				case value_type::object:
-				{
-					print(ctx, {value{.type = value_type::string, .as_string = v.as_object->type_name + " { "}});
-					bool is_first = true;
-					for (auto& [name, val] : v.as_object->members) {
-						if (!is_first) {
-							print(ctx, {value{.type = value_type::string, .as_string = " , "}});
-						}
-						is_first = false;
-						print(ctx, {value{.type = value_type::string, .as_string = "." + name + " = "}, val});
-					}
-					print(ctx, {value{.type = value_type::string, .as_string = " }"}});
-					break;
-				}
-				default:
-				{
-					std::cout << "[unknown]";
-					break;
-				}
+std::string io_error(i64 res) {
+	return std::strerror((int)-res);
+}
+
+// Lines read ahead of the script, one reader per fd shared by every script reading it.
+struct fd_reader {
+	int fd;
+	std::mutex lock;
+	std::string buffered;
+	bool eof = false;
+	bool busy = false;	// A read_line is waiting on the fd
+	std::vector<char> chunk = std::vector<char>(64 * 1024);
+
+	// A line with its '\n', the rest of the input at the end of the file, empty once it's all read.
+	std::optional<std::string> take_line() {
+		i64 nl = buffered.find('\n');
+		if (nl == (i64)buffered.npos && !eof) {
+			return {};
+		}
+		i64 len = (nl == (i64)buffered.npos) ? (i64)buffered.size() : nl + 1;
+		std::string line = buffered.substr(0, len);
+		buffered.erase(0, len);
+		return line;
+	}
+};
+
+struct fd_reader_table {
+	std::mutex lock;
+	std::unordered_map<int, std::shared_ptr<fd_reader>> readers;
+};
+
+fd_reader_table& fd_readers() {
+	static fd_reader_table table;
+	return table;
+}
+
+std::shared_ptr<fd_reader> fd_reader_for(int fd) {
+	auto& table = fd_readers();
+	std::lock_guard<std::mutex> lock(table.lock);
+	auto& reader = table.readers[fd];
+	if (!reader) {
+		reader = std::make_shared<fd_reader>();
+		reader->fd = fd;
+	}
+	return reader;
+}
+
+void read_until_line(std::shared_ptr<fd_reader> reader, std::shared_ptr<pending_call> call) {
+	default_io_loop().submit_read(reader->fd, reader->chunk.data(), (i64)reader->chunk.size(), [reader, call](i64 n) {
+		std::unique_lock<std::mutex> lock(reader->lock);
+		if (n < 0) {
+			reader->busy = false;
+			lock.unlock();
+			call->fail("(Runtime) 'read_line' failed on fd " + std::to_string(reader->fd) + ": " + io_error(n));
+			return;
+		}
+		if (n == 0) {
+			reader->eof = true;
+		}
+		reader->buffered.append(reader->chunk.data(), (size_t)n);
+		if (auto line = reader->take_line()) {
+			reader->busy = false;
+			lock.unlock();
+			call->complete(make_string_value(std::move(*line)));
+			return;
+		}
+		lock.unlock();
+		read_until_line(reader, call);
+	});
+}
+
+// read_line(fd) returns the next line with its '\n', or "" at the end of the input.
+void builtin_read_line(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() != 1 || vals[0].type != value_type::i64) {
+		ctx.error("(Runtime) 'read_line' expects an fd.");
+		return;
+	}
+	auto reader = fd_reader_for((int)vals[0].as_i64);
+	{
+		std::lock_guard<std::mutex> lock(reader->lock);
+		if (reader->busy) {
+			ctx.error("(Runtime) 'read_line' is already waiting on fd " + std::to_string(reader->fd) + ".");
+			return;
+		}
+		// Lines read ahead don't need to wait.
+		if (auto line = reader->take_line()) {
+			ctx.ret_value = make_string_value(std::move(*line));
+			return;
+		}
+		reader->busy = true;
+	}
+	read_until_line(reader, suspend(ctx));
+}
+
+struct file_read {
+	std::string path;
+	int fd;
+	std::string data;
+};
+
+void read_to_end(std::shared_ptr<file_read> file, std::shared_ptr<pending_call> call) {
+	constexpr i64 chunk_size = 256 * 1024;
+	i64 used = (i64)file->data.size();
+	file->data.resize(used + chunk_size);
+	default_io_loop().submit_read(file->fd, file->data.data() + used, chunk_size, [file, call, used](i64 n) {
+		file->data.resize(used + std::max<i64>(n, 0));
+		if (n > 0) {
+			read_to_end(file, call);
+			return;
+		}
+		io_close(file->fd);
+		if (n < 0) {
+			call->fail("(Runtime) 'read_file' failed on '" + file->path + "': " + io_error(n));
+			return;
+		}
+		call->complete(make_string_value(std::move(file->data)));
+	});
+}
+
+// read_file(path) returns the whole file.
+void builtin_read_file(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() != 1 || vals[0].type != value_type::string) {
+		ctx.error("(Runtime) 'read_file' expects a path.");
+		return;
+	}
+	auto file = std::make_shared<file_read>();
+	file->path = std::string(vals[0].as_string.view());
+	auto call = suspend(ctx);
+	default_io_loop().submit_open(file->path, O_RDONLY, [file, call](i64 fd) {
+		if (fd < 0) {
+			call->fail("(Runtime) Can't open '" + file->path + "': " + io_error(fd));
+			return;
+		}
+		file->fd = (int)fd;
+		read_to_end(file, call);
+	});
+}
+
+void write_all(int fd, value str, i64 written, std::shared_ptr<pending_call> call) {
+	default_io_loop().submit_write(fd, str.as_string.data + written, str.as_string.size - written, [fd, str, written, call](i64 n) {
+		if (n < 0) {
+			call->fail("(Runtime) 'write' failed on fd " + std::to_string(fd) + ": " + io_error(n));
+		}
+		else if (written + n < str.as_string.size) {
+			write_all(fd, str, written + n, call);
+		}
+		else {
+			call->complete(make_i64(str.as_string.size));
+		}
+	});
+}
+
+// write(fd, str) returns the number of bytes written.
+void builtin_write(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() != 2 || vals[0].type != value_type::i64 || vals[1].type != value_type::string) {
+		ctx.error("(Runtime) 'write' expects an fd and a string.");
+		return;
+	}
+	int fd = (int)vals[0].as_i64;
+	// Keeps the output of print and write in order.
+	if (fd == 1 || fd == 2) {
+		std::cout.flush();
+	}
+	if (vals[1].as_string.size == 0) {
+		ctx.ret_value = make_i64(0);
+		return;
+	}
+	write_all(fd, vals[1], 0, suspend(ctx));
+}
+
+// open(path, mode) returns an fd. Modes are "r", "w" (truncates) and "a".
+void builtin_open(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() != 2 || vals[0].type != value_type::string || vals[1].type != value_type::string) {
+		ctx.error("(Runtime) 'open' expects a path and a mode.");
+		return;
+	}
+	auto mode = vals[1].as_string.view();
+	int flags = 0;
+	if (mode == "r") flags = O_RDONLY;
+	else if (mode == "w") flags = O_WRONLY | O_CREAT | O_TRUNC;
+	else if (mode == "a") flags = O_WRONLY | O_CREAT | O_APPEND;
+	else {
+		ctx.error("(Runtime) Unknown mode '" + std::string(mode) + "' passed to 'open'.");
+		return;
+	}
+	std::string path(vals[0].as_string.view());
+	auto call = suspend(ctx);
+	default_io_loop().submit_open(path, flags, [path, call](i64 fd) {
+		if (fd < 0) {
+			call->fail("(Runtime) Can't open '" + path + "': " + io_error(fd));
+			return;
+		}
+		call->complete(make_i64(fd));
+	});
+}
+
+void builtin_close(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() != 1 || vals[0].type != value_type::i64) {
+		ctx.error("(Runtime) 'close' expects an fd.");
+		return;
+	}
+	int fd = (int)vals[0].as_i64;
+	{
+		auto& table = fd_readers();
+		std::lock_guard<std::mutex> lock(table.lock);
+		table.readers.erase(fd);
+	}
+	if (io_close(fd) != 0) {
+		ctx.error("(Runtime) Can't close fd " + std::to_string(fd) + ".");
+		return;
+	}
+	ctx.ret_value = make_i64(0);
+}
+
+value make_native_generator(std::function<bool(value&)> next) {
+	auto gen = std::make_shared<generator_data>();
+	gen->fn = nullptr;
+	gen->native = std::move(next);
+	return value{ .type = value_type::generator, .handle = gen };
+}
+
+// A read only view of a whole file. Strings sliced out of it keep it alive through their owner.
+struct file_mapping {
+	const char* data = nullptr;
+	i64 size = 0;
+#if defined(_WIN32)
+	std::string contents;	// No mapping, the file is read in
+#else
+	~file_mapping() {
+		if (size > 0) {
+			munmap((void*)data, (size_t)size);
+		}
+	}
+#endif
+};
+
+std::shared_ptr<file_mapping> map_file(const std::string& path, std::string& error) {
+	auto mapping = std::make_shared<file_mapping>();
+#if defined(_WIN32)
+	std::ifstream fs(path, std::ios::binary);
+	if (!fs) {
+		error = "can't open the file";
+		return nullptr;
+	}
+	mapping->contents.assign(std::istreambuf_iterator<char>(fs), std::istreambuf_iterator<char>());
+	mapping->data = mapping->contents.data();
+	mapping->size = (i64)mapping->contents.size();
+#else
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		error = std::strerror(errno);
+		return nullptr;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		error = std::strerror(errno);
+		close(fd);
+		return nullptr;
+	}
+	// Empty files can't be mapped, there are no lines to point into anyway.
+	if (st.st_size > 0) {
+		void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			error = std::strerror(errno);
+			close(fd);
+			return nullptr;
+		}
+		madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+		mapping->data = (const char*)data;
+		mapping->size = (i64)st.st_size;
+	}
+	close(fd);
+#endif
+	return mapping;
+}
+
+// lines(path) yields every line of the file without its '\n'. Lines are slices of the mapped file, nothing is copied.
+void builtin_lines(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() != 1 || vals[0].type != value_type::string) {
+		ctx.error("(Runtime) 'lines' expects a path.");
+		return;
+	}
+	std::string path(vals[0].as_string.view());
+	std::string error;
+	auto mapping = map_file(path, error);
+	if (!mapping) {
+		ctx.error("(Runtime) Can't map '" + path + "': " + error + ".");
+		return;
+	}
+	ctx.ret_value = make_native_generator([mapping, pos = (i64)0](value& out) mutable {
+		if (pos >= mapping->size) {
+			return false;
+		}
+		const char* start = mapping->data + pos;
+		const char* nl = (const char*)memchr(start, '\n', (size_t)(mapping->size - pos));
+		i64 len = nl ? nl - start : mapping->size - pos;
+		pos += len + 1;
+		out = value{ .type = value_type::string, .as_string = { .data = start, .size = len, .hash = 0 }, .handle = mapping };
+		return true;
+	});
+}
+
+// split(str, sep) yields the parts of 'str' between separators as slices of it.
+void builtin_split(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() != 2 || vals[0].type != value_type::string || vals[1].type != value_type::string || vals[1].as_string.size == 0) {
+		ctx.error("(Runtime) 'split' expects a string and a non-empty separator.");
+		return;
+	}
+	ctx.ret_value = make_native_generator([owner = vals[0].handle, str = vals[0].as_string, sep = std::string(vals[1].as_string.view()), pos = (i64)0](value& out) mutable {
+		if (pos > str.size) {
+			return false;
+		}
+		i64 at = (i64)str.view().find(sep, (size_t)pos);
+		i64 end = (at == (i64)std::string_view::npos) ? str.size : at;
+		out = value{ .type = value_type::string, .as_string = { .data = str.data + pos, .size = end - pos, .hash = 0 }, .handle = owner };
+		pos = (at == (i64)std::string_view::npos) ? str.size + 1 : at + (i64)sep.size();
+		return true;
+	});
+}
+
+// Numeric conversions, integers wrap to the target width and f64 truncates toward zero. to_i64 and to_f64
+// also parse strings.
+void convert_number(eval_context& ctx, const std::vector<value>& vals, value_type target, const std::string& name) {
+	if (vals.size() != 1 || !(is_int_type(vals[0].type) || vals[0].type == value_type::f64 || vals[0].type == value_type::string)) {
+		ctx.error("(Runtime) '" + name + "' expects a number or a string.");
+		return;
+	}
+	auto& v = vals[0];
+	if (v.type == value_type::string) {
+		auto& str = v.as_string;
+		i64 i = 0;
+		double d = 0;
+		auto [end, ec] = (target == value_type::f64) ? std::from_chars(str.data, str.data + str.size, d) : std::from_chars(str.data, str.data + str.size, i);
+		if (ec != std::errc() || end != str.data + str.size || target == value_type::i32 || target == value_type::u8) {
+			ctx.error("(Runtime) '" + name + "' can't parse '" + std::string(str.view()) + "'.");
+			return;
+		}
+		ctx.ret_value = (target == value_type::f64) ? make_f64(d) : make_i64(i);
+		return;
+	}
+	if (target == value_type::f64) {
+		ctx.ret_value = make_f64(v.type == value_type::f64 ? v.as_f64 : (double)v.as_i64);
+		return;
+	}
+	i64 i = v.as_i64;
+	if (v.type == value_type::f64) {
+		if (!(v.as_f64 > -9.3e18 && v.as_f64 < 9.3e18)) {
+			ctx.error("(Runtime) '" + name + "' can't convert " + std::to_string(v.as_f64) + ".");
+			return;
+		}
+		i = (i64)v.as_f64;
+	}
+	ctx.ret_value = make_int(target, i);
+}
+
+void builtin_to_i64(eval_context& ctx, std::vector<value> vals) { convert_number(ctx, vals, value_type::i64, "to_i64"); }
+void builtin_to_f64(eval_context& ctx, std::vector<value> vals) { convert_number(ctx, vals, value_type::f64, "to_f64"); }
+void builtin_to_i32(eval_context& ctx, std::vector<value> vals) { convert_number(ctx, vals, value_type::i32, "to_i32"); }
+void builtin_to_u8(eval_context& ctx, std::vector<value> vals) { convert_number(ctx, vals, value_type::u8, "to_u8"); }
+
+value make_buffer(std::shared_ptr<i64_buffer> buf) {
+	return value{ .type = value_type::buffer, .handle = std::move(buf) };
+}
+
+// Checks the arguments of a buffer builtin, 'types' has a 'b' for every i64buf and an 'i' for every i64.
+bool check_buffer_args(eval_context& ctx, const std::vector<value>& vals, const std::string& types, const std::string& name) {
+	bool ok = vals.size() == types.size();
+	for (i64 i = 0; ok && i < (i64)types.size(); i++) {
+		ok = vals[i].type == (types[i] == 'b' ? value_type::buffer : value_type::i64);
+	}
+	if (!ok) {
+		ctx.error("(Runtime) Invalid arguments to '" + name + "'.");
+	}
+	return ok;
+}
+
+bool check_same_length(eval_context& ctx, const i64_buffer& a, const i64_buffer& b, const std::string& name) {
+	if (a.size != b.size) {
+		ctx.error("(Runtime) '" + name + "' expects buffers of the same length, got " + std::to_string(a.size) + " and " + std::to_string(b.size) + ".");
+		return false;
+	}
+	return true;
+}
+
+void builtin_buf_new(eval_context& ctx, std::vector<value> vals) {
+	if (!check_buffer_args(ctx, vals, "i", "buf_new")) return;
+	if (vals[0].as_i64 < 0) {
+		ctx.error("(Runtime) 'buf_new' got a negative length " + std::to_string(vals[0].as_i64) + ".");
+		return;
+	}
+	ctx.ret_value = make_buffer(std::make_shared<i64_buffer>(vals[0].as_i64));
+}
+
+void builtin_sum(eval_context& ctx, std::vector<value> vals) {
+	if (!check_buffer_args(ctx, vals, "b", "sum")) return;
+	ctx.ret_value = make_i64(simd().sum(vals[0].as_buffer()->data, vals[0].as_buffer()->size));
+}
+
+void buffer_min_max(eval_context& ctx, const std::vector<value>& vals, bool is_min) {
+	const char* name = is_min ? "min" : "max";
+	if (!check_buffer_args(ctx, vals, "b", name)) return;
+	auto& buf = *vals[0].as_buffer();
+	if (buf.size == 0) {
+		ctx.error(std::string("(Runtime) '") + name + "' of an empty buffer.");
+		return;
+	}
+	ctx.ret_value = make_i64(is_min ? simd().min(buf.data, buf.size) : simd().max(buf.data, buf.size));
+}
+
+void builtin_min(eval_context& ctx, std::vector<value> vals) { buffer_min_max(ctx, vals, true); }
+void builtin_max(eval_context& ctx, std::vector<value> vals) { buffer_min_max(ctx, vals, false); }
+
+void builtin_dot(eval_context& ctx, std::vector<value> vals) {
+	if (!check_buffer_args(ctx, vals, "bb", "dot") || !check_same_length(ctx, *vals[0].as_buffer(), *vals[1].as_buffer(), "dot")) return;
+	ctx.ret_value = make_i64(simd().dot(vals[0].as_buffer()->data, vals[1].as_buffer()->data, vals[0].as_buffer()->size));
+}
+
+// Elementwise operations write into the first buffer and return it.
+void builtin_add(eval_context& ctx, std::vector<value> vals) {
+	if (!check_buffer_args(ctx, vals, "bb", "add") || !check_same_length(ctx, *vals[0].as_buffer(), *vals[1].as_buffer(), "add")) return;
+	simd().add(vals[0].as_buffer()->data, vals[1].as_buffer()->data, vals[0].as_buffer()->size);
+	ctx.ret_value = vals[0];
+}
+
+void builtin_mul(eval_context& ctx, std::vector<value> vals) {
+	if (!check_buffer_args(ctx, vals, "bb", "mul") || !check_same_length(ctx, *vals[0].as_buffer(), *vals[1].as_buffer(), "mul")) return;
+	simd().mul(vals[0].as_buffer()->data, vals[1].as_buffer()->data, vals[0].as_buffer()->size);
+	ctx.ret_value = vals[0];
+}
+
+void builtin_fill(eval_context& ctx, std::vector<value> vals) {
+	if (!check_buffer_args(ctx, vals, "bi", "fill")) return;
+	simd().fill(vals[0].as_buffer()->data, vals[0].as_buffer()->size, vals[1].as_i64);
+	ctx.ret_value = vals[0];
+}
+
+void builtin_find(eval_context& ctx, std::vector<value> vals) {
+	if (!check_buffer_args(ctx, vals, "bi", "find")) return;
+	ctx.ret_value = make_i64(simd().find(vals[0].as_buffer()->data, vals[0].as_buffer()->size, vals[1].as_i64));
+}
+
+void builtin_map_new(eval_context& ctx, std::vector<value> vals) {
+	ctx.ret_value = value{ .type = value_type::map, .handle = std::make_shared<map_data>() };
+}
+
+bool check_map_args(eval_context& ctx, const std::vector<value>& vals, i64 count, const std::string& name) {
+	if ((i64)vals.size() != count || vals[0].type != value_type::map || (count == 2 && !is_map_key(vals[1]))) {
+		ctx.error("(Runtime) '" + name + "' expects a map" + (count == 2 ? " and a key." : "."));
+		return false;
+	}
+	return true;
+}
+
+void builtin_has(eval_context& ctx, std::vector<value> vals) {
+	if (!check_map_args(ctx, vals, 2, "has")) return;
+	ctx.ret_value = make_i64(vals[0].as_map()->find(vals[1]) != nullptr);
+}
+
+// Returns 1 if the key was present.
+void builtin_erase(eval_context& ctx, std::vector<value> vals) {
+	if (!check_map_args(ctx, vals, 2, "erase")) return;
+	ctx.ret_value = make_i64(vals[0].as_map()->erase(vals[1]));
+}
+
+// Keys in insertion order. Keys added while iterating are visited too, erased ones are skipped.
+void builtin_keys(eval_context& ctx, std::vector<value> vals) {
+	if (!check_map_args(ctx, vals, 1, "keys")) return;
+	auto it = std::make_shared<map_iteration>(vals[0].shared<map_data>());
+	ctx.ret_value = make_native_generator([it, pos = (i64)0](value& out) mutable {
+		auto& entries = it->map->entries;
+		while (pos < (i64)entries.size() && !entries[pos].live) {
+			pos++;
+		}
+		if (pos == (i64)entries.size()) {
+			return false;
+		}
+		out = entries[pos++].key;
+		return true;
+	});
+}
+
+void builtin_columns_new(eval_context& ctx, std::vector<value> vals) {
+	ctx.ret_value = value{ .type = value_type::columns, .handle = std::make_shared<columns_data>() };
+}
+
+// Rows that exist when it's called, rows pushed while iterating aren't visited.
+void builtin_rows(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() != 1 || vals[0].type != value_type::columns) {
+		ctx.error("(Runtime) 'rows' expects columns.");
+		return;
+	}
+	ctx.ret_value = make_native_generator([cols = vals[0], end = vals[0].as_columns()->rows, row = (i64)0](value& out) mutable {
+		if (row == end) {
+			return false;
+		}
+		out = make_row(cols, row++);
+		return true;
+	});
+}
+
+// Copies an i64 member into a buffer for the vector builtins.
+void builtin_column(eval_context& ctx, std::vector<value> vals) {
+	if (vals.size() != 2 || vals[0].type != value_type::columns || vals[1].type != value_type::string) {
+		ctx.error("(Runtime) 'column' expects columns and a member name.");
+		return;
+	}
+	auto& cols = *vals[0].as_columns();
+	std::string name(vals[1].as_string.view());
+	i64 index = cols.column_index(name);
+	auto buf = std::make_shared<i64_buffer>(cols.rows);
+	if (cols.rows > 0 && (index < 0 || cols.columns[index].is_boxed || cols.columns[index].dense != value_type::i64)) {
+		ctx.error("(Runtime) 'column': '" + name + "' isn't an i64 member of '" + cols.type_name + "'.");
+		return;
+	}
+	if (cols.rows > 0) {
+		memcpy(buf->data, cols.columns[index].packed.data(), sizeof(i64) * cols.rows);
+	}
+	ctx.ret_value = make_buffer(std::move(buf));
+}
+
+// Links the standard builtins and freezes the program so it can be shared between VMs.
+std::shared_ptr<const program> load_program(program prog) {
+	register_internal_function(prog, "print", builtin_print);
+	register_internal_function(prog, "println", builtin_println);
+	register_internal_function(prog, "join", builtin_join);
+	register_internal_function(prog, "parallel_for", builtin_parallel_for);
+	register_internal_function(prog, "parallel_sum", builtin_parallel_sum);
+	register_internal_function(prog, "parallel_min", builtin_parallel_min);
+	register_internal_function(prog, "parallel_max", builtin_parallel_max);
+	register_internal_function(prog, "len", builtin_len);
+	register_internal_function(prog, "read_line", builtin_read_line);
+	register_internal_function(prog, "read_file", builtin_read_file);
+	register_internal_function(prog, "write", builtin_write);
+	register_internal_function(prog, "open", builtin_open);
+	register_internal_function(prog, "close", builtin_close);
+	register_internal_function(prog, "lines", builtin_lines);
+	register_internal_function(prog, "split", builtin_split);
+	register_internal_function(prog, "to_i64", builtin_to_i64);
+	register_internal_function(prog, "to_f64", builtin_to_f64);
+	register_internal_function(prog, "to_i32", builtin_to_i32);
+	register_internal_function(prog, "to_u8", builtin_to_u8);
+	register_internal_function(prog, "push", builtin_push);
+	register_internal_function(prog, "buf_new", builtin_buf_new);
+	register_internal_function(prog, "sum", builtin_sum);
+	register_internal_function(prog, "min", builtin_min);
+	register_internal_function(prog, "max", builtin_max);
+	register_internal_function(prog, "dot", builtin_dot);
+	register_internal_function(prog, "add", builtin_add);
+	register_internal_function(prog, "mul", builtin_mul);
+	register_internal_function(prog, "fill", builtin_fill);
+	register_internal_function(prog, "find", builtin_find);
+	register_internal_function(prog, "map_new", builtin_map_new);
+	register_internal_function(prog, "has", builtin_has);
+	register_internal_function(prog, "erase", builtin_erase);
+	register_internal_function(prog, "keys", builtin_keys);
+	register_internal_function(prog, "columns_new", builtin_columns_new);
+	register_internal_function(prog, "rows", builtin_rows);
+	register_internal_function(prog, "column", builtin_column);
+	return std::make_shared<const program>(std::move(prog));
+}
+
+// Every builtin the program calls has an implementation. Only a damaged cache names one that doesn't exist.
+bool natives_linked(const program& prog) {
+	return prog.natives.size() == prog.builtins.size() && std::all_of(prog.natives.begin(), prog.natives.end(), [](const internal_function& f) { return (bool)f; });
+}
+
+// The value of an evaluated constant, built like its push instructions would. Arrays are copied per VM.
+value constant_value(const program& prog, const constant_decl& c) {
+	auto element = [&](i64 operand) {
+		switch (c.push) {
+			case opcode::push_i64:	return make_i64(operand);
+			case opcode::push_f64:	return make_f64(std::bit_cast<double>(operand));
+			case opcode::push_i32:	return make_i32((int32_t)operand);
+			case opcode::push_u8:	return make_u8((uint8_t)operand);
+			case opcode::push_string:
+			{
+				auto& str = prog.strings[operand];
+				return value{ .type = value_type::string, .as_string = { .data = str.data(), .size = (i64)str.size(), .hash = prog.string_hashes[operand] } };
 			}
+			default:	break;
 		}
-		set_rval_i64(ctx, 0);
+		return value{};
 	};
-	register_internal_function(ctx, "print", print);
-	register_internal_function(ctx, "println", [&print](eval_context& ctx, std::vector<value> vals) {
-		print(ctx, vals);
-		print(ctx, {value{.type = value_type::string, .as_string = "\n"}});
-	});
+	if (!c.is_array) {
+		return c.operands.empty() ? value{} : element(c.operands[0]);
+	}
+	auto arr = std::make_shared<array_data>();
+	for (auto operand : c.operands) {
+		arr->push(element(operand));
+	}
+	arr->read_only = true;
+	return value{ .type = value_type::array, .handle = std::move(arr) };
+}
+
+// Creates an independent VM instance for a loaded program.
+eval_context make_context(std::shared_ptr<const program> prog) {
+	eval_context ctx{};
+	ctx.prog = prog;
 
 	auto add_enum = [&](const enum_def& ed) {
 		value v;
 		v.type = value_type::object;
 		v.as_object = new object_data{};
-		
+
 		v.as_object->type_name = ed.name;
 		i64 i = 0;
 		for (auto& n : ed.values) {
-			value iv{ 
-				.type = value_type::i64, 
-				.as_i64 = i++ 
+			value iv{
+				.type = value_type::i64,
+				.as_i64 = i++
 			};
 			v.as_object->members.push_back({n, iv});
 		}
-		ctx.scopes[0].values.push_back({ed.name, v});
+		return v;
 	};
 
-	ctx.scopes.push_back({});
-	for (auto obj : lib.object_types) {
-		if (obj->type == ast_node_type::enum_def) {
-			add_enum(obj->as_enum_def);
+	for (auto& g : prog->globals) {
+		if (g.function >= 0) {
+			ctx.globals.push_back(value{ .type = value_type::function, .as_function = &prog->functions[g.function] });
+		}
+		else {
+			ctx.globals.push_back(add_enum(prog->enums[g.enum_type]));
 		}
 	}
-	for (auto& fn : lib.functions) {
-		evaluate(ctx, fn);
+	for (auto& c : prog->constants) {
+		ctx.constants.push_back(constant_value(*prog, c));
+	}
+	return ctx;
+}
+
+// The push instruction recreating a scalar or string, strings are added to the program.
+std::optional<std::pair<opcode, i64>> constant_operand(program& prog, const value& v) {
+	switch (v.type) {
+		case value_type::i64:	return std::pair{ opcode::push_i64, v.as_i64 };
+		case value_type::f64:	return std::pair{ opcode::push_f64, std::bit_cast<i64>(v.as_f64) };
+		case value_type::i32:	return std::pair{ opcode::push_i32, v.as_i64 };
+		case value_type::u8:	return std::pair{ opcode::push_u8, v.as_i64 };
+		case value_type::string:
+		{
+			prog.strings.push_back(std::string(v.as_string.view()));
+			prog.string_hashes.push_back(hash_string(v.as_string.view()));
+			return std::pair{ opcode::push_string, (i64)prog.strings.size() - 1 };
+		}
+		default:	break;
+	}
+	return std::nullopt;
+}
+
+// Runs every const initializer once, after the constants it reads, and stores the results in the program.
+// VMs then only load them, nothing is computed again at run time. An initializer running longer than
+// 'const_instruction_limit' instructions is an error, so one that never ends can't hang the compiler.
+constexpr i64 const_instruction_limit = 100'000'000;
+
+std::vector<std::string> evaluate_constants(program& prog) {
+	std::vector<std::string> errors;
+	if (prog.constants.empty()) {
+		return errors;
+	}
+	auto snapshot = load_program(prog);
+	eval_context vm = make_context(snapshot);
+
+	// Constants read by a function and by every function it can reach.
+	auto reads = [&](i64 fn) {
+		std::vector<i64> consts;
+		std::unordered_set<i64> seen{ fn };
+		std::vector<i64> todo{ fn };
+		while (!todo.empty()) {
+			auto& code = snapshot->functions[todo.back()].code;
+			todo.pop_back();
+			for (auto& ins : code) {
+				i64 target = -1;
+				switch (ins.op) {
+					case opcode::push_const:	consts.push_back(ins.a); break;
+					case opcode::call:
+					case opcode::spawn:
+					case opcode::push_fn:
+					case opcode::make_closure:	target = ins.a; break;
+					case opcode::load_global:	target = snapshot->globals[ins.a].function; break;
+					default:	break;
+				}
+				if (target >= 0 && seen.insert(target).second) {
+					todo.push_back(target);
+				}
+			}
+		}
+		return consts;
+	};
+
+	enum struct state { pending, running, done };
+	std::vector<state> states(prog.constants.size(), state::pending);
+	std::function<void(i64)> evaluate = [&](i64 i) {
+		auto& c = prog.constants[i];
+		if (states[i] == state::running) {
+			errors.push_back("(Const) '" + c.name + "' depends on its own value.");
+		}
+		if (states[i] != state::pending) {
+			return;
+		}
+		states[i] = state::running;
+		for (i64 dep : reads(c.init)) {
+			evaluate(dep);
+		}
+		states[i] = state::done;
+		if (!errors.empty()) {
+			return;
+		}
+
+		run_status status = call_function(vm, &snapshot->functions[c.init], {}, nullptr, const_instruction_limit);
+		if (status == run_status::yielded) {
+			errors.push_back("(Const) '" + c.name + "' didn't finish within " + std::to_string(const_instruction_limit) + " instructions.");
+			return;
+		}
+		if (status != run_status::finished) {
+			errors.insert(errors.end(), vm.errors.begin(), vm.errors.end());
+			errors.push_back("(Const) '" + c.name + "' failed while it was computed.");
+			return;
+		}
+		value v = vm.ret_value;
+		vm.constants[i] = v;
+
+		bool stored = true;
+		if (v.type == value_type::array) {
+			c.is_array = true;
+			v.as_array()->read_only = true;	// Later initializers read it too
+			for (i64 e = 0; stored && e < v.as_array()->size(); e++) {
+				auto operand = constant_operand(prog, v.as_array()->get(e));
+				stored = operand && (e == 0 || operand->first == c.push);
+				if (stored) {
+					c.push = operand->first;
+					c.operands.push_back(operand->second);
+				}
+			}
+		}
+		else if (auto operand = constant_operand(prog, v)) {
+			c.push = operand->first;
+			c.operands.push_back(operand->second);
+		}
+		else {
+			stored = false;
+		}
+		if (!stored) {
+			errors.push_back("(Const) '" + c.name + "' is a '" + get_value_type(v) + "', only numbers, strings and arrays of one of them can be constants.");
+		}
+	};
+	for (i64 i = 0; i < (i64)prog.constants.size(); i++) {
+		evaluate(i);
 	}
+	return errors;
+}
 
-	evaluate(ctx, find_function(ctx, "main")->scope);
+// Runs 'main'. A script with an 'init' function passes its result to 'main', 'state' is that result when it
+// comes from a snapshot instead.
+std::pair<i64, std::vector<std::string>> evaluate(eval_context& ctx, std::optional<value> state = std::nullopt) {
+	ctx.errors.clear();
+
+	auto main_fn = find_function(ctx, "main");
+	if (!main_fn) {
+		return { -1, { "(Runtime) No 'main' function." } };
+	}
+	auto init_fn = find_function(ctx, "init");
+	if (!state && init_fn) {
+		if (!init_fn->args.empty()) {
+			return { -1, { "(Runtime) 'init' can't take arguments." } };
+		}
+		if (call_function(ctx, init_fn, {}) != run_status::finished) {
+			return { -1, ctx.errors };
+		}
+		state = std::move(ctx.ret_value);
+	}
+	std::vector<value> args;
+	if (state) {
+		args.push_back(std::move(*state));
+	}
+	if (main_fn->args.size() != args.size()) {
+		return { -1, { state ? "(Runtime) 'main' has to take the result of 'init' as its argument." : "(Runtime) 'main' can't take arguments without an 'init' function." } };
+	}
+	if (call_function(ctx, main_fn, args) != run_status::finished) {
+		return { -1, ctx.errors };
+	}
 	assert(ctx.ret_value.type == value_type::i64);
 
-	return ctx.ret_value.as_i64;
-}
\ No newline at end of file
+	return { ctx.ret_value.as_i64, {} };
+}